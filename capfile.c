@@ -0,0 +1,430 @@
+/*
+ * pcap/pcapng writer, see capfile.h.
+ *
+ * The ring holds one record per packet: a fixed header followed by the
+ * packet bytes, padded to 8. Indexes only grow and are masked into the
+ * ring; head is stored only by the capture thread and tail only by the
+ * writer, each with release order so the other side sees complete
+ * records. A record that would run past the end of the ring starts at
+ * offset 0 instead, and the gap is marked so the writer skips it.
+ *
+ * With O_DIRECT every write() must be a multiple of DIRECT_ALIGN from an
+ * aligned buffer. The writer keeps to that by only writing whole buffers
+ * or the aligned part of one; the unaligned tail of a file is written
+ * after turning O_DIRECT off for that descriptor.
+ */
+
+#define _GNU_SOURCE
+#include "capfile.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <time.h>
+
+#define DIRECT_ALIGN 4096
+#define RING_MIN (1 << 20)
+#define WRAP_MARK UINT32_MAX
+
+#define PCAP_MAGIC 0xa1b2c3d4
+#define PCAPNG_SHB 0x0a0d0d0a
+#define PCAPNG_IDB 0x00000001
+#define PCAPNG_EPB 0x00000006
+#define PCAPNG_BYTE_ORDER 0x1a2b3c4d
+
+struct record {
+    int64_t sec;
+    uint32_t usec;
+    uint32_t caplen;            // WRAP_MARK for the gap before a wrap
+    uint32_t len;
+    uint32_t pad;
+};
+
+struct capfile {
+    struct capfile_config config;
+    char path[4096];
+
+    // Ring. Producer and consumer fields sit on separate cache lines.
+    uint8_t *ring;
+    uint64_t mask;
+    uint64_t head __attribute__((aligned(64)));
+    uint64_t cached_tail;       // Last tail the producer saw
+    unsigned long long queued;
+    unsigned long long dropped;
+    uint64_t tail __attribute__((aligned(64)));
+    int stopping;
+
+    // Writer thread state
+    pthread_t thread;
+    int fd;
+    uint8_t *buf;
+    size_t buf_len;
+    unsigned long long file_bytes;
+    int64_t file_start;         // Timestamp of the first packet, -1 before it
+    time_t last_flush;
+    unsigned long long written;
+    unsigned long long bytes;
+    unsigned files;
+    int failed;
+};
+
+enum capfile_format capfile_format_of(const char *path) {
+    const char *ext = strrchr(path, '.');
+    return ext && strcasecmp(ext, ".pcapng") == 0 ? CAPFILE_PCAPNG : CAPFILE_PCAP;
+}
+
+/* Report the first I/O error; after it the writer discards packets */
+static void writer_failed(struct capfile *c, const char *what) {
+    if (!c->failed) {
+        fprintf(stderr, "Capture file %s: %s: %s, discarding packets\n", c->path, what, strerror(errno));
+    }
+    __atomic_store_n(&c->failed, 1, __ATOMIC_RELAXED);
+    c->buf_len = 0;
+}
+
+/* Write the first len bytes of the buffer and keep the rest */
+static void write_out(struct capfile *c, size_t len) {
+    size_t done = 0;
+
+    while (done < len && !c->failed) {
+        ssize_t n = write(c->fd, c->buf + done, len - done);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            writer_failed(c, "write");
+            return;
+        }
+        done += n;
+    }
+    memmove(c->buf, c->buf + len, c->buf_len - len);
+    c->buf_len -= len;
+    c->last_flush = time(NULL);
+}
+
+/* Write what can be written now; final also writes the unaligned tail */
+static void flush_buffer(struct capfile *c, int final) {
+    size_t len = c->config.direct ? c->buf_len & ~(size_t)(DIRECT_ALIGN - 1) : c->buf_len;
+
+    if (len > 0) {
+        write_out(c, len);
+    }
+    if (final && c->buf_len > 0 && !c->failed) {
+        fcntl(c->fd, F_SETFL, fcntl(c->fd, F_GETFL) & ~O_DIRECT);
+        write_out(c, c->buf_len);
+    }
+}
+
+/* Copy bytes into the buffer, writing it out each time it fills */
+static void append(struct capfile *c, const void *data, size_t len) {
+    const uint8_t *p = data;
+
+    __atomic_store_n(&c->bytes, c->bytes + len, __ATOMIC_RELAXED);
+    c->file_bytes += len;
+    if (c->failed) {
+        return;
+    }
+    while (len > 0) {
+        size_t n = CAPFILE_WRITE_BUFFER - c->buf_len;
+        if (n > len) {
+            n = len;
+        }
+        memcpy(c->buf + c->buf_len, p, n);
+        c->buf_len += n;
+        p += n;
+        len -= n;
+        if (c->buf_len == CAPFILE_WRITE_BUFFER) {
+            flush_buffer(c, 0);
+        }
+    }
+}
+
+static void put16(uint8_t *block, size_t *n, uint16_t v) {
+    memcpy(block + *n, &v, sizeof(v));
+    *n += sizeof(v);
+}
+
+static void put32(uint8_t *block, size_t *n, uint32_t v) {
+    memcpy(block + *n, &v, sizeof(v));
+    *n += sizeof(v);
+}
+
+/* pcap global header, or pcapng section header and interface block */
+static void write_file_header(struct capfile *c) {
+    uint8_t block[256];
+    size_t n = 0;
+
+    if (c->config.format == CAPFILE_PCAP) {
+        put32(block, &n, PCAP_MAGIC);
+        put16(block, &n, 2);
+        put16(block, &n, 4);
+        put32(block, &n, 0);    // thiszone
+        put32(block, &n, 0);    // sigfigs
+        put32(block, &n, c->config.snaplen);
+        put32(block, &n, c->config.linktype);
+        append(c, block, n);
+        return;
+    }
+
+    put32(block, &n, PCAPNG_SHB);
+    put32(block, &n, 28);
+    put32(block, &n, PCAPNG_BYTE_ORDER);
+    put16(block, &n, 1);
+    put16(block, &n, 0);
+    put32(block, &n, 0xffffffff);  // Section length unknown
+    put32(block, &n, 0xffffffff);
+    put32(block, &n, 28);
+
+    // if_name option, padded to 4, then opt_endofopt
+    const char *name = c->config.ifname ? c->config.ifname : "";
+    size_t name_len = strnlen(name, 64);
+    size_t option_len = name_len ? 4 + ((name_len + 3) & ~(size_t)3) : 0;
+    uint32_t total = 20 + option_len + 4;
+    put32(block, &n, PCAPNG_IDB);
+    put32(block, &n, total);
+    put16(block, &n, c->config.linktype);
+    put16(block, &n, 0);
+    put32(block, &n, c->config.snaplen);
+    if (name_len) {
+        put16(block, &n, 2);
+        put16(block, &n, name_len);
+        memset(block + n, 0, option_len - 4);
+        memcpy(block + n, name, name_len);
+        n += option_len - 4;
+    }
+    put32(block, &n, 0);
+    put32(block, &n, total);
+    append(c, block, n);
+}
+
+static void write_packet(struct capfile *c, const struct record *r) {
+    const uint8_t *data = (const uint8_t *)(r + 1);
+    uint8_t block[32];
+    size_t n = 0;
+
+    if (c->config.format == CAPFILE_PCAP) {
+        put32(block, &n, r->sec);
+        put32(block, &n, r->usec);
+        put32(block, &n, r->caplen);
+        put32(block, &n, r->len);
+        append(c, block, n);
+        append(c, data, r->caplen);
+    } else {
+        static const uint8_t zero[4];
+        uint32_t padded = (r->caplen + 3) & ~3u;
+        uint64_t ts = (uint64_t)r->sec * 1000000 + r->usec;
+        put32(block, &n, PCAPNG_EPB);
+        put32(block, &n, 32 + padded);
+        put32(block, &n, 0);    // Interface 0
+        put32(block, &n, ts >> 32);
+        put32(block, &n, ts);
+        put32(block, &n, r->caplen);
+        put32(block, &n, r->len);
+        append(c, block, n);
+        append(c, data, r->caplen);
+        append(c, zero, padded - r->caplen);
+        n = 0;
+        put32(block, &n, 32 + padded);
+        append(c, block, n);
+    }
+    __atomic_store_n(&c->written, c->written + 1, __ATOMIC_RELAXED);
+}
+
+/* Open the next file; rotated files get a sequence number before the
+ * extension so they sort in capture order */
+static int open_file(struct capfile *c) {
+    const char *path = c->config.path;
+    int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+    if (c->config.rotate_bytes || c->config.rotate_seconds) {
+        const char *slash = strrchr(path, '/');
+        const char *ext = strrchr(slash ? slash : path, '.');
+        int stem = ext ? (int)(ext - path) : (int)strlen(path);
+        snprintf(c->path, sizeof(c->path), "%.*s-%05u%s", stem, path, c->files + 1, ext ? ext : "");
+    } else {
+        snprintf(c->path, sizeof(c->path), "%s", path);
+    }
+
+    // Captures hold other people's traffic; keep them private
+    c->fd = open(c->path, flags | (c->config.direct ? O_DIRECT : 0), 0600);
+    if (c->fd < 0 && c->config.direct && errno == EINVAL) {
+        fprintf(stderr, "O_DIRECT not supported for %s, using buffered writes\n", c->path);
+        c->config.direct = 0;
+        c->fd = open(c->path, flags, 0600);
+    }
+    if (c->fd < 0) {
+        return -1;
+    }
+    __atomic_store_n(&c->files, c->files + 1, __ATOMIC_RELAXED);
+    c->file_bytes = 0;
+    c->file_start = -1;
+    write_file_header(c);
+    return 0;
+}
+
+static void close_file(struct capfile *c) {
+    if (c->fd >= 0) {
+        flush_buffer(c, 1);
+        close(c->fd);
+        c->fd = -1;
+    }
+}
+
+static void rotate_if_due(struct capfile *c, const struct record *r) {
+    if (c->file_start < 0) {
+        c->file_start = r->sec;
+    }
+    if ((c->config.rotate_bytes && c->file_bytes >= c->config.rotate_bytes) ||
+        (c->config.rotate_seconds && r->sec - c->file_start >= c->config.rotate_seconds)) {
+        close_file(c);
+        if (!c->failed && open_file(c) != 0) {
+            writer_failed(c, "open");
+        }
+        c->file_start = r->sec;
+    }
+}
+
+static void *capfile_writer(void *arg) {
+    struct capfile *c = arg;
+    uint64_t size = c->mask + 1;
+    struct timespec idle = { 0, 1000000 };
+
+    for (;;) {
+        uint64_t head = __atomic_load_n(&c->head, __ATOMIC_ACQUIRE);
+        if (c->tail == head) {
+            if (__atomic_load_n(&c->stopping, __ATOMIC_ACQUIRE) &&
+                c->tail == __atomic_load_n(&c->head, __ATOMIC_ACQUIRE)) {
+                break;
+            }
+            // Slow traffic still reaches the disk within the flush interval
+            if (c->buf_len > 0 && time(NULL) - c->last_flush >= CAPFILE_FLUSH_INTERVAL) {
+                flush_buffer(c, 0);
+            }
+            nanosleep(&idle, NULL);
+            continue;
+        }
+        while (c->tail != head) {
+            uint64_t pos = c->tail & c->mask;
+            const struct record *r = (const struct record *)(c->ring + pos);
+            uint64_t used;
+
+            if (size - pos < sizeof(struct record) || r->caplen == WRAP_MARK) {
+                used = size - pos;
+            } else {
+                if (!c->failed) {
+                    rotate_if_due(c, r);
+                    write_packet(c, r);
+                }
+                used = (sizeof(struct record) + r->caplen + 7) & ~(uint64_t)7;
+            }
+            __atomic_store_n(&c->tail, c->tail + used, __ATOMIC_RELEASE);
+        }
+    }
+    close_file(c);
+    return NULL;
+}
+
+static void free_capfile(struct capfile *c) {
+    free(c->ring);
+    free(c->buf);
+    free(c);
+}
+
+struct capfile *capfile_open(const struct capfile_config *config, char *errbuf, size_t errlen) {
+    struct capfile *c = calloc(1, sizeof(*c));
+    size_t size = RING_MIN;
+
+    if (!c) {
+        snprintf(errbuf, errlen, "Out of memory");
+        return NULL;
+    }
+    c->config = *config;
+    while (size < config->ring_size) {
+        size <<= 1;
+    }
+    c->mask = size - 1;
+    c->ring = malloc(size);
+    if (!c->ring || posix_memalign((void **)&c->buf, DIRECT_ALIGN, CAPFILE_WRITE_BUFFER) != 0) {
+        snprintf(errbuf, errlen, "Out of memory");
+        c->buf = NULL;
+        free_capfile(c);
+        return NULL;
+    }
+    c->fd = -1;
+    c->last_flush = time(NULL);
+    if (open_file(c) != 0) {
+        snprintf(errbuf, errlen, "%s: %s", c->path, strerror(errno));
+        free_capfile(c);
+        return NULL;
+    }
+
+    // Signals belong to the capture thread, not the writer
+    sigset_t all, old;
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    int rc = pthread_create(&c->thread, NULL, capfile_writer, c);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+    if (rc != 0) {
+        snprintf(errbuf, errlen, "Couldn't start the writer thread");
+        close_file(c);
+        free_capfile(c);
+        return NULL;
+    }
+    return c;
+}
+
+int capfile_write(struct capfile *c, const struct pcap_pkthdr *header, const u_char *packet) {
+    uint32_t caplen = header->caplen < (uint32_t)c->config.snaplen ? header->caplen : (uint32_t)c->config.snaplen;
+    uint64_t need = (sizeof(struct record) + caplen + 7) & ~(uint64_t)7;
+    uint64_t size = c->mask + 1;
+    uint64_t head = c->head;
+    uint64_t pos = head & c->mask;
+    uint64_t skip = size - pos < need ? size - pos : 0;
+
+    // Only look at the writer's tail when the cached one says full
+    if (head + skip + need - c->cached_tail > size) {
+        c->cached_tail = __atomic_load_n(&c->tail, __ATOMIC_ACQUIRE);
+        if (head + skip + need - c->cached_tail > size) {
+            c->dropped++;
+            return -1;
+        }
+    }
+    if (skip >= sizeof(struct record)) {
+        ((struct record *)(c->ring + pos))->caplen = WRAP_MARK;
+    }
+
+    struct record *r = (struct record *)(c->ring + ((head + skip) & c->mask));
+    r->sec = header->ts.tv_sec;
+    r->usec = header->ts.tv_usec;
+    r->caplen = caplen;
+    r->len = header->len;
+    memcpy(r + 1, packet, caplen);
+    __atomic_store_n(&c->head, head + skip + need, __ATOMIC_RELEASE);
+    c->queued++;
+    return 0;
+}
+
+void capfile_stats(struct capfile *c, struct capfile_stat *stat) {
+    stat->queued = c->queued;
+    stat->dropped = c->dropped;
+    stat->written = __atomic_load_n(&c->written, __ATOMIC_RELAXED);
+    stat->bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+    stat->files = __atomic_load_n(&c->files, __ATOMIC_RELAXED);
+    stat->failed = __atomic_load_n(&c->failed, __ATOMIC_RELAXED);
+}
+
+void capfile_close(struct capfile *c, struct capfile_stat *stat) {
+    __atomic_store_n(&c->stopping, 1, __ATOMIC_RELEASE);
+    pthread_join(c->thread, NULL);
+    if (stat) {
+        capfile_stats(c, stat);
+    }
+    free_capfile(c);
+}
@@ -0,0 +1,65 @@
+/*
+ * Capture files for the packet tools
+ * ----------------------------------
+ * Writes packets to pcap or pcapng files from a background thread. The
+ * capture thread only copies each packet into a lock-free single-producer
+ * single-consumer ring and never waits on the disk; the writer thread
+ * drains the ring into large page-aligned buffers and rotates files by
+ * size or age. When the ring is full the packet is dropped and counted
+ * rather than stalling capture.
+ *
+ * Build the tools with capfile.c and -lpthread.
+ */
+
+#ifndef CAPFILE_H
+#define CAPFILE_H
+
+#include <pcap.h>
+
+#define CAPFILE_WRITE_BUFFER (4 << 20)  // Bytes per write(); a multiple of the page size
+#define CAPFILE_FLUSH_INTERVAL 1        // Seconds before an idle buffer is written out
+
+enum capfile_format { CAPFILE_PCAP, CAPFILE_PCAPNG };
+
+struct capfile_config {
+    const char *path;           // With rotation, -NNNNN is added before the extension
+    enum capfile_format format;
+    const char *ifname;         // Recorded in pcapng files
+    int linktype;
+    int snaplen;                // Longer packets are truncated
+    size_t ring_size;           // Bytes, rounded up to a power of two
+    unsigned long long rotate_bytes;  // 0 disables size rotation
+    int rotate_seconds;         // 0 disables time rotation
+    int direct;                 // Write with O_DIRECT, bypassing the page cache
+};
+
+struct capfile_stat {
+    unsigned long long queued;  // Packets accepted by capfile_write()
+    unsigned long long dropped; // Packets lost because the ring was full
+    unsigned long long written; // Packets handed to the file
+    unsigned long long bytes;   // File bytes written, headers included
+    unsigned files;             // Files opened so far
+    int failed;                 // The writer hit an I/O error and is discarding
+};
+
+struct capfile;
+
+/* Pick the format from the file extension: .pcapng, anything else pcap */
+enum capfile_format capfile_format_of(const char *path);
+
+/* Open the first file and start the writer thread. Returns NULL and
+ * fills errbuf on failure. */
+struct capfile *capfile_open(const struct capfile_config *config, char *errbuf, size_t errlen);
+
+/* Queue one packet; call from a single capture thread only. Returns -1
+ * when the ring is full and the packet was dropped. */
+int capfile_write(struct capfile *c, const struct pcap_pkthdr *header, const u_char *packet);
+
+/* Counters so far; safe to call from the capture thread */
+void capfile_stats(struct capfile *c, struct capfile_stat *stat);
+
+/* Write out everything queued, close the file and stop the writer. The
+ * final counters go to stat unless it is NULL. */
+void capfile_close(struct capfile *c, struct capfile_stat *stat);
+
+#endif
@@ -0,0 +1,276 @@
+/*
+ * PACKET_FANOUT capture workers, see fanout.h.
+ *
+ * Each ring is split into FANOUT_BLOCK_SIZE blocks. The kernel fills a
+ * block and flips its status to TP_STATUS_USER when it is full or after
+ * FANOUT_BLOCK_TIMEOUT; the worker walks every packet in it and hands the
+ * block back. Nothing is copied and there is one poll() per block at
+ * most, not one system call per packet.
+ */
+
+#define _GNU_SOURCE
+#include "fanout.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <net/if.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <arpa/inet.h>
+#include <linux/if_ether.h>
+#include <linux/if_packet.h>
+
+struct worker {
+    struct fanout *owner;
+    int fd;
+    int cpu;
+    uint8_t *ring;
+    struct iovec *blocks;
+    int block_count;
+    int next_block;
+    pthread_t thread;
+    int started;
+    pcap_handler handler;
+    u_char *args;
+};
+
+struct fanout {
+    struct worker *workers;
+    int count;
+    size_t ring_size;
+    int stopping;               // Set once, read by every worker
+    struct fanout_stat totals;
+};
+
+/* The CPUs this process may run on, in order; returns how many */
+static int usable_cpus(int *cpus, int max) {
+    cpu_set_t set;
+    int n = 0;
+
+    if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+        cpus[0] = 0;
+        return 1;
+    }
+    for (int cpu = 0; cpu < CPU_SETSIZE && n < max; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+            cpus[n++] = cpu;
+        }
+    }
+    return n > 0 ? n : (cpus[0] = 0, 1);
+}
+
+/* Socket, ring, bind and fanout group for one worker */
+static int open_worker(struct worker *w, int ifindex, int group, size_t ring_size, char *errbuf, size_t errlen) {
+    int version = TPACKET_V3;
+    struct tpacket_req3 req;
+    struct sockaddr_ll addr;
+    struct packet_mreq mreq;
+
+    w->fd = socket(AF_PACKET, SOCK_RAW, htons(ETH_P_ALL));
+    if (w->fd < 0) {
+        snprintf(errbuf, errlen, "socket: %s", strerror(errno));
+        return -1;
+    }
+    if (setsockopt(w->fd, SOL_PACKET, PACKET_VERSION, &version, sizeof(version)) < 0) {
+        snprintf(errbuf, errlen, "TPACKET_V3 not supported: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&req, 0, sizeof(req));
+    req.tp_block_size = FANOUT_BLOCK_SIZE;
+    req.tp_block_nr = ring_size / FANOUT_BLOCK_SIZE;
+    req.tp_frame_size = TPACKET_ALIGNMENT << 7;
+    req.tp_frame_nr = req.tp_block_size / req.tp_frame_size * req.tp_block_nr;
+    req.tp_retire_blk_tov = FANOUT_BLOCK_TIMEOUT;
+    if (setsockopt(w->fd, SOL_PACKET, PACKET_RX_RING, &req, sizeof(req)) < 0) {
+        snprintf(errbuf, errlen, "PACKET_RX_RING: %s", strerror(errno));
+        return -1;
+    }
+    w->ring = mmap(NULL, ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, w->fd, 0);
+    if (w->ring == MAP_FAILED) {
+        w->ring = NULL;
+        snprintf(errbuf, errlen, "mmap: %s", strerror(errno));
+        return -1;
+    }
+    w->block_count = req.tp_block_nr;
+    w->blocks = calloc(w->block_count, sizeof(struct iovec));
+    if (!w->blocks) {
+        snprintf(errbuf, errlen, "Out of memory");
+        return -1;
+    }
+    for (int i = 0; i < w->block_count; i++) {
+        w->blocks[i].iov_base = w->ring + (size_t)i * req.tp_block_size;
+        w->blocks[i].iov_len = req.tp_block_size;
+    }
+
+    memset(&addr, 0, sizeof(addr));
+    addr.sll_family = AF_PACKET;
+    addr.sll_protocol = htons(ETH_P_ALL);
+    addr.sll_ifindex = ifindex;
+    if (bind(w->fd, (struct sockaddr *)&addr, sizeof(addr)) < 0) {
+        snprintf(errbuf, errlen, "bind: %s", strerror(errno));
+        return -1;
+    }
+
+    memset(&mreq, 0, sizeof(mreq));
+    mreq.mr_ifindex = ifindex;
+    mreq.mr_type = PACKET_MR_PROMISC;
+    setsockopt(w->fd, SOL_PACKET, PACKET_ADD_MEMBERSHIP, &mreq, sizeof(mreq));
+
+    // Hash on the flow; DEFRAG keeps fragments with the rest of their flow
+    int fanout_arg = group | ((PACKET_FANOUT_HASH | PACKET_FANOUT_FLAG_DEFRAG) << 16);
+    if (setsockopt(w->fd, SOL_PACKET, PACKET_FANOUT, &fanout_arg, sizeof(fanout_arg)) < 0) {
+        snprintf(errbuf, errlen, "PACKET_FANOUT: %s", strerror(errno));
+        return -1;
+    }
+    return 0;
+}
+
+struct fanout *fanout_open(const char *dev, int workers, int ring_mb, char *errbuf, size_t errlen) {
+    int cpus[CPU_SETSIZE];
+    int cpu_count = usable_cpus(cpus, CPU_SETSIZE);
+    int ifindex = if_nametoindex(dev);
+
+    if (ifindex == 0) {
+        snprintf(errbuf, errlen, "No such interface %s", dev);
+        return NULL;
+    }
+    if (workers <= 0) {
+        workers = cpu_count;
+    }
+    if (ring_mb < FANOUT_BLOCK_SIZE >> 20) {
+        ring_mb = FANOUT_BLOCK_SIZE >> 20;
+    }
+
+    struct fanout *f = calloc(1, sizeof(*f));
+    if (!f || !(f->workers = calloc(workers, sizeof(struct worker)))) {
+        free(f);
+        snprintf(errbuf, errlen, "Out of memory");
+        return NULL;
+    }
+    f->ring_size = ((size_t)ring_mb << 20) & ~((size_t)FANOUT_BLOCK_SIZE - 1);
+    for (int i = 0; i < workers; i++) {
+        f->workers[i].fd = -1;
+    }
+
+    // Fanout groups are per network namespace; the pid keeps ours apart
+    int group = getpid() & 0xffff;
+    for (f->count = 0; f->count < workers; f->count++) {
+        struct worker *w = &f->workers[f->count];
+        w->owner = f;
+        w->cpu = cpus[f->count % cpu_count];
+        if (open_worker(w, ifindex, group, f->ring_size, errbuf, errlen) != 0) {
+            f->count++;
+            fanout_close(f);
+            return NULL;
+        }
+    }
+    return f;
+}
+
+int fanout_workers(const struct fanout *f) {
+    return f->count;
+}
+
+int fanout_cpu(const struct fanout *f, int i) {
+    return f->workers[i].cpu;
+}
+
+/* Hand every packet of a filled block to the handler */
+static void walk_block(struct worker *w, struct tpacket_block_desc *block) {
+    struct tpacket3_hdr *hdr = (struct tpacket3_hdr *)((uint8_t *)block + block->hdr.bh1.offset_to_first_pkt);
+    struct pcap_pkthdr header;
+
+    for (uint32_t i = 0; i < block->hdr.bh1.num_pkts; i++) {
+        header.ts.tv_sec = hdr->tp_sec;
+        header.ts.tv_usec = hdr->tp_nsec / 1000;
+        header.caplen = hdr->tp_snaplen;
+        header.len = hdr->tp_len;
+        w->handler(w->args, &header, (const u_char *)hdr + hdr->tp_mac);
+        hdr = (struct tpacket3_hdr *)((uint8_t *)hdr + hdr->tp_next_offset);
+    }
+}
+
+static void *fanout_worker(void *arg) {
+    struct worker *w = arg;
+    struct pollfd pfd = { .fd = w->fd, .events = POLLIN | POLLERR };
+
+    while (!__atomic_load_n(&w->owner->stopping, __ATOMIC_RELAXED)) {
+        struct tpacket_block_desc *block = w->blocks[w->next_block].iov_base;
+        if (!(__atomic_load_n(&block->hdr.bh1.block_status, __ATOMIC_ACQUIRE) & TP_STATUS_USER)) {
+            // The block timeout bounds the wait, so stop requests are seen
+            poll(&pfd, 1, FANOUT_BLOCK_TIMEOUT);
+            continue;
+        }
+        walk_block(w, block);
+        __atomic_store_n(&block->hdr.bh1.block_status, TP_STATUS_KERNEL, __ATOMIC_RELEASE);
+        w->next_block = (w->next_block + 1) % w->block_count;
+    }
+    return NULL;
+}
+
+int fanout_start(struct fanout *f, pcap_handler handler, u_char **args) {
+    int started = 0;
+
+    for (int i = 0; i < f->count; i++) {
+        struct worker *w = &f->workers[i];
+        cpu_set_t set;
+
+        w->handler = handler;
+        w->args = args[i];
+        if (pthread_create(&w->thread, NULL, fanout_worker, w) != 0) {
+            continue;
+        }
+        CPU_ZERO(&set);
+        CPU_SET(w->cpu, &set);
+        pthread_setaffinity_np(w->thread, sizeof(set), &set);
+        w->started = 1;
+        started++;
+    }
+    return started > 0 ? 0 : -1;
+}
+
+void fanout_stop(struct fanout *f) {
+    __atomic_store_n(&f->stopping, 1, __ATOMIC_RELAXED);
+}
+
+/* PACKET_STATISTICS resets on every read, so the totals live here */
+int fanout_stats(struct fanout *f, struct fanout_stat *stat) {
+    for (int i = 0; i < f->count; i++) {
+        struct tpacket_stats_v3 st;
+        socklen_t len = sizeof(st);
+        if (getsockopt(f->workers[i].fd, SOL_PACKET, PACKET_STATISTICS, &st, &len) != 0) {
+            return -1;
+        }
+        // tp_packets already includes the drops
+        f->totals.packets += st.tp_packets;
+        f->totals.drops += st.tp_drops;
+    }
+    *stat = f->totals;
+    return 0;
+}
+
+void fanout_close(struct fanout *f) {
+    fanout_stop(f);
+    for (int i = 0; i < f->count; i++) {
+        struct worker *w = &f->workers[i];
+        if (w->started) {
+            pthread_join(w->thread, NULL);
+        }
+        if (w->ring) {
+            munmap(w->ring, f->ring_size);
+        }
+        if (w->fd >= 0) {
+            close(w->fd);
+        }
+        free(w->blocks);
+    }
+    free(f->workers);
+    free(f);
+}
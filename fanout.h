@@ -0,0 +1,53 @@
+/*
+ * Multi-core capture for the packet tools
+ * ---------------------------------------
+ * Opens one AF_PACKET socket per worker, each with its own TPACKET_V3
+ * ring, and joins them into a PACKET_FANOUT group that hashes on the
+ * flow. Both directions of a connection land on the same worker, so
+ * per-flow state needs no locking. Every worker runs on its own thread
+ * pinned to one CPU and hands packets to an ordinary pcap_handler, the
+ * same callback pcap_loop() would call.
+ *
+ * Needs root (CAP_NET_RAW). Build the tools with fanout.c and -lpthread.
+ */
+
+#ifndef FANOUT_H
+#define FANOUT_H
+
+#include <pcap.h>
+
+#define FANOUT_RING_MB 32       // Ring per worker
+#define FANOUT_BLOCK_SIZE (1 << 22)
+#define FANOUT_BLOCK_TIMEOUT 100 // ms before a partly filled block is handed over
+
+struct fanout;
+
+struct fanout_stat {
+    unsigned long long packets;  // Seen by the kernel across all workers
+    unsigned long long drops;    // Lost because a ring was full
+};
+
+/* Open workers sockets on dev (0 means one per usable CPU). Returns NULL
+ * and fills errbuf on failure. */
+struct fanout *fanout_open(const char *dev, int workers, int ring_mb, char *errbuf, size_t errlen);
+
+/* Number of workers actually opened */
+int fanout_workers(const struct fanout *f);
+
+/* CPU worker i is pinned to */
+int fanout_cpu(const struct fanout *f, int i);
+
+/* Start one thread per worker; worker i calls handler with args[i].
+ * Returns -1 if no thread could be started. */
+int fanout_start(struct fanout *f, pcap_handler handler, u_char **args);
+
+/* Ask the workers to stop; safe to call from a signal handler */
+void fanout_stop(struct fanout *f);
+
+/* Kernel counters summed over the workers since fanout_open() */
+int fanout_stats(struct fanout *f, struct fanout_stat *stat);
+
+/* Wait for the workers, then release the sockets and rings */
+void fanout_close(struct fanout *f);
+
+#endif
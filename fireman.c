@@ -1,293 +1,2558 @@
-# compile with gcc -o fireman fireman.c
+// compile with gcc -O2 -o fireman fireman.c
 
-​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​#include <stdio.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
-#include <arpa/inet.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 // Define the FirewallRule structure
 typedef struct {
     char chain[10];      // "INPUT", "OUTPUT", "FORWARD"
-    char source_ip[16];  // IPv4 address
-    char dest_ip[16];
+    char source_ip[19];  // IPv4 address or CIDR prefix, e.g. 10.0.0.0/8
+    char dest_ip[19];
     int source_port;     // 0 if not specified
+    int source_port_end; // Last port of a range, 0 for a single port
     int dest_port;       // 0 if not specified
-    char protocol[4];    // "TCP", "UDP", "ICMP"
-    char action[6];      // "ACCEPT", "DROP", "REJECT", "LOG"
+    int dest_port_end;
+    char protocol[5];    // "TCP", "UDP", "ICMP"
+    char action[7];      // "ACCEPT", "DROP", "REJECT", "LOG"
 } FirewallRule;
 
-// Define the RuleNode structure for the linked list
-typedef struct RuleNode {
-    FirewallRule rule;
-    struct RuleNode* next;
-} RuleNode;
+// Rules in evaluation order, stored contiguously
+typedef struct {
+    FirewallRule* rules;
+    int count;
+    int capacity;
+} RuleList;
+
+// Chains, protocols and actions as small integers for the compiled rules
+typedef enum { CHAIN_INPUT, CHAIN_OUTPUT, CHAIN_FORWARD, CHAIN_COUNT } ChainId;
+typedef enum { PROTO_TCP, PROTO_UDP, PROTO_ICMP, PROTO_COUNT } ProtocolId;
+typedef enum { ACTION_ACCEPT, ACTION_DROP, ACTION_REJECT, ACTION_LOG, ACTION_COUNT } ActionId;
+
+const char* chain_names[CHAIN_COUNT] = {"INPUT", "OUTPUT", "FORWARD"};
+const char* protocol_names[PROTO_COUNT] = {"TCP", "UDP", "ICMP"};
+const char* action_names[ACTION_COUNT] = {"ACCEPT", "DROP", "REJECT", "LOG"};
+
+// Look a name up in one of the tables above; -1 if it is not there
+int find_name(const char** names, int count, const char* name) {
+    for (int i = 0; i < count; i++) {
+        if (strcmp(names[i], name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+int parse_chain(const char* name) {
+    return find_name(chain_names, CHAIN_COUNT, name);
+}
+
+int parse_protocol(const char* name) {
+    return find_name(protocol_names, PROTO_COUNT, name);
+}
+
+int parse_action(const char* name) {
+    return find_name(action_names, ACTION_COUNT, name);
+}
+
+// Parse "a.b.c.d" or "a.b.c.d/len" from the first length bytes of text
+// into a host byte order address and prefix length; an empty string is
+// 0.0.0.0/0. Returns 0 if invalid.
+int parse_cidr_span(const char* text, size_t length, uint32_t* ip, int* prefix_len) {
+    const char* end = text + length;
+    uint32_t address = 0;
+    int len = 32;
+
+    if (length == 0) {
+        *ip = 0;
+        *prefix_len = 0;
+        return 1;
+    }
+    for (int octet = 0; octet < 4; octet++) {
+        const char* start = text;
+        unsigned value = 0;
+        while (text < end && text - start < 3 && *text >= '0' && *text <= '9') {
+            value = value * 10 + (*text++ - '0');
+        }
+        // Like inet_pton, no empty octets, no leading zeros
+        if (text == start || value > 255 || (*start == '0' && text - start > 1)) {
+            return 0;
+        }
+        address = address << 8 | value;
+        if (octet < 3 && (text == end || *text++ != '.')) {
+            return 0;
+        }
+    }
+    if (text < end) {
+        if (*text++ != '/' || text == end || end - text > 2) {
+            return 0;
+        }
+        for (len = 0; text < end; text++) {
+            if (*text < '0' || *text > '9') {
+                return 0;
+            }
+            len = len * 10 + (*text - '0');
+        }
+        if (len > 32) {
+            return 0;
+        }
+    }
+    *ip = address;
+    *prefix_len = len;
+    return 1;
+}
+
+int parse_cidr(const char* text, uint32_t* ip, int* prefix_len) {
+    return parse_cidr_span(text, strlen(text), ip, prefix_len);
+}
+
+uint32_t prefix_mask(int prefix_len) {
+    return prefix_len ? 0xffffffffu << (32 - prefix_len) : 0;
+}
+
+// Parse "port" or "first-last" from the first length bytes of text;
+// returns 0 if invalid
+int parse_port_span(const char* text, size_t length, int* port, int* port_end) {
+    const char* end = text + length;
+    const char* start = text;
+    int first = 0, last = 0;
+
+    while (text < end && text - start < 6 && *text >= '0' && *text <= '9') {
+        first = first * 10 + (*text++ - '0');
+    }
+    if (text == start) {
+        return 0;
+    }
+    if (text < end && *text == '-') {
+        start = ++text;
+        while (text < end && text - start < 6 && *text >= '0' && *text <= '9') {
+            last = last * 10 + (*text++ - '0');
+        }
+        if (text == start || last < first) {
+            return 0;
+        }
+    }
+    if (text != end) {
+        return 0;
+    }
+    *port = first;
+    *port_end = last;
+    return 1;
+}
+
+int parse_port_range(const char* text, int* port, int* port_end) {
+    return parse_port_span(text, strcspn(text, "\n"), port, port_end);
+}
+
+// Print a port or range as "80" or "1000<separator>2000"
+void format_ports(char* out, size_t size, int port, int port_end, char separator) {
+    if (port_end > 0) {
+        snprintf(out, size, "%d%c%d", port, separator, port_end);
+    } else {
+        snprintf(out, size, "%d", port);
+    }
+}
+
+// Validate a firewall rule
+int validate_rule(FirewallRule* rule) {
+    uint32_t ip;
+    int prefix_len;
+    // Validate source IP or prefix if specified
+    if (!parse_cidr(rule->source_ip, &ip, &prefix_len)) {
+        return 0;
+    }
+    // Validate destination IP or prefix if specified
+    if (!parse_cidr(rule->dest_ip, &ip, &prefix_len)) {
+        return 0;
+    }
+    // Validate port ranges
+    if (rule->source_port < 0 || rule->source_port > 65535) {
+        return 0;
+    }
+    if (rule->dest_port < 0 || rule->dest_port > 65535) {
+        return 0;
+    }
+    if (rule->source_port_end != 0 &&
+        (rule->source_port_end < rule->source_port || rule->source_port_end > 65535)) {
+        return 0;
+    }
+    if (rule->dest_port_end != 0 &&
+        (rule->dest_port_end < rule->dest_port || rule->dest_port_end > 65535)) {
+        return 0;
+    }
+    // Validate protocol
+    if (parse_protocol(rule->protocol) < 0) {
+        return 0;
+    }
+    // Validate action
+    if (parse_action(rule->action) < 0) {
+        return 0;
+    }
+    // Validate chain
+    if (parse_chain(rule->chain) < 0) {
+        return 0;
+    }
+    return 1;
+}
+
+// Make room for at least capacity rules; returns 0 if memory ran out
+int reserve_rules(RuleList* list, int capacity) {
+    if (capacity <= list->capacity) {
+        return 1;
+    }
+    FirewallRule* rules = realloc(list->rules, capacity * sizeof(FirewallRule));
+    if (!rules) {
+        printf("Memory allocation failed.\n");
+        return 0;
+    }
+    list->rules = rules;
+    list->capacity = capacity;
+    return 1;
+}
+
+// Add a rule at the end of the list; returns 0 if memory ran out
+int append_rule(RuleList* list, const FirewallRule* rule) {
+    if (list->count == list->capacity &&
+        !reserve_rules(list, list->capacity ? list->capacity * 2 : 64)) {
+        return 0;
+    }
+    list->rules[list->count++] = *rule;
+    return 1;
+}
+
+// Copy a field into a fixed size string; returns 0 if it does not fit
+int copy_field(char* out, size_t size, const char* text, size_t length) {
+    if (length >= size) {
+        return 0;
+    }
+    memcpy(out, text, length);
+    out[length] = '\0';
+    return 1;
+}
+
+// Parse a "chain,source,dest,sport,dport,protocol,action" line of the
+// given length in place; addresses may be empty for any. Returns 1 for a
+// valid rule, 0 if the line is not in that format and -1 if the rule
+// itself is invalid.
+int parse_rule_span(const char* line, size_t length, FirewallRule* rule) {
+    const char* end = line + length;
+    const char* field[7];
+    size_t size[7];
+
+    // Cleared so snapshots never carry stale bytes after the strings
+    memset(rule, 0, sizeof(*rule));
+    for (int i = 0; i < 7; i++) {
+        const char* comma = i < 6 ? memchr(line, ',', end - line) : end;
+        if (!comma) {
+            return 0;
+        }
+        field[i] = line;
+        size[i] = comma - line;
+        line = comma + 1;
+    }
+    while (size[6] > 0 && (field[6][size[6] - 1] == ' ' || field[6][size[6] - 1] == '\t')) {
+        size[6]--;
+    }
+    if (!copy_field(rule->chain, sizeof(rule->chain), field[0], size[0]) ||
+        !copy_field(rule->source_ip, sizeof(rule->source_ip), field[1], size[1]) ||
+        !copy_field(rule->dest_ip, sizeof(rule->dest_ip), field[2], size[2]) ||
+        !copy_field(rule->protocol, sizeof(rule->protocol), field[5], size[5]) ||
+        !copy_field(rule->action, sizeof(rule->action), field[6], size[6])) {
+        return 0;
+    }
+    if (!parse_port_span(field[3], size[3], &rule->source_port, &rule->source_port_end) ||
+        !parse_port_span(field[4], size[4], &rule->dest_port, &rule->dest_port_end) ||
+        !validate_rule(rule)) {
+        return -1;
+    }
+    return 1;
+}
+
+int parse_rule_line(const char* line, FirewallRule* rule) {
+    return parse_rule_span(line, strcspn(line, "\r\n"), rule);
+}
+
+// The original sscanf based line parser, kept as the baseline of the load
+// benchmark
+int parse_rule_scanf(const char* line, FirewallRule* rule) {
+    char source_port_str[12], dest_port_str[12];
+    char expanded[300];
+    char* out = expanded;
+    int field = 0;
+
+    // %[^,] cannot match an empty field, so the "any" addresses that
+    // save_rules writes as empty fields are spelled out first
+    while (*line && out < expanded + sizeof(expanded) - 10) {
+        *out = *line++;
+        if (*out++ == ',' && ++field <= 2 && *line == ',') {
+            memcpy(out, "0.0.0.0/0", 9);
+            out += 9;
+        }
+    }
+    *out = '\0';
+    memset(rule, 0, sizeof(*rule));
+    int n = sscanf(expanded, "%9[^,],%18[^,],%18[^,],%11[^,],%11[^,],%4[^,],%6s",
+                   rule->chain, rule->source_ip, rule->dest_ip, source_port_str, dest_port_str,
+                   rule->protocol, rule->action);
+    if (n != 7) {
+        return 0;
+    }
+    if (!parse_port_range(source_port_str, &rule->source_port, &rule->source_port_end) ||
+        !parse_port_range(dest_port_str, &rule->dest_port, &rule->dest_port_end) ||
+        !validate_rule(rule)) {
+        return -1;
+    }
+    return 1;
+}
+
+// Add a new rule at the end of the list
+void add_rule(RuleList* list) {
+    FirewallRule new_rule;
+    char source_ports[12], dest_ports[12];
+    memset(&new_rule, 0, sizeof(new_rule));
+    printf("Enter chain (INPUT, OUTPUT, FORWARD): ");
+    scanf("%9s", new_rule.chain);
+    printf("Enter source IP or CIDR (or leave blank for any): ");
+    scanf("%18s", new_rule.source_ip);
+    printf("Enter destination IP or CIDR (or leave blank for any): ");
+    scanf("%18s", new_rule.dest_ip);
+    printf("Enter source port or range, e.g. 1024-65535 (0 for any): ");
+    scanf("%11s", source_ports);
+    printf("Enter destination port or range (0 for any): ");
+    scanf("%11s", dest_ports);
+    if (!parse_port_range(source_ports, &new_rule.source_port, &new_rule.source_port_end) ||
+        !parse_port_range(dest_ports, &new_rule.dest_port, &new_rule.dest_port_end)) {
+        printf("Invalid rule.\n");
+        return;
+    }
+    printf("Enter protocol (TCP, UDP, ICMP): ");
+    scanf("%4s", new_rule.protocol);
+    printf("Enter action (ACCEPT, DROP, REJECT, LOG): ");
+    scanf("%6s", new_rule.action);
+
+    // Validate the rule
+    if (!validate_rule(&new_rule)) {
+        printf("Invalid rule.\n");
+        return;
+    }
+    if (append_rule(list, &new_rule)) {
+        printf("Rule added successfully.\n");
+    }
+}
+
+// Delete a rule by index; returns 0 if there is no such rule
+int delete_rule(RuleList* list, int index) {
+    if (list->count == 0) {
+        printf("No rules to delete.\n");
+        return 0;
+    }
+    if (index < 0 || index >= list->count) {
+        printf("Index out of range.\n");
+        return 0;
+    }
+    memmove(&list->rules[index], &list->rules[index + 1],
+            (list->count - index - 1) * sizeof(FirewallRule));
+    list->count--;
+    printf("Rule deleted successfully.\n");
+    return 1;
+}
+
+// Selection of rules for bulk deletion; every field that is set must match
+typedef struct {
+    int chain;           // -1 for any, like protocol and action
+    int protocol;
+    int action;
+    uint32_t source;     // Rules whose prefix lies inside this one
+    int source_len;      // -1 for any
+    uint32_t dest;
+    int dest_len;
+    int source_port;     // Rules whose ports lie inside this range, -1 for any
+    int source_port_end;
+    int dest_port;
+    int dest_port_end;
+} RuleFilter;
+
+// Parse "key=value,..." with keys chain, protocol, action, source, dest,
+// sport and dport. Returns 0 if the filter is invalid.
+int parse_filter(const char* text, RuleFilter* filter) {
+    char copy[256];
+    snprintf(copy, sizeof(copy), "%s", text);
+    filter->chain = filter->protocol = filter->action = -1;
+    filter->source_len = filter->dest_len = -1;
+    filter->source_port = filter->dest_port = -1;
+
+    for (char* term = strtok(copy, ","); term != NULL; term = strtok(NULL, ",")) {
+        char* value = strchr(term, '=');
+        if (!value) {
+            return 0;
+        }
+        *value++ = '\0';
+        int ok;
+        if (strcmp(term, "chain") == 0) {
+            ok = (filter->chain = parse_chain(value)) >= 0;
+        } else if (strcmp(term, "protocol") == 0) {
+            ok = (filter->protocol = parse_protocol(value)) >= 0;
+        } else if (strcmp(term, "action") == 0) {
+            ok = (filter->action = parse_action(value)) >= 0;
+        } else if (strcmp(term, "source") == 0) {
+            ok = parse_cidr(value, &filter->source, &filter->source_len);
+        } else if (strcmp(term, "dest") == 0) {
+            ok = parse_cidr(value, &filter->dest, &filter->dest_len);
+        } else if (strcmp(term, "sport") == 0) {
+            ok = parse_port_range(value, &filter->source_port, &filter->source_port_end);
+        } else if (strcmp(term, "dport") == 0) {
+            ok = parse_port_range(value, &filter->dest_port, &filter->dest_port_end);
+        } else {
+            ok = 0;
+        }
+        if (!ok) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int prefix_within(const char* text, uint32_t prefix, int prefix_len) {
+    uint32_t ip;
+    int len;
+    return parse_cidr(text, &ip, &len) && len >= prefix_len && ((ip ^ prefix) & prefix_mask(prefix_len)) == 0;
+}
+
+int ports_within(int port, int port_end, int first, int last) {
+    if (!port_end) {
+        port_end = port ? port : 65535;
+    }
+    if (!last) {
+        last = first;
+    }
+    return port >= first && port_end <= last;
+}
+
+int filter_matches(const RuleFilter* filter, const FirewallRule* rule) {
+    return (filter->chain < 0 || filter->chain == parse_chain(rule->chain)) &&
+           (filter->protocol < 0 || filter->protocol == parse_protocol(rule->protocol)) &&
+           (filter->action < 0 || filter->action == parse_action(rule->action)) &&
+           (filter->source_len < 0 || prefix_within(rule->source_ip, filter->source, filter->source_len)) &&
+           (filter->dest_len < 0 || prefix_within(rule->dest_ip, filter->dest, filter->dest_len)) &&
+           (filter->source_port < 0 || ports_within(rule->source_port, rule->source_port_end,
+                                                    filter->source_port, filter->source_port_end)) &&
+           (filter->dest_port < 0 || ports_within(rule->dest_port, rule->dest_port_end,
+                                                  filter->dest_port, filter->dest_port_end));
+}
+
+// Delete every rule the filter selects in one pass; returns the count
+int delete_matching(RuleList* list, const RuleFilter* filter) {
+    int kept = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (!filter_matches(filter, &list->rules[i])) {
+            list->rules[kept++] = list->rules[i];
+        }
+    }
+    int deleted = list->count - kept;
+    list->count = kept;
+    printf("%d rules deleted.\n", deleted);
+    return deleted;
+}
+
+// List all rules
+void list_rules(const RuleList* list) {
+    if (list->count == 0) {
+        printf("No rules defined.\n");
+        return;
+    }
+    printf("Index\tChain\tSource IP\tDest IP\tSrc Port\tDst Port\tProtocol\tAction\n");
+    for (int index = 0; index < list->count; index++) {
+        const FirewallRule* rule = &list->rules[index];
+        char source_ports[24], dest_ports[24];
+        format_ports(source_ports, sizeof(source_ports), rule->source_port, rule->source_port_end, '-');
+        format_ports(dest_ports, sizeof(dest_ports), rule->dest_port, rule->dest_port_end, '-');
+        printf("%d\t%s\t%s\t%s\t%s\t%s\t%s\t%s\n",
+               index,
+               rule->chain,
+               rule->source_ip,
+               rule->dest_ip,
+               source_ports,
+               dest_ports,
+               rule->protocol,
+               rule->action);
+    }
+}
+
+// Render a rule as a line of the rule file, without the newline
+void format_rule_csv(const FirewallRule* rule, char* out, size_t size) {
+    char source_ports[24], dest_ports[24];
+    format_ports(source_ports, sizeof(source_ports), rule->source_port, rule->source_port_end, '-');
+    format_ports(dest_ports, sizeof(dest_ports), rule->dest_port, rule->dest_port_end, '-');
+    snprintf(out, size, "%s,%s,%s,%s,%s,%s,%s",
+             rule->chain,
+             rule->source_ip,
+             rule->dest_ip,
+             source_ports,
+             dest_ports,
+             rule->protocol,
+             rule->action);
+}
+
+// Save rules to a file; returns 0 on failure
+int save_rules(const RuleList* list, const char* filename) {
+    FILE* fp = fopen(filename, "w");
+    if (fp == NULL) {
+        perror("Error opening file");
+        return 0;
+    }
+    for (int index = 0; index < list->count; index++) {
+        char line[96];
+        format_rule_csv(&list->rules[index], line, sizeof(line));
+        fprintf(fp, "%s\n", line);
+    }
+    if (fclose(fp) != 0) {
+        perror("Error writing file");
+        return 0;
+    }
+    printf("Rules saved to %s.\n", filename);
+    return 1;
+}
+
+// Release the rules and leave an empty list
+void free_rules(RuleList* list) {
+    free(list->rules);
+    list->rules = NULL;
+    list->count = list->capacity = 0;
+}
+
+// Binary snapshot: this header, then the rules exactly as a RuleList
+// holds them, so loading one is a single mmap and a copy. The byte order
+// mark and record size tie a snapshot to the build that wrote it.
+#define SNAPSHOT_MAGIC "FWRULES1"
+
+typedef struct {
+    char magic[8];
+    uint32_t byte_order;   // 0x01020304 as the writer stored it
+    uint32_t record_size;  // sizeof(FirewallRule)
+    uint64_t count;
+} SnapshotHeader;
+
+// Write the rules as a binary snapshot; returns 0 on failure
+int save_snapshot(const RuleList* list, const char* filename) {
+    SnapshotHeader header = {SNAPSHOT_MAGIC, 0x01020304, sizeof(FirewallRule), list->count};
+    FILE* fp = fopen(filename, "wb");
+    if (fp == NULL) {
+        perror("Error opening file");
+        return 0;
+    }
+    size_t written = fwrite(&header, sizeof(header), 1, fp);
+    if (list->count > 0) {
+        written += fwrite(list->rules, sizeof(FirewallRule), list->count, fp);
+    }
+    if (fclose(fp) != 0 || written != (size_t)list->count + 1) {
+        perror("Error writing file");
+        return 0;
+    }
+    printf("Snapshot of %d rules saved to %s.\n", list->count, filename);
+    return 1;
+}
+
+// Append the rules of a mapped snapshot; returns the count, or -1 if the
+// snapshot is damaged or was written by another build
+int read_snapshot(RuleList* list, const char* data, size_t size) {
+    SnapshotHeader header;
+    memcpy(&header, data, sizeof(header));
+    if (header.byte_order != 0x01020304 || header.record_size != sizeof(FirewallRule) ||
+        header.count > (size - sizeof(header)) / sizeof(FirewallRule) ||
+        header.count > (uint64_t)(INT32_MAX - list->count)) {
+        printf("Snapshot does not match this build of fireman.\n");
+        return -1;
+    }
+    if (!reserve_rules(list, list->count + header.count)) {
+        return -1;
+    }
+    FirewallRule* rules = &list->rules[list->count];
+    memcpy(rules, data + sizeof(header), header.count * sizeof(FirewallRule));
+    // A snapshot is trusted no more than a CSV file: terminate the strings
+    // and check every record before any of them is used
+    for (uint64_t i = 0; i < header.count; i++) {
+        rules[i].chain[sizeof(rules[i].chain) - 1] = '\0';
+        rules[i].source_ip[sizeof(rules[i].source_ip) - 1] = '\0';
+        rules[i].dest_ip[sizeof(rules[i].dest_ip) - 1] = '\0';
+        rules[i].protocol[sizeof(rules[i].protocol) - 1] = '\0';
+        rules[i].action[sizeof(rules[i].action) - 1] = '\0';
+        if (!validate_rule(&rules[i])) {
+            printf("Invalid rule %llu in snapshot.\n", (unsigned long long)i + 1);
+            return -1;
+        }
+    }
+    list->count += header.count;
+    return header.count;
+}
+
+// Append the rule lines of a buffer, parsing each straight into its slot
+// of the list. Returns the count, or -1 if memory ran out.
+int parse_rules_buffer(RuleList* list, const char* data, size_t size) {
+    const char* end = data + size;
+    int loaded = 0;
+
+    // No valid line is shorter than "INPUT,,,0,0,TCP,LOG\n", so this is
+    // the only allocation the file needs
+    if (size / 20 + 1 > (size_t)(INT32_MAX - list->count) ||
+        !reserve_rules(list, list->count + size / 20 + 1)) {
+        return -1;
+    }
+    for (const char* line = data; line < end;) {
+        const char* newline = memchr(line, '\n', end - line);
+        size_t length = (newline ? newline : end) - line;
+        if (length > 0 && line[length - 1] == '\r') {
+            length--;
+        }
+        if (length > 0) {
+            int result = parse_rule_span(line, length, &list->rules[list->count]);
+            if (result > 0) {
+                list->count++;
+                loaded++;
+            } else if (result < 0) {
+                printf("Invalid rule in file: %.*s\n", (int)length, line);
+            } else {
+                printf("Invalid rule format in file: %.*s\n", (int)length, line);
+            }
+        }
+        line = newline ? newline + 1 : end;
+    }
+    return loaded;
+}
+
+// Map a rule file, CSV or snapshot, and append its rules. Returns the
+// count, or -1 on failure.
+int map_rules(RuleList* list, const char* filename) {
+    struct stat st;
+    int fd = open(filename, O_RDONLY);
+    if (fd == -1) {
+        perror("Error opening file");
+        return -1;
+    }
+    if (fstat(fd, &st) == -1) {
+        perror("Error reading file");
+        close(fd);
+        return -1;
+    }
+    if (st.st_size == 0) {
+        close(fd);
+        return 0;
+    }
+    char* data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        perror("Error mapping file");
+        return -1;
+    }
+    madvise(data, st.st_size, MADV_SEQUENTIAL);
+    int loaded;
+    if ((size_t)st.st_size >= sizeof(SnapshotHeader) && memcmp(data, SNAPSHOT_MAGIC, 8) == 0) {
+        loaded = read_snapshot(list, data, st.st_size);
+    } else {
+        loaded = parse_rules_buffer(list, data, st.st_size);
+    }
+    munmap(data, st.st_size);
+    return loaded;
+}
+
+// Append the rules of a file, or of standard input for "-", in file
+// order. Returns 0 if the file cannot be read.
+int import_rules(RuleList* list, const char* filename) {
+    int loaded = 0;
+    if (strcmp(filename, "-") != 0) {
+        loaded = map_rules(list, filename);
+        if (loaded < 0) {
+            return 0;
+        }
+        printf("%d rules loaded from %s.\n", loaded, filename);
+        return 1;
+    }
+
+    // Pipes cannot be mapped, so standard input is read line by line
+    char line[256];
+    while (fgets(line, sizeof(line), stdin) != NULL) {
+        FirewallRule rule;
+        int result = parse_rule_line(line, &rule);
+        if (result > 0) {
+            if (!append_rule(list, &rule)) {
+                return 0;
+            }
+            loaded++;
+        } else if (result < 0) {
+            printf("Invalid rule in file: %s", line);
+        } else if (line[strspn(line, "\r\n")] != '\0') {
+            printf("Invalid rule format in file: %s", line);
+        }
+    }
+    printf("%d rules loaded from standard input.\n", loaded);
+    return 1;
+}
+
+// Replace the rules with those of a file
+int load_rules(RuleList* list, const char* filename) {
+    list->count = 0;
+    return import_rules(list, filename);
+}
+
+double elapsed_ms(const struct timespec* start) {
+    struct timespec end;
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    return (end.tv_sec - start->tv_sec) * 1e3 + (end.tv_nsec - start->tv_nsec) / 1e6;
+}
+
+// Time loading a CSV rule file with the original fgets and sscanf reader,
+// with the mapped parser, and from a binary snapshot of the same rules.
+// Returns 0 on failure.
+int benchmark_load(const char* filename) {
+    const int rounds = 5;
+    const char* names[] = {"fgets + sscanf", "mmap parser", "snapshot"};
+    double best[3] = {1e300, 1e300, 1e300};
+    char snapshot[] = "/tmp/firewall_snapshot_XXXXXX";
+    RuleList list = {0};
+    struct timespec start;
+    int counts[3] = {0};
+
+    int fd = mkstemp(snapshot);
+    if (fd == -1) {
+        perror("Error creating temporary file");
+        return 0;
+    }
+    close(fd);
+    if (map_rules(&list, filename) < 0 || !save_snapshot(&list, snapshot)) {
+        unlink(snapshot);
+        free_rules(&list);
+        return 0;
+    }
+
+    for (int round = 0; round < rounds; round++) {
+        list.count = 0;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        FILE* fp = fopen(filename, "r");
+        char line[256];
+        while (fp && fgets(line, sizeof(line), fp) != NULL) {
+            FirewallRule rule;
+            if (parse_rule_scanf(line, &rule) > 0 && !append_rule(&list, &rule)) {
+                break;
+            }
+        }
+        if (fp) {
+            fclose(fp);
+        }
+        double ms = elapsed_ms(&start);
+        best[0] = ms < best[0] ? ms : best[0];
+        counts[0] = list.count;
+
+        for (int method = 1; method < 3; method++) {
+            list.count = 0;
+            clock_gettime(CLOCK_MONOTONIC, &start);
+            counts[method] = map_rules(&list, method == 1 ? filename : snapshot);
+            ms = elapsed_ms(&start);
+            best[method] = ms < best[method] ? ms : best[method];
+        }
+    }
+    unlink(snapshot);
+    free_rules(&list);
+
+    printf("Best of %d loads of %s:\n", rounds, filename);
+    for (int method = 0; method < 3; method++) {
+        printf("  %-16s %8d rules %9.2f ms %8.2f M rules/s\n", names[method], counts[method],
+               best[method], counts[method] / best[method] / 1e3);
+    }
+    if (counts[0] != counts[1] || counts[1] != counts[2]) {
+        printf("Warning: the loaders read different numbers of rules, the timings are not comparable.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// Compiled rule set for offline packet matching. The list is turned into
+// packed integer records in one contiguous array. Per chain and protocol,
+// rules that name an address hang off longest-prefix tries over source and
+// destination, the rest are indexed by destination port, so a lookup only
+// visits the rules that can match however large the set is.
+typedef struct {
+    uint32_t source;       // Host byte order, masked to the prefix
+    uint32_t source_mask;  // 0 matches any source
+    uint32_t dest;
+    uint32_t dest_mask;
+    uint32_t index;        // Position in the rule list; the lowest match wins
+    uint32_t key;          // Port or trie node the rule is filed under
+    uint16_t source_port;  // Inclusive port ranges, 0-65535 for any
+    uint16_t source_port_end;
+    uint16_t dest_port;
+    uint16_t dest_port_end;
+    uint8_t group;         // chain * PROTO_COUNT + protocol
+    uint8_t kind;          // RULE_ANY_PORT, RULE_PORT, RULE_SOURCE or RULE_DEST
+    uint8_t action;
+} CompiledRule;
+
+// Where a compiled rule is filed, in the order they are laid out
+enum { RULE_ANY_PORT, RULE_PORT, RULE_SOURCE, RULE_DEST };
+
+// Rules of one group without addresses that require a single destination port
+typedef struct {
+    uint16_t port;
+    uint32_t first;
+    uint32_t count;
+} PortBucket;
+
+// Path-compressed binary trie node for a prefix. Holds the rules filed
+// under exactly this prefix, if any, sorted by list position.
+typedef struct {
+    uint32_t prefix;
+    uint8_t prefix_len;
+    int32_t child[2];      // -1 when absent
+    uint32_t first;
+    uint32_t count;
+} TrieNode;
+
+// Rules of one chain and protocol
+typedef struct {
+    uint32_t any_first;    // No address, any or a range of destination ports
+    uint32_t any_count;
+    uint32_t bucket_first;
+    uint32_t bucket_count;
+    int32_t source_root;   // Tries of rules filed by source or destination
+    int32_t dest_root;
+} RuleGroup;
+
+typedef struct {
+    CompiledRule* rules;
+    int rule_count;
+    PortBucket* buckets;
+    int bucket_count;
+    TrieNode* nodes;
+    int node_count;
+    int node_capacity;
+    RuleGroup groups[CHAIN_COUNT * PROTO_COUNT];
+} CompiledRuleset;
+
+// A packet to evaluate, addresses and ports in host byte order
+typedef struct {
+    uint32_t source;
+    uint32_t dest;
+    uint16_t source_port;
+    uint16_t dest_port;
+    uint8_t chain;
+    uint8_t protocol;
+} PacketTuple;
+
+// Bit of an address right after the first `position` bits
+int address_bit(uint32_t address, int position) {
+    return (address >> (31 - position)) & 1;
+}
+
+int trie_new_node(CompiledRuleset* set, uint32_t prefix, int prefix_len) {
+    if (set->node_count == set->node_capacity) {
+        int capacity = set->node_capacity ? set->node_capacity * 2 : 64;
+        TrieNode* nodes = realloc(set->nodes, capacity * sizeof(TrieNode));
+        if (!nodes) {
+            return -1;
+        }
+        set->nodes = nodes;
+        set->node_capacity = capacity;
+    }
+    TrieNode* node = &set->nodes[set->node_count];
+    node->prefix = prefix & prefix_mask(prefix_len);
+    node->prefix_len = prefix_len;
+    node->child[0] = node->child[1] = -1;
+    node->first = node->count = 0;
+    return set->node_count++;
+}
+
+// Find or add the node for prefix/prefix_len below root, which is 0/0.
+// Returns the node index, or -1 if memory ran out.
+int trie_insert(CompiledRuleset* set, int root, uint32_t prefix, int prefix_len) {
+    int parent = -1, side = 0, node = root;
+
+    prefix &= prefix_mask(prefix_len);
+    while (node >= 0) {
+        TrieNode* n = &set->nodes[node];
+        int common = n->prefix_len < prefix_len ? n->prefix_len : prefix_len;
+        uint32_t diff = (prefix ^ n->prefix) & prefix_mask(common);
+        if (diff) {
+            common = __builtin_clz(diff);
+        }
+
+        if (common == n->prefix_len) {
+            if (prefix_len == n->prefix_len) {
+                return node;
+            }
+            // n covers the prefix: descend
+            parent = node;
+            side = address_bit(prefix, n->prefix_len);
+            node = n->child[side];
+            continue;
+        }
+
+        // The prefix ends or diverges inside n's compressed path
+        int existing = node;
+        uint32_t existing_prefix = n->prefix;
+        int split = trie_new_node(set, prefix, common);
+        if (split < 0) {
+            return -1;
+        }
+        set->nodes[split].child[address_bit(existing_prefix, common)] = existing;
+        set->nodes[parent].child[side] = split;
+        if (common == prefix_len) {
+            return split;
+        }
+        int leaf = trie_new_node(set, prefix, prefix_len);
+        if (leaf < 0) {
+            return -1;
+        }
+        set->nodes[split].child[address_bit(prefix, common)] = leaf;
+        return leaf;
+    }
+    node = trie_new_node(set, prefix, prefix_len);
+    if (node >= 0) {
+        set->nodes[parent].child[side] = node;
+    }
+    return node;
+}
+
+int compare_compiled(const void* a, const void* b) {
+    const CompiledRule* x = a;
+    const CompiledRule* y = b;
+    if (x->group != y->group) {
+        return x->group - y->group;
+    }
+    if (x->kind != y->kind) {
+        return x->kind - y->kind;
+    }
+    if (x->key != y->key) {
+        return (x->key > y->key) - (x->key < y->key);
+    }
+    return (x->index > y->index) - (x->index < y->index);
+}
+
+void free_compiled(CompiledRuleset* set) {
+    if (set) {
+        free(set->rules);
+        free(set->buckets);
+        free(set->nodes);
+        free(set);
+    }
+}
+
+// Turn a rule into its packed form; returns 0 if it is invalid
+int compile_rule(const FirewallRule* rule, CompiledRule* c) {
+    int chain = parse_chain(rule->chain);
+    int protocol = parse_protocol(rule->protocol);
+    int action = parse_action(rule->action);
+    int source_len, dest_len;
+
+    if (chain < 0 || protocol < 0 || action < 0 ||
+        !parse_cidr(rule->source_ip, &c->source, &source_len) ||
+        !parse_cidr(rule->dest_ip, &c->dest, &dest_len)) {
+        return 0;
+    }
+    c->source_mask = prefix_mask(source_len);
+    c->source &= c->source_mask;
+    c->dest_mask = prefix_mask(dest_len);
+    c->dest &= c->dest_mask;
+    c->source_port = rule->source_port;
+    c->source_port_end = rule->source_port_end ? rule->source_port_end :
+                         rule->source_port ? rule->source_port : 65535;
+    c->dest_port = rule->dest_port;
+    c->dest_port_end = rule->dest_port_end ? rule->dest_port_end :
+                       rule->dest_port ? rule->dest_port : 65535;
+    c->group = chain * PROTO_COUNT + protocol;
+    c->action = action;
+    return 1;
+}
+
+// Build the compiled form of the rule list
+CompiledRuleset* compile_rules(const RuleList* list) {
+    CompiledRuleset* set = calloc(1, sizeof(CompiledRuleset));
+    int total = list->count;
+    if (!set) {
+        return NULL;
+    }
+    set->rules = malloc((total + 1) * sizeof(CompiledRule));
+    set->buckets = malloc((total + 1) * sizeof(PortBucket));
+    if (!set->rules || !set->buckets) {
+        free_compiled(set);
+        return NULL;
+    }
+    for (int g = 0; g < CHAIN_COUNT * PROTO_COUNT; g++) {
+        set->groups[g].source_root = set->groups[g].dest_root = -1;
+    }
+
+    // File every rule: a rule naming an address goes into the trie of its
+    // longer prefix, the others by destination port
+    for (int index = 0; index < list->count; index++) {
+        CompiledRule* c = &set->rules[set->rule_count];
+        // LOG never ends the evaluation of a chain, so it decides nothing
+        if (!compile_rule(&list->rules[index], c) || c->action == ACTION_LOG) {
+            continue;
+        }
+        c->index = index;
+        RuleGroup* group = &set->groups[c->group];
+        int source_len = __builtin_popcount(c->source_mask);
+        int dest_len = __builtin_popcount(c->dest_mask);
+        if (source_len == 0 && dest_len == 0) {
+            int single = c->dest_port == c->dest_port_end;
+            c->kind = single ? RULE_PORT : RULE_ANY_PORT;
+            c->key = single ? c->dest_port : 0;
+        } else {
+            int by_source = source_len >= dest_len;
+            int32_t* root = by_source ? &group->source_root : &group->dest_root;
+            if (*root < 0) {
+                *root = trie_new_node(set, 0, 0);
+            }
+            int node = *root < 0 ? -1 :
+                       trie_insert(set, *root, by_source ? c->source : c->dest,
+                                   by_source ? source_len : dest_len);
+            if (node < 0) {
+                free_compiled(set);
+                return NULL;
+            }
+            c->kind = by_source ? RULE_SOURCE : RULE_DEST;
+            c->key = node;
+        }
+        set->rule_count++;
+    }
+    qsort(set->rules, set->rule_count, sizeof(CompiledRule), compare_compiled);
+
+    // Point the groups, buckets and trie nodes at their runs of rules
+    for (int i = 0; i < set->rule_count;) {
+        CompiledRule* c = &set->rules[i];
+        RuleGroup* group = &set->groups[c->group];
+        int end = i;
+        while (end < set->rule_count && set->rules[end].group == c->group &&
+               set->rules[end].kind == c->kind && set->rules[end].key == c->key) {
+            end++;
+        }
+        if (c->kind == RULE_ANY_PORT) {
+            group->any_first = i;
+            group->any_count = end - i;
+        } else if (c->kind == RULE_PORT) {
+            if (group->bucket_count == 0) {
+                group->bucket_first = set->bucket_count;
+            }
+            PortBucket* bucket = &set->buckets[set->bucket_count++];
+            bucket->port = c->key;
+            bucket->first = i;
+            bucket->count = end - i;
+            group->bucket_count++;
+        } else {
+            set->nodes[c->key].first = i;
+            set->nodes[c->key].count = end - i;
+        }
+        i = end;
+    }
+    return set;
+}
+
+// First rule in a run sorted by index that matches the packet
+const CompiledRule* first_match(const CompiledRule* rules, uint32_t count, const PacketTuple* packet) {
+    for (uint32_t i = 0; i < count; i++) {
+        const CompiledRule* r = &rules[i];
+        if ((packet->source & r->source_mask) == r->source &&
+            (packet->dest & r->dest_mask) == r->dest &&
+            packet->source_port >= r->source_port && packet->source_port <= r->source_port_end &&
+            packet->dest_port >= r->dest_port && packet->dest_port <= r->dest_port_end) {
+            return r;
+        }
+    }
+    return NULL;
+}
+
+// Walk the trie along address and keep the earliest matching rule of
+// every prefix that contains it
+const CompiledRule* trie_match(const CompiledRuleset* set, int node, uint32_t address,
+                               const PacketTuple* packet, const CompiledRule* best) {
+    while (node >= 0) {
+        const TrieNode* n = &set->nodes[node];
+        if ((address & prefix_mask(n->prefix_len)) != n->prefix) {
+            break;
+        }
+        // Runs are sorted, so a run starting after the best match is skipped
+        if (n->count > 0 && (!best || set->rules[n->first].index < best->index)) {
+            const CompiledRule* hit = first_match(set->rules + n->first, n->count, packet);
+            if (hit && (!best || hit->index < best->index)) {
+                best = hit;
+            }
+        }
+        if (n->prefix_len == 32) {
+            break;
+        }
+        node = n->child[address_bit(address, n->prefix_len)];
+    }
+    return best;
+}
+
+// Evaluate a packet like the kernel walks a chain: the first matching rule
+// decides. Returns the action, or ACCEPT (the chain policy) when nothing
+// matches. rule_index receives the rule's list position, or -1.
+int match_packet(const CompiledRuleset* set, const PacketTuple* packet, int* rule_index) {
+    *rule_index = -1;
+    if (packet->chain >= CHAIN_COUNT || packet->protocol >= PROTO_COUNT) {
+        return ACTION_ACCEPT;
+    }
+    const RuleGroup* group = &set->groups[packet->chain * PROTO_COUNT + packet->protocol];
+    const CompiledRule* best = first_match(set->rules + group->any_first, group->any_count, packet);
+
+    // Binary search for the bucket of the destination port
+    const PortBucket* buckets = set->buckets + group->bucket_first;
+    uint32_t low = 0, high = group->bucket_count;
+    while (low < high) {
+        uint32_t mid = (low + high) / 2;
+        if (buckets[mid].port < packet->dest_port) {
+            low = mid + 1;
+        } else {
+            high = mid;
+        }
+    }
+    if (low < group->bucket_count && buckets[low].port == packet->dest_port) {
+        const CompiledRule* hit = first_match(set->rules + buckets[low].first, buckets[low].count, packet);
+        if (hit && (!best || hit->index < best->index)) {
+            best = hit;
+        }
+    }
+
+    best = trie_match(set, group->source_root, packet->source, packet, best);
+    best = trie_match(set, group->dest_root, packet->dest, packet, best);
+    if (!best) {
+        return ACTION_ACCEPT;
+    }
+    *rule_index = best->index;
+    return best->action;
+}
+
+// A rule of a built-in chain as iptables-save prints it, used to diff the
+// live table against the rule list
+typedef struct {
+    int chain;
+    uint64_t hash;
+    uint64_t packets;    // Counter from iptables-save -c, else 0
+    char spec[160];      // Everything after "-A CHAIN "
+} TableRule;
+
+typedef struct {
+    TableRule* rules;
+    int count;
+    int capacity;
+} RuleTable;
+
+uint64_t hash_text(uint64_t hash, const char* text) {
+    while (*text) {
+        hash = (hash ^ (unsigned char)*text++) * 0x100000001b3ull;
+    }
+    return hash;
+}
+
+int table_add(RuleTable* table, int chain, const char* spec) {
+    if (table->count == table->capacity) {
+        int capacity = table->capacity ? table->capacity * 2 : 256;
+        TableRule* rules = realloc(table->rules, capacity * sizeof(TableRule));
+        if (!rules) {
+            return 0;
+        }
+        table->rules = rules;
+        table->capacity = capacity;
+    }
+    TableRule* rule = &table->rules[table->count++];
+    rule->chain = chain;
+    rule->packets = 0;
+    snprintf(rule->spec, sizeof(rule->spec), "%s", spec);
+    rule->spec[strcspn(rule->spec, "\r\n")] = '\0';
+    rule->hash = hash_text(hash_text(0xcbf29ce484222325ull, chain_names[chain]), rule->spec);
+    return 1;
+}
+
+// Append "-s a.b.c.d/len" style output for a non-empty prefix
+void format_prefix(char* out, size_t size, const char* option, const char* text) {
+    uint32_t ip;
+    int prefix_len;
+    if (!parse_cidr(text, &ip, &prefix_len) || prefix_len == 0) {
+        return;
+    }
+    ip &= prefix_mask(prefix_len);
+    size_t used = strlen(out);
+    snprintf(out + used, size - used, "%s %u.%u.%u.%u/%d ", option,
+             ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255, prefix_len);
+}
+
+// Render a rule exactly as iptables-save would list it, so that unchanged
+// rules compare equal as text
+void format_rule_spec(const FirewallRule* rule, char* out, size_t size) {
+    char ports[24];
+    const char* protocol = "";
+    size_t used;
+
+    switch (parse_protocol(rule->protocol)) {
+        case PROTO_TCP: protocol = "tcp"; break;
+        case PROTO_UDP: protocol = "udp"; break;
+        case PROTO_ICMP: protocol = "icmp"; break;
+    }
+    out[0] = '\0';
+    format_prefix(out, size, "-s", rule->source_ip);
+    format_prefix(out, size, "-d", rule->dest_ip);
+    used = strlen(out);
+    used += snprintf(out + used, size - used, "-p %s ", protocol);
+    int source_ports = rule->source_port > 0 || rule->source_port_end > 0;
+    int dest_ports = rule->dest_port > 0 || rule->dest_port_end > 0;
+    if (source_ports || dest_ports) {
+        used += snprintf(out + used, size - used, "-m %s ", protocol);
+    }
+    if (source_ports) {
+        format_ports(ports, sizeof(ports), rule->source_port, rule->source_port_end, ':');
+        used += snprintf(out + used, size - used, "--sport %s ", ports);
+    }
+    if (dest_ports) {
+        format_ports(ports, sizeof(ports), rule->dest_port, rule->dest_port_end, ':');
+        used += snprintf(out + used, size - used, "--dport %s ", ports);
+    }
+    snprintf(out + used, size - used, "-j %s%s", rule->action,
+             strcmp(rule->action, "REJECT") == 0 ? " --reject-with icmp-port-unreachable" : "");
+}
+
+// Read the built-in chains of the filter table from an iptables-save dump,
+// or from iptables-save itself when path is NULL. Rules of other chains
+// and tables are not ours and are left out. Packet counters are kept when
+// the dump has them, as iptables-save -c writes.
+int read_live_table(RuleTable* live, const char* path) {
+    FILE* fp = path ? fopen(path, "r") : popen("iptables-save -c -t filter", "r");
+    char line[512], chain[32];
+    int in_filter = 0;
+
+    if (fp == NULL) {
+        perror(path ? "Error opening file" : "Error running iptables-save");
+        return 0;
+    }
+    while (fgets(line, sizeof(line), fp) != NULL) {
+        unsigned long long packets = 0, bytes;
+        int start = 0, offset = 0;
+        if (line[0] == '*') {
+            in_filter = strncmp(line, "*filter", 7) == 0;
+            continue;
+        }
+        if (line[0] == '[') {
+            sscanf(line, "[%llu:%llu] %n", &packets, &bytes, &start);
+        }
+        if (in_filter && sscanf(line + start, "-A %31s %n", chain, &offset) == 1 && offset > 0) {
+            int chain_id = parse_chain(chain);
+            if (chain_id >= 0 && !table_add(live, chain_id, line + start + offset)) {
+                printf("Memory allocation failed.\n");
+                break;
+            }
+            if (chain_id >= 0) {
+                live->rules[live->count - 1].packets = packets;
+            }
+        }
+    }
+    int status = path ? fclose(fp) : pclose(fp);
+    if (!path && status != 0) {
+        printf("Error reading the live table. Ensure you have root privileges.\n");
+        return 0;
+    }
+    return 1;
+}
+
+// State of the linear-space Myers diff of one chain: a is the live
+// sequence, b the desired one, and keep marks their common subsequence
+typedef struct {
+    TableRule** a;
+    TableRule** b;
+    char* keep_a;
+    char* keep_b;
+    int* forward;
+    int* backward;
+} DiffContext;
+
+int same_rule(const TableRule* x, const TableRule* y) {
+    return x->hash == y->hash && strcmp(x->spec, y->spec) == 0;
+}
+
+// Mark a longest common subsequence of a[a0,a1) and b[b0,b1) by recursing
+// on the middle snake, which needs O(N + M) memory and O((N + M) D) time
+// for D differences
+void diff_lcs(DiffContext* ctx, int a0, int a1, int b0, int b1) {
+    while (a0 < a1 && b0 < b1 && same_rule(ctx->a[a0], ctx->b[b0])) {
+        ctx->keep_a[a0++] = ctx->keep_b[b0++] = 1;
+    }
+    while (a0 < a1 && b0 < b1 && same_rule(ctx->a[a1 - 1], ctx->b[b1 - 1])) {
+        ctx->keep_a[--a1] = ctx->keep_b[--b1] = 1;
+    }
+    if (a0 == a1 || b0 == b1) {
+        return;
+    }
+
+    int n = a1 - a0, m = b1 - b0, delta = n - m, odd = delta & 1;
+    int offset = n + m + 1, limit = (n + m + 1) / 2;
+    int* vf = ctx->forward + offset;
+    int* vb = ctx->backward + offset;
+    vf[1] = 0;
+    vb[1] = 0;
+    for (int d = 0; d <= limit; d++) {
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && vf[k - 1] < vf[k + 1])) ? vf[k + 1] : vf[k - 1] + 1;
+            int y = x - k, start = x;
+            while (x < n && y < m && same_rule(ctx->a[a0 + x], ctx->b[b0 + y])) {
+                x++;
+                y++;
+            }
+            vf[k] = x;
+            if (odd && delta - k >= -(d - 1) && delta - k <= d - 1 && x + vb[delta - k] >= n) {
+                for (int i = start; i < x; i++) {
+                    ctx->keep_a[a0 + i] = ctx->keep_b[b0 + i - k] = 1;
+                }
+                diff_lcs(ctx, a0, a0 + start, b0, b0 + start - k);
+                diff_lcs(ctx, a0 + x, a1, b0 + y, b1);
+                return;
+            }
+        }
+        for (int k = -d; k <= d; k += 2) {
+            int x = (k == -d || (k != d && vb[k - 1] < vb[k + 1])) ? vb[k + 1] : vb[k - 1] + 1;
+            int y = x - k, start = x;
+            while (x < n && y < m && same_rule(ctx->a[a1 - 1 - x], ctx->b[b1 - 1 - y])) {
+                x++;
+                y++;
+            }
+            vb[k] = x;
+            if (!odd && delta - k >= -d && delta - k <= d && x + vf[delta - k] >= n) {
+                for (int i = start; i < x; i++) {
+                    ctx->keep_a[a1 - 1 - i] = ctx->keep_b[b1 - 1 - i + k] = 1;
+                }
+                diff_lcs(ctx, a0, a1 - x, b0, b1 - y);
+                diff_lcs(ctx, a1 - start, a1, b1 - start + k, b1);
+                return;
+            }
+        }
+    }
+}
+
+// Write the iptables-restore --noflush commands that turn the live chains
+// into the desired ones: deletions from the bottom up, then insertions in
+// list order. Returns the number of commands, or -1 on allocation failure.
+int write_changes(FILE* out, const RuleTable* live, const RuleTable* desired) {
+    int changes = 0;
+
+    for (int chain = 0; chain < CHAIN_COUNT; chain++) {
+        DiffContext ctx;
+        int n = 0, m = 0;
+        ctx.a = malloc((live->count + 1) * sizeof(TableRule*));
+        ctx.b = malloc((desired->count + 1) * sizeof(TableRule*));
+        for (int i = 0; ctx.a && i < live->count; i++) {
+            if (live->rules[i].chain == chain) {
+                ctx.a[n++] = &live->rules[i];
+            }
+        }
+        for (int i = 0; ctx.b && i < desired->count; i++) {
+            if (desired->rules[i].chain == chain) {
+                ctx.b[m++] = &desired->rules[i];
+            }
+        }
+        ctx.keep_a = calloc(n + 1, 1);
+        ctx.keep_b = calloc(m + 1, 1);
+        ctx.forward = malloc((2 * (n + m) + 3) * sizeof(int));
+        ctx.backward = malloc((2 * (n + m) + 3) * sizeof(int));
+        if (!ctx.a || !ctx.b || !ctx.keep_a || !ctx.keep_b || !ctx.forward || !ctx.backward) {
+            changes = -1;
+        } else {
+            diff_lcs(&ctx, 0, n, 0, m);
+            for (int i = n - 1; i >= 0; i--) {
+                if (!ctx.keep_a[i]) {
+                    fprintf(out, "-D %s %d\n", chain_names[chain], i + 1);
+                    changes++;
+                }
+            }
+            for (int j = 0; j < m; j++) {
+                if (!ctx.keep_b[j]) {
+                    fprintf(out, "-I %s %d %s\n", chain_names[chain], j + 1, ctx.b[j]->spec);
+                    changes++;
+                }
+            }
+        }
+        free(ctx.a);
+        free(ctx.b);
+        free(ctx.keep_a);
+        free(ctx.keep_b);
+        free(ctx.forward);
+        free(ctx.backward);
+        if (changes < 0) {
+            return -1;
+        }
+    }
+    return changes;
+}
+
+// Bring the filter table in line with the rule list by changing only the
+// rules that differ. The commands go through iptables-restore --noflush as
+// one transaction, so chain policies, counters of unchanged rules and
+// other chains are left alone. live_path replaces the live table with an
+// iptables-save dump; with dry_run the commands are only printed.
+// Returns 0 on failure.
+int apply_rules(const RuleList* list, const char* live_path, int dry_run) {
+    RuleTable live = {0}, desired = {0};
+    char spec[160];
+    struct timespec start;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!read_live_table(&live, live_path)) {
+        free(live.rules);
+        return 0;
+    }
+    for (int i = 0; i < list->count; i++) {
+        format_rule_spec(&list->rules[i], spec, sizeof(spec));
+        if (!table_add(&desired, parse_chain(list->rules[i].chain), spec)) {
+            printf("Memory allocation failed.\n");
+            free(live.rules);
+            free(desired.rules);
+            return 0;
+        }
+    }
+
+    char template[] = "/tmp/firewall_rules_XXXXXX";
+    int fd = dry_run ? -1 : mkstemp(template);
+    if (!dry_run && fd == -1) {
+        perror("Error creating temporary file");
+        free(live.rules);
+        free(desired.rules);
+        return 0;
+    }
+    FILE* fp = dry_run ? stdout : fdopen(fd, "w");
+    if (fp == NULL) {
+        perror("Error opening temporary file");
+        close(fd);
+        unlink(template);
+        free(live.rules);
+        free(desired.rules);
+        return 0;
+    }
+    // Write iptables-restore format; no chain lines, so policies stay
+    fprintf(fp, "*filter\n");
+    int changes = write_changes(fp, &live, &desired);
+    fprintf(fp, "COMMIT\n");
+    double ms = elapsed_ms(&start);
+    free(live.rules);
+    free(desired.rules);
+
+    if (changes < 0) {
+        printf("Memory allocation failed.\n");
+    } else {
+        printf("%d rule changes computed in %.1f ms.\n", changes, ms);
+    }
+    if (dry_run) {
+        return changes >= 0;
+    }
+    fclose(fp);
+
+    int ok = changes >= 0;
+    if (changes > 0) {
+        // Apply the changes
+        char command[256];
+        snprintf(command, sizeof(command), "iptables-restore --noflush < %s", template);
+        int result = system(command);
+        if (result != 0) {
+            printf("Error applying rules. Ensure you have root privileges.\n");
+            ok = 0;
+        } else {
+            printf("Rules applied successfully.\n");
+        }
+    } else if (changes == 0) {
+        printf("Rules are already up to date.\n");
+    }
+    unlink(template); // Remove the temporary file
+    return ok;
+}
+
+// nftables backend. The rules live in a table of their own that is
+// replaced as a whole on every apply. Consecutive rules of a chain that
+// share protocol and matched fields fold into one lookup: a set when
+// they share the action, a verdict map when they mix ACCEPT and DROP.
+// The kernel then does one hash or interval lookup per group instead of
+// walking the rules one by one. The table is in the ip family, so like
+// the iptables backend it filters IPv4 only; in inet, rules without an
+// address would also match IPv6.
+enum { FIELD_SOURCE = 1, FIELD_DEST = 2, FIELD_SPORT = 4, FIELD_DPORT = 8 };
+
+// Groups up to this size are written inline as anonymous sets, larger
+// ones as named sets and maps
+#define NFT_INLINE_MAX 8
+
+// Groups whose keys differ in width are checked for overlaps pairwise,
+// and closed at this size to keep that cheap
+#define NFT_SCAN_MAX 64
+
+const char* nft_chain_names[CHAIN_COUNT] = {"input", "output", "forward"};
+const char* nft_protocol_names[PROTO_COUNT] = {"tcp", "udp", "icmp"};
+const char* nft_verdicts[ACTION_COUNT] = {"accept", "drop", "reject", "log"};
+
+// Run of rules that become one nft rule; members are chained through
+// the next array of write_nft_ruleset
+typedef struct {
+    int chain;
+    int protocol;
+    int fields;
+    int action;          // -1 once the group mixes ACCEPT and DROP
+    int interval;        // Some key is a prefix or a port range
+    int uniform;         // All first fields are aligned and of one width
+    uint32_t width;
+    int first;
+    int last;
+    int count;
+} NftGroup;
+
+// Which fields a compiled rule actually matches on
+int nft_fields(const CompiledRule* c, int protocol) {
+    int fields = 0;
+    if (c->source_mask) {
+        fields |= FIELD_SOURCE;
+    }
+    if (c->dest_mask) {
+        fields |= FIELD_DEST;
+    }
+    if (protocol != PROTO_ICMP) {
+        if (c->source_port != 0 || c->source_port_end != 65535) {
+            fields |= FIELD_SPORT;
+        }
+        if (c->dest_port != 0 || c->dest_port_end != 65535) {
+            fields |= FIELD_DPORT;
+        }
+    }
+    return fields;
+}
+
+// First matched field of a rule as an inclusive range
+void first_field(const CompiledRule* c, int fields, uint32_t* lo, uint32_t* hi) {
+    if (fields & FIELD_SOURCE) {
+        *lo = c->source;
+        *hi = c->source | ~c->source_mask;
+    } else if (fields & FIELD_DEST) {
+        *lo = c->dest;
+        *hi = c->dest | ~c->dest_mask;
+    } else if (fields & FIELD_SPORT) {
+        *lo = c->source_port;
+        *hi = c->source_port_end;
+    } else {
+        *lo = c->dest_port;
+        *hi = c->dest_port_end;
+    }
+}
+
+// Whether some packet matches both rules; such keys cannot share a set
+int rules_overlap(const CompiledRule* a, const CompiledRule* b) {
+    return ((a->source ^ b->source) & a->source_mask & b->source_mask) == 0 &&
+           ((a->dest ^ b->dest) & a->dest_mask & b->dest_mask) == 0 &&
+           a->source_port <= b->source_port_end && b->source_port <= a->source_port_end &&
+           a->dest_port <= b->dest_port_end && b->dest_port <= a->dest_port_end;
+}
+
+void append_text(char* out, size_t size, const char* format, ...) {
+    size_t used = strlen(out);
+    va_list args;
+    if (used + 1 >= size) {
+        return;
+    }
+    va_start(args, format);
+    vsnprintf(out + used, size - used, format, args);
+    va_end(args);
+}
+
+void append_address(char* out, size_t size, uint32_t address, uint32_t mask) {
+    int prefix_len = __builtin_popcount(mask);
+    append_text(out, size, "%u.%u.%u.%u", address >> 24, (address >> 16) & 255,
+                (address >> 8) & 255, address & 255);
+    if (prefix_len < 32) {
+        append_text(out, size, "/%d", prefix_len);
+    }
+}
+
+void append_ports(char* out, size_t size, int port, int port_end) {
+    if (port == port_end) {
+        append_text(out, size, "%d", port);
+    } else {
+        append_text(out, size, "%d-%d", port, port_end);
+    }
+}
+
+// Either the match of a single rule ("ip saddr 10.0.0.0/8 tcp dport 22")
+// or, with key set, the selector of a set ("ip saddr . tcp dport") and
+// the key of the rule in it ("10.0.0.0/8 . 22")
+void format_nft_match(char* out, size_t size, const CompiledRule* c, int protocol, int fields, char* key, size_t key_size) {
+    const char* names[] = {"ip saddr", "ip daddr", "sport", "dport"};
+    const char* separator = key ? " . " : " ";
+    int first = 1;
+
+    out[0] = '\0';
+    if (key) {
+        key[0] = '\0';
+    }
+    if (!(fields & (FIELD_SPORT | FIELD_DPORT))) {
+        // Port matches imply the protocol, anything else needs it spelled out
+        append_text(out, size, "meta l4proto %s ", nft_protocol_names[protocol]);
+    }
+    for (int i = 0; i < 4; i++) {
+        if (!(fields & (1 << i))) {
+            continue;
+        }
+        append_text(out, size, "%s", first ? "" : separator);
+        if (i < 2) {
+            append_text(out, size, "%s", names[i]);
+        } else {
+            append_text(out, size, "%s %s", nft_protocol_names[protocol], names[i]);
+        }
+        char* value = key ? key : out;
+        size_t value_size = key ? key_size : size;
+        append_text(value, value_size, "%s", key ? (first ? "" : separator) : " ");
+        switch (i) {
+            case 0: append_address(value, value_size, c->source, c->source_mask); break;
+            case 1: append_address(value, value_size, c->dest, c->dest_mask); break;
+            case 2: append_ports(value, value_size, c->source_port, c->source_port_end); break;
+            case 3: append_ports(value, value_size, c->dest_port, c->dest_port_end); break;
+        }
+        first = 0;
+    }
+    size_t length = strlen(out);
+    if (length > 0 && out[length - 1] == ' ') {
+        out[length - 1] = '\0';
+    }
+}
 
-// Validate a firewall rule
-int validate_rule(FirewallRule* rule) {
-    struct in_addr addr;
-    // Validate source IP if specified
-    if (strlen(rule->source_ip) > 0 && inet_pton(AF_INET, rule->source_ip, &addr) != 1) {
-        return 0;
+// Set or map elements of a group, separated by commas
+void write_nft_elements(FILE* fp, const CompiledRule* rules, const int* next, const NftGroup* group, const char* indent) {
+    char match[160], key[96];
+    int i = group->first;
+    for (int n = 0; n < group->count; n++, i = next[i]) {
+        format_nft_match(match, sizeof(match), &rules[i], group->protocol, group->fields, key, sizeof(key));
+        fprintf(fp, "%s%s%s%s%s\n", indent, key, group->action < 0 ? " : " : "",
+                group->action < 0 ? nft_verdicts[rules[i].action] : "", n + 1 < group->count ? "," : "");
     }
-    // Validate destination IP if specified
-    if (strlen(rule->dest_ip) > 0 && inet_pton(AF_INET, rule->dest_ip, &addr) != 1) {
-        return 0;
+}
+
+// Write the complete nft script for the rule list. Returns the number of
+// nft rules written, or -1 if memory ran out.
+int write_nft_ruleset(FILE* fp, const RuleList* list) {
+    int total = list->count, rule_count = 0, group_count = 0, written = 0;
+    int open[CHAIN_COUNT] = {-1, -1, -1};
+
+    // Members of all groups are hashed by group and the low end of their
+    // first field, so a rule is only compared with keys that can overlap
+    int bucket_count = 16;
+    while (bucket_count < 2 * total) {
+        bucket_count *= 2;
     }
-    // Validate port ranges
-    if (rule->source_port < 0 || rule->source_port > 65535) {
-        return 0;
+    CompiledRule* rules = malloc((total + 1) * sizeof(CompiledRule));
+    int* next = malloc((total + 1) * sizeof(int));
+    NftGroup* groups = malloc((total + 1) * sizeof(NftGroup));
+    int* member_group = malloc((total + 1) * sizeof(int));
+    uint32_t* keys = malloc((total + 1) * sizeof(uint32_t));
+    int* same_bucket = malloc((total + 1) * sizeof(int));
+    int* buckets = malloc(bucket_count * sizeof(int));
+    if (!rules || !next || !groups || !member_group || !keys || !same_bucket || !buckets) {
+        free(rules);
+        free(next);
+        free(groups);
+        free(member_group);
+        free(keys);
+        free(same_bucket);
+        free(buckets);
+        return -1;
     }
-    if (rule->dest_port < 0 || rule->dest_port > 65535) {
+    memset(buckets, 0xff, bucket_count * sizeof(int));
+
+    // Extend the open group of the rule's chain when the rule fits in it,
+    // else start a new one. LOG rules and rules without fields stand alone.
+    for (int index = 0; index < list->count; index++) {
+        CompiledRule* c = &rules[rule_count];
+        if (!compile_rule(&list->rules[index], c)) {
+            continue;
+        }
+        int chain = c->group / PROTO_COUNT;
+        int protocol = c->group % PROTO_COUNT;
+        int fields = nft_fields(c, protocol);
+        int interval = (c->source_mask != 0 && c->source_mask != 0xffffffffu) ||
+                       (c->dest_mask != 0 && c->dest_mask != 0xffffffffu) ||
+                       ((fields & FIELD_SPORT) && c->source_port != c->source_port_end) ||
+                       ((fields & FIELD_DPORT) && c->dest_port != c->dest_port_end);
+        NftGroup* group = open[chain] >= 0 ? &groups[open[chain]] : NULL;
+        uint32_t lo, hi;
+        first_field(c, fields, &lo, &hi);
+        int aligned = (fields & (FIELD_SOURCE | FIELD_DEST)) || lo == hi;
+        unsigned bucket = ((unsigned)open[chain] * 2654435761u ^ lo * 0x9e3779b1u) & (bucket_count - 1);
+
+        int fits = group && fields && c->action != ACTION_LOG &&
+                   group->protocol == protocol && group->fields == fields &&
+                   (group->action == c->action ||
+                    (c->action <= ACTION_DROP && group->action <= ACTION_DROP));
+        int uniform = fits && group->uniform && aligned && hi - lo == group->width;
+        if (uniform) {
+            // Aligned keys of one width only overlap when they start together
+            for (int i = buckets[bucket]; i >= 0 && fits; i = same_bucket[i]) {
+                if (member_group[i] == open[chain] && keys[i] == lo) {
+                    fits = !rules_overlap(&rules[i], c);
+                }
+            }
+        } else if (fits && group->count < NFT_SCAN_MAX) {
+            for (int i = group->first; i >= 0 && fits; i = next[i]) {
+                fits = !rules_overlap(&rules[i], c);
+            }
+        } else {
+            fits = 0;
+        }
+        if (fits) {
+            if (group->action != c->action) {
+                group->action = -1;
+            }
+            group->interval |= interval;
+            group->uniform = uniform;
+            next[group->last] = rule_count;
+            group->last = rule_count;
+            group->count++;
+        } else {
+            group = &groups[group_count];
+            group->chain = chain;
+            group->protocol = protocol;
+            group->fields = fields;
+            group->action = c->action;
+            group->interval = interval;
+            group->uniform = aligned;
+            group->width = hi - lo;
+            group->first = group->last = rule_count;
+            group->count = 1;
+            open[chain] = fields && c->action != ACTION_LOG ? group_count : -1;
+            bucket = ((unsigned)group_count * 2654435761u ^ lo * 0x9e3779b1u) & (bucket_count - 1);
+            group_count++;
+        }
+        member_group[rule_count] = open[chain];
+        keys[rule_count] = lo;
+        same_bucket[rule_count] = buckets[bucket];
+        buckets[bucket] = rule_count;
+        next[rule_count++] = -1;
+    }
+
+    // Create the table if missing so the delete cannot fail, then replace
+    // it; nft -f applies the whole file as one transaction
+    fprintf(fp, "table ip fireman\n");
+    fprintf(fp, "delete table ip fireman\n");
+    fprintf(fp, "table ip fireman {\n");
+    for (int g = 0; g < group_count; g++) {
+        NftGroup* group = &groups[g];
+        if (group->count <= NFT_INLINE_MAX) {
+            continue;
+        }
+        fprintf(fp, "    %s g%d {\n        type ", group->action < 0 ? "map" : "set", g);
+        const char* separator = "";
+        for (int i = 0; i < 4; i++) {
+            if (group->fields & (1 << i)) {
+                fprintf(fp, "%s%s", separator, i < 2 ? "ipv4_addr" : "inet_service");
+                separator = " . ";
+            }
+        }
+        fprintf(fp, "%s\n", group->action < 0 ? " : verdict" : "");
+        if (group->interval) {
+            fprintf(fp, "        flags interval\n");
+        }
+        fprintf(fp, "        elements = {\n");
+        write_nft_elements(fp, rules, next, group, "            ");
+        fprintf(fp, "        }\n    }\n");
+    }
+    for (int chain = 0; chain < CHAIN_COUNT; chain++) {
+        fprintf(fp, "    chain %s {\n", nft_chain_names[chain]);
+        fprintf(fp, "        type filter hook %s priority filter; policy accept;\n", nft_chain_names[chain]);
+        for (int g = 0; g < group_count; g++) {
+            NftGroup* group = &groups[g];
+            char match[160], key[96];
+            if (group->chain != chain) {
+                continue;
+            }
+            const char* verdict = group->action < 0 ? "" : nft_verdicts[group->action];
+            if (group->count == 1) {
+                format_nft_match(match, sizeof(match), &rules[group->first], group->protocol, group->fields, NULL, 0);
+                fprintf(fp, "        %s %s\n", match, verdict);
+            } else {
+                format_nft_match(match, sizeof(match), &rules[group->first], group->protocol, group->fields, key, sizeof(key));
+                fprintf(fp, "        %s %s", match, group->action < 0 ? "vmap " : "");
+                if (group->count > NFT_INLINE_MAX) {
+                    fprintf(fp, "@g%d", g);
+                } else {
+                    fprintf(fp, "{\n");
+                    write_nft_elements(fp, rules, next, group, "            ");
+                    fprintf(fp, "        }");
+                }
+                fprintf(fp, "%s%s\n", verdict[0] ? " " : "", verdict);
+            }
+            written++;
+        }
+        fprintf(fp, "    }\n");
+    }
+    fprintf(fp, "}\n");
+
+    free(rules);
+    free(next);
+    free(groups);
+    free(member_group);
+    free(keys);
+    free(same_bucket);
+    free(buckets);
+    return written;
+}
+
+// Load the rule list into nftables, or with dry_run print the ruleset
+// that would be loaded. Returns 0 on failure.
+int apply_rules_nft(const RuleList* list, int dry_run) {
+    if (dry_run) {
+        int written = write_nft_ruleset(stdout, list);
+        if (written < 0) {
+            printf("Memory allocation failed.\n");
+        } else {
+            printf("%d nft rules generated.\n", written);
+        }
+        return written >= 0;
+    }
+
+    char template[] = "/tmp/firewall_nft_XXXXXX";
+    int fd = mkstemp(template);
+    if (fd == -1) {
+        perror("Error creating temporary file");
         return 0;
     }
-    // Validate protocol
-    if (strcmp(rule->protocol, "TCP") != 0 && strcmp(rule->protocol, "UDP") != 0 && 
-        strcmp(rule->protocol, "ICMP") != 0) {
+    FILE* fp = fdopen(fd, "w");
+    if (fp == NULL) {
+        perror("Error opening temporary file");
+        close(fd);
+        unlink(template);
         return 0;
     }
-    // Validate action
-    if (strcmp(rule->action, "ACCEPT") != 0 && strcmp(rule->action, "DROP") != 0 && 
-        strcmp(rule->action, "REJECT") != 0 && strcmp(rule->action, "LOG") != 0) {
+    int written = write_nft_ruleset(fp, list);
+    int ok = 0;
+    fclose(fp);
+    if (written < 0) {
+        printf("Memory allocation failed.\n");
+    } else {
+        char command[256];
+        snprintf(command, sizeof(command), "nft -f %s", template);
+        if (system(command) != 0) {
+            printf("Error applying rules. Ensure you have root privileges.\n");
+        } else {
+            printf("Rules applied successfully as %d nft rules.\n", written);
+            ok = 1;
+        }
+    }
+    unlink(template); // Remove the temporary file
+    return ok;
+}
+
+// Ruleset analysis. Rules are boxes in (source, dest, sport, dport)
+// space per chain and protocol, and the first rule whose box holds a
+// packet decides it. A rule inside the box of an earlier terminal rule
+// never matches: it is redundant when that rule has the same action and
+// shadowed, most likely a mistake, when it does not.
+//
+// Finding the covering rule does not compare rule pairs. Every rule is
+// hashed by its exact box, and a lookup tries each box that could hold
+// it: the enclosing prefixes of the lengths used in the group times the
+// enclosing port ranges used in the group. Real rulesets have a handful
+// of each, so a pass stays linear in the number of rules.
+
+typedef struct {
+    uint32_t source;
+    uint32_t dest;
+    uint16_t source_port;
+    uint16_t source_port_end;
+    uint16_t dest_port;
+    uint16_t dest_port_end;
+    uint8_t source_len;
+    uint8_t dest_len;
+    uint8_t group;
+} RuleBox;
+
+// Prefix lengths and port ranges seen in one chain and protocol
+typedef struct {
+    uint64_t source_lens;  // Bit n set when some rule uses a /n source
+    uint64_t dest_lens;
+    uint32_t* source_ranges;  // Distinct port ranges wider than one port,
+    int source_range_count;   // packed as first << 16 | last
+    uint32_t* dest_ranges;
+    int dest_range_count;
+} BoxGroup;
+
+typedef struct {
+    RuleBox* keys;
+    int* values;         // Earliest rule with that box, -1 for a free slot
+    int mask;
+    BoxGroup groups[CHAIN_COUNT * PROTO_COUNT];
+} BoxIndex;
+
+void make_box(const CompiledRule* c, RuleBox* box) {
+    memset(box, 0, sizeof(*box));
+    box->source = c->source;
+    box->dest = c->dest;
+    box->source_port = c->source_port;
+    box->source_port_end = c->source_port_end;
+    box->dest_port = c->dest_port;
+    box->dest_port_end = c->dest_port_end;
+    box->source_len = __builtin_popcount(c->source_mask);
+    box->dest_len = __builtin_popcount(c->dest_mask);
+    box->group = c->group;
+}
+
+unsigned hash_box(const RuleBox* box) {
+    uint64_t h = box->source * 0x9e3779b97f4a7c15ull;
+    h ^= (h >> 29) ^ box->dest * 0xbf58476d1ce4e5b9ull;
+    h ^= (h >> 31) ^ ((uint64_t)box->source_port << 48 | (uint64_t)box->source_port_end << 32 |
+                      (uint32_t)box->dest_port << 16 | box->dest_port_end) * 0x94d049bb133111ebull;
+    h ^= (h >> 27) ^ (uint64_t)(box->source_len << 16 | box->dest_len << 8 | box->group) * 0xff51afd7ed558ccdull;
+    return (unsigned)(h ^ (h >> 32));
+}
+
+int box_lookup(const BoxIndex* index, const RuleBox* box) {
+    for (unsigned slot = hash_box(box) & index->mask;; slot = (slot + 1) & index->mask) {
+        if (index->values[slot] < 0) {
+            return -1;
+        }
+        if (memcmp(&index->keys[slot], box, sizeof(*box)) == 0) {
+            return index->values[slot];
+        }
+    }
+}
+
+int add_range(uint32_t** ranges, int* count, uint32_t range) {
+    for (int i = 0; i < *count; i++) {
+        if ((*ranges)[i] == range) {
+            return 1;
+        }
+    }
+    if ((*count & (*count - 1)) == 0) {
+        uint32_t* grown = realloc(*ranges, (*count ? *count * 2 : 4) * sizeof(uint32_t));
+        if (!grown) {
+            return 0;
+        }
+        *ranges = grown;
+    }
+    (*ranges)[(*count)++] = range;
+    return 1;
+}
+
+// File a rule under its box unless an earlier rule has the same box.
+// Returns 0 if memory ran out.
+int box_insert(BoxIndex* index, const RuleBox* box, int rule) {
+    BoxGroup* group = &index->groups[box->group];
+    unsigned slot = hash_box(box) & index->mask;
+    while (index->values[slot] >= 0) {
+        if (memcmp(&index->keys[slot], box, sizeof(*box)) == 0) {
+            return 1;
+        }
+        slot = (slot + 1) & index->mask;
+    }
+    index->keys[slot] = *box;
+    index->values[slot] = rule;
+    group->source_lens |= 1ull << box->source_len;
+    group->dest_lens |= 1ull << box->dest_len;
+    if (box->source_port != box->source_port_end &&
+        !add_range(&group->source_ranges, &group->source_range_count,
+                   (uint32_t)box->source_port << 16 | box->source_port_end)) {
         return 0;
     }
-    // Validate chain
-    if (strcmp(rule->chain, "INPUT") != 0 && strcmp(rule->chain, "OUTPUT") != 0 && 
-        strcmp(rule->chain, "FORWARD") != 0) {
+    if (box->dest_port != box->dest_port_end &&
+        !add_range(&group->dest_ranges, &group->dest_range_count,
+                   (uint32_t)box->dest_port << 16 | box->dest_port_end)) {
         return 0;
     }
     return 1;
 }
 
-// Add a new rule to the linked list
-void add_rule(RuleNode** head) {
-    FirewallRule new_rule;
-    printf("Enter chain (INPUT, OUTPUT, FORWARD): ");
-    scanf("%9s", new_rule.chain);
-    printf("Enter source IP (or leave blank for any): ");
-    scanf("%15s", new_rule.source_ip);
-    printf("Enter destination IP (or leave blank for any): ");
-    scanf("%15s", new_rule.dest_ip);
-    printf("Enter source port (0 for any): ");
-    scanf("%d", &new_rule.source_port);
-    printf("Enter destination port (0 for any): ");
-    scanf("%d", &new_rule.dest_port);
-    printf("Enter protocol (TCP, UDP, ICMP): ");
-    scanf("%3s", new_rule.protocol);
-    printf("Enter action (ACCEPT, DROP, REJECT, LOG): ");
-    scanf("%5s", new_rule.action);
+// Earliest filed rule whose box holds this one, or -1
+int box_covering(const BoxIndex* index, const RuleBox* box) {
+    const BoxGroup* group = &index->groups[box->group];
+    int best = -1;
+    RuleBox probe = *box;
 
-    // Validate the rule
-    if (!validate_rule(&new_rule)) {
-        printf("Invalid rule.\n");
-        return;
+    for (int source_len = 0; source_len <= box->source_len; source_len++) {
+        if (!(group->source_lens >> source_len & 1)) {
+            continue;
+        }
+        probe.source_len = source_len;
+        probe.source = box->source & prefix_mask(source_len);
+        for (int dest_len = 0; dest_len <= box->dest_len; dest_len++) {
+            if (!(group->dest_lens >> dest_len & 1)) {
+                continue;
+            }
+            probe.dest_len = dest_len;
+            probe.dest = box->dest & prefix_mask(dest_len);
+            // The rule's own ranges first, then every wider one around them
+            for (int s = -1; s < group->source_range_count; s++) {
+                uint32_t sports = s < 0 ? (uint32_t)box->source_port << 16 | box->source_port_end :
+                                  group->source_ranges[s];
+                if ((sports >> 16) > box->source_port || (sports & 0xffff) < box->source_port_end ||
+                    (s >= 0 && (sports >> 16) == box->source_port && (sports & 0xffff) == box->source_port_end)) {
+                    continue;
+                }
+                probe.source_port = sports >> 16;
+                probe.source_port_end = sports & 0xffff;
+                for (int d = -1; d < group->dest_range_count; d++) {
+                    uint32_t dports = d < 0 ? (uint32_t)box->dest_port << 16 | box->dest_port_end :
+                                      group->dest_ranges[d];
+                    if ((dports >> 16) > box->dest_port || (dports & 0xffff) < box->dest_port_end ||
+                        (d >= 0 && (dports >> 16) == box->dest_port && (dports & 0xffff) == box->dest_port_end)) {
+                        continue;
+                    }
+                    probe.dest_port = dports >> 16;
+                    probe.dest_port_end = dports & 0xffff;
+                    int rule = box_lookup(index, &probe);
+                    if (rule >= 0 && (best < 0 || rule < best)) {
+                        best = rule;
+                    }
+                }
+            }
+        }
     }
+    return best;
+}
 
-    // Allocate memory for the new node
-    RuleNode* new_node = (RuleNode*)malloc(sizeof(RuleNode));
-    if (!new_node) {
-        printf("Memory allocation failed.\n");
-        return;
+void free_box_index(BoxIndex* index) {
+    free(index->keys);
+    free(index->values);
+    for (int g = 0; g < CHAIN_COUNT * PROTO_COUNT; g++) {
+        free(index->groups[g].source_ranges);
+        free(index->groups[g].dest_ranges);
     }
-    new_node->rule = new_rule;
-    new_node->next = *head;
-    *head = new_node;
-    printf("Rule added successfully.\n");
 }
 
-// Delete a rule by index
-void delete_rule(RuleNode** head, int index) {
-    if (*head == NULL) {
-        printf("No rules to delete.\n");
-        return;
+// For every rule, the earliest terminal rule before it that covers it,
+// or -1. Returns the number of covered rules, or -1 if memory ran out.
+int find_covered_rules(const RuleList* list, int* covered_by) {
+    BoxIndex index = {0};
+    int size = 16, covered = 0;
+    while (size < 2 * list->count) {
+        size *= 2;
     }
-    if (index == 0) {
-        RuleNode* temp = *head;
-        *head = (*head)->next;
-        free(temp);
-        printf("Rule deleted successfully.\n");
-        return;
+    index.keys = malloc(size * sizeof(RuleBox));
+    index.values = malloc(size * sizeof(int));
+    index.mask = size - 1;
+    if (!index.keys || !index.values) {
+        free_box_index(&index);
+        return -1;
     }
-    RuleNode* current = *head;
-    int i = 0;
-    while (current->next != NULL && i < index - 1) {
-        current = current->next;
-        i++;
+    memset(index.values, 0xff, size * sizeof(int));
+
+    for (int i = 0; i < list->count; i++) {
+        CompiledRule c;
+        RuleBox box;
+        covered_by[i] = -1;
+        if (!compile_rule(&list->rules[i], &c)) {
+            continue;
+        }
+        make_box(&c, &box);
+        covered_by[i] = box_covering(&index, &box);
+        if (covered_by[i] >= 0) {
+            covered++;
+        } else if (c.action != ACTION_LOG && !box_insert(&index, &box, i)) {
+            covered = -1;
+            break;
+        }
     }
-    if (current->next == NULL) {
-        printf("Index out of range.\n");
-        return;
+    free_box_index(&index);
+    return covered;
+}
+
+// Write a prefix back in the text form the rules use
+void format_cidr(char* out, size_t size, uint32_t ip, int prefix_len) {
+    memset(out, 0, size);
+    snprintf(out, size, "%u.%u.%u.%u", ip >> 24, (ip >> 16) & 255, (ip >> 8) & 255, ip & 255);
+    if (prefix_len < 32) {
+        size_t used = strlen(out);
+        snprintf(out + used, size - used, "/%d", prefix_len);
     }
-    RuleNode* temp = current->next;
-    current->next = temp->next;
-    free(temp);
-    printf("Rule deleted successfully.\n");
 }
 
-// List all rules
-void list_rules(RuleNode* head) {
-    if (!head) {
-        printf("No rules defined.\n");
-        return;
+// Fold b into a when the union of their boxes is itself a box: equal in
+// all fields but one, which holds sibling prefixes or touching port
+// ranges. Returns 1 if b was merged.
+int merge_rule(FirewallRule* a, const FirewallRule* b) {
+    CompiledRule x, y;
+    if (!compile_rule(a, &x) || !compile_rule(b, &y) || x.group != y.group ||
+        x.action != y.action || x.action == ACTION_LOG) {
+        return 0;
     }
-    printf("Index\tChain\tSource IP\tDest IP\tSrc Port\tDst Port\tProtocol\tAction\n");
-    RuleNode* current = head;
-    int index = 0;
-    while (current != NULL) {
-        printf("%d\t%s\t%s\t%s\t%d\t%d\t%s\t%s\n",
-               index,
-               current->rule.chain,
-               current->rule.source_ip,
-               current->rule.dest_ip,
-               current->rule.source_port,
-               current->rule.dest_port,
-               current->rule.protocol,
-               current->rule.action);
-        current = current->next;
-        index++;
+    int same_source = x.source == y.source && x.source_mask == y.source_mask;
+    int same_dest = x.dest == y.dest && x.dest_mask == y.dest_mask;
+    int same_sports = x.source_port == y.source_port && x.source_port_end == y.source_port_end;
+    int same_dports = x.dest_port == y.dest_port && x.dest_port_end == y.dest_port_end;
+    int differing = !same_source + !same_dest + !same_sports + !same_dports;
+    if (differing != 1) {
+        return 0;
     }
-}
 
-// Save rules to a file
-void save_rules(RuleNode* head, const char* filename) {
-    FILE* fp = fopen(filename, "w");
-    if (fp == NULL) {
-        perror("Error opening file");
-        return;
+    if (!same_source || !same_dest) {
+        uint32_t p = same_source ? x.dest : x.source, q = same_source ? y.dest : y.source;
+        uint32_t mask = same_source ? x.dest_mask : x.source_mask;
+        int len = __builtin_popcount(mask);
+        if (len == 0 || mask != (same_source ? y.dest_mask : y.source_mask) ||
+            (p ^ q) != 1u << (32 - len)) {
+            return 0;
+        }
+        char* field = same_source ? a->dest_ip : a->source_ip;
+        format_cidr(field, sizeof(a->source_ip), p & prefix_mask(len - 1), len - 1);
+        return 1;
     }
-    RuleNode* current = head;
-    while (current != NULL) {
-        fprintf(fp, "%s,%s,%s,%d,%d,%s,%s\n",
-                current->rule.chain,
-                current->rule.source_ip,
-                current->rule.dest_ip,
-                current->rule.source_port,
-                current->rule.dest_port,
-                current->rule.protocol,
-                current->rule.action);
-        current = current->next;
+
+    int first = same_sports ? x.dest_port : x.source_port;
+    int last = same_sports ? x.dest_port_end : x.source_port_end;
+    int other_first = same_sports ? y.dest_port : y.source_port;
+    int other_last = same_sports ? y.dest_port_end : y.source_port_end;
+    if (other_first > last + 1 || first > other_last + 1) {
+        return 0;
     }
-    fclose(fp);
-    printf("Rules saved to %s.\n", filename);
+    first = first < other_first ? first : other_first;
+    last = last > other_last ? last : other_last;
+    int* port = same_sports ? &a->dest_port : &a->source_port;
+    int* port_end = same_sports ? &a->dest_port_end : &a->source_port_end;
+    *port = first;
+    *port_end = first == 0 && last == 65535 ? 0 : (last == first ? 0 : last);
+    return 1;
 }
 
-// Load rules from a file
-void load_rules(RuleNode** head, const char* filename) {
-    // Free existing rules
-    free_rules(*head);
-    *head = NULL;
+// Merge each rule into the previous one of its chain and protocol while
+// the union is a box, summing their counters. Nothing of that group sits
+// between them, so the merged rule decides the same packets. Returns the
+// number of rules merged away.
+int merge_rules(RuleList* list, uint64_t* hits) {
+    int merged = 0, changed = 1;
+    while (changed) {
+        int last[CHAIN_COUNT * PROTO_COUNT];
+        int kept = 0;
+        changed = 0;
+        for (int g = 0; g < CHAIN_COUNT * PROTO_COUNT; g++) {
+            last[g] = -1;
+        }
+        for (int i = 0; i < list->count; i++) {
+            CompiledRule c;
+            if (!compile_rule(&list->rules[i], &c)) {
+                list->rules[kept] = list->rules[i];
+                hits[kept++] = hits[i];
+                continue;
+            }
+            int previous = last[c.group];
+            if (previous >= 0 && merge_rule(&list->rules[previous], &list->rules[i])) {
+                hits[previous] += hits[i];
+                merged++;
+                changed = 1;
+                continue;
+            }
+            list->rules[kept] = list->rules[i];
+            hits[kept] = hits[i];
+            // A LOG rule in between must still see the packets of both
+            last[c.group] = c.action == ACTION_LOG ? -1 : kept;
+            kept++;
+        }
+        list->count = kept;
+    }
+    return merged;
+}
 
-    FILE* fp = fopen(filename, "r");
-    if (fp == NULL) {
-        perror("Error opening file");
-        return;
+// Look up the packet counter of every rule in an iptables-save -c dump,
+// or in the live table for "live". Rules the table lacks count 0.
+int read_counters(const RuleList* list, const char* path, uint64_t* hits) {
+    RuleTable live = {0};
+    char spec[160];
+    if (!read_live_table(&live, strcmp(path, "live") == 0 ? NULL : path)) {
+        free(live.rules);
+        return 0;
     }
-    char line[256];
-    while (fgets(line, sizeof(line), fp) != NULL) {
-        char chain[10], source_ip[16], dest_ip[16], source_port_str[6], dest_port_str[6], protocol[4], action[6];
-        int n = sscanf(line, "%9[^,],%15[^,],%15[^,],%5[^,],%5[^,],%3[^,],%5s",
-                       chain, source_ip, dest_ip, source_port_str, dest_port_str, protocol, action);
-        if (n == 7) {
-            FirewallRule rule;
-            strcpy(rule.chain, chain);
-            strcpy(rule.source_ip, source_ip);
-            strcpy(rule.dest_ip, dest_ip);
-            rule.source_port = (strlen(source_port_str) > 0) ? atoi(source_port_str) : 0;
-            rule.dest_port = (strlen(dest_port_str) > 0) ? atoi(dest_port_str) : 0;
-            strcpy(rule.protocol, protocol);
-            strcpy(rule.action, action);
-            if (validate_rule(&rule)) {
-                RuleNode* new_node = (RuleNode*)malloc(sizeof(RuleNode));
-                if (!new_node) {
-                    printf("Memory allocation failed.\n");
-                    fclose(fp);
-                    return;
-                }
-                new_node->rule = rule;
-                new_node->next = *head;
-                *head = new_node;
-            } else {
-                printf("Invalid rule in file: %s", line);
+    int size = 16;
+    while (size < 2 * live.count) {
+        size *= 2;
+    }
+    int* slots = malloc(size * sizeof(int));
+    if (!slots) {
+        printf("Memory allocation failed.\n");
+        free(live.rules);
+        return 0;
+    }
+    memset(slots, 0xff, size * sizeof(int));
+    for (int i = 0; i < live.count; i++) {
+        unsigned slot = live.rules[i].hash & (size - 1);
+        while (slots[slot] >= 0) {
+            slot = (slot + 1) & (size - 1);
+        }
+        slots[slot] = i;
+    }
+    // Identical rules pair up in order; a claimed entry is marked by chain -1
+    for (int i = 0; i < list->count; i++) {
+        hits[i] = 0;
+        format_rule_spec(&list->rules[i], spec, sizeof(spec));
+        uint64_t hash = hash_text(hash_text(0xcbf29ce484222325ull, list->rules[i].chain), spec);
+        for (unsigned slot = hash & (size - 1); slots[slot] >= 0; slot = (slot + 1) & (size - 1)) {
+            TableRule* rule = &live.rules[slots[slot]];
+            if (rule->chain >= 0 && rule->hash == hash &&
+                strcmp(chain_names[rule->chain], list->rules[i].chain) == 0 &&
+                strcmp(rule->spec, spec) == 0) {
+                hits[i] = rule->packets;
+                rule->chain = -1;
+                break;
             }
-        } else {
-            printf("Invalid rule format in file: %s", line);
         }
     }
-    fclose(fp);
-    printf("Rules loaded from %s.\n", filename);
+    free(slots);
+    free(live.rules);
+    return 1;
 }
 
-// Apply rules using iptables-restore
-void apply_rules(RuleNode* head) {
-    char template[] = "/tmp/firewall_rules_XXXXXX";
-    int fd = mkstemp(template);
-    if (fd == -1) {
-        perror("Error creating temporary file");
-        return;
+typedef struct {
+    uint64_t hits;
+    int index;
+} HotRule;
+
+// Hottest first, list order among equals
+int compare_hot(const void* a, const void* b) {
+    const HotRule* x = a;
+    const HotRule* y = b;
+    if (x->hits != y->hits) {
+        return x->hits < y->hits ? 1 : -1;
     }
-    FILE* fp = fdopen(fd, "w");
-    if (fp == NULL) {
-        perror("Error opening temporary file");
-        close(fd);
-        return;
+    return x->index - y->index;
+}
+
+// Order every chain hottest rule first without changing any verdict.
+// Rules of one chain and protocol only move within runs of the same
+// action, which decide the same packets in any order; different
+// protocols never match the same packet, so their rules interleave
+// freely, hottest first. Each chain keeps the positions it had.
+int reorder_rules(RuleList* list, const uint64_t* hits) {
+    HotRule* hot = malloc((list->count + 1) * sizeof(HotRule));
+    int* groups = malloc((list->count + 1) * sizeof(int));
+    int* actions = malloc((list->count + 1) * sizeof(int));
+    FirewallRule* sorted = malloc((list->count + 1) * sizeof(FirewallRule));
+    if (!hot || !groups || !actions || !sorted) {
+        free(hot);
+        free(groups);
+        free(actions);
+        free(sorted);
+        printf("Memory allocation failed.\n");
+        return 0;
     }
-    // Write iptables-restore format
-    fprintf(fp, "*filter\n");
-    fprintf(fp, ":INPUT ACCEPT [0:0]\n");
-    fprintf(fp, ":FORWARD ACCEPT [0:0]\n");
-    fprintf(fp, ":OUTPUT ACCEPT [0:0]\n");
-    RuleNode* current = head;
-    while (current != NULL) {
-        fprintf(fp, "-A %s", current->rule.chain);
-        if (strlen(current->rule.protocol) > 0) {
-            fprintf(fp, " -p %s", current->rule.protocol);
+    for (int i = 0; i < list->count; i++) {
+        CompiledRule c;
+        groups[i] = compile_rule(&list->rules[i], &c) ? c.group : -1;
+        actions[i] = c.action;
+        sorted[i] = list->rules[i];
+    }
+
+    for (int chain = 0; chain < CHAIN_COUNT; chain++) {
+        int start[PROTO_COUNT], count[PROTO_COUNT] = {0}, total = 0;
+        for (int i = 0; i < list->count; i++) {
+            if (groups[i] >= 0 && groups[i] / PROTO_COUNT == chain) {
+                count[groups[i] % PROTO_COUNT]++;
+            }
+        }
+        for (int p = 0; p < PROTO_COUNT; p++) {
+            start[p] = total;
+            total += count[p];
+            count[p] = 0;
+        }
+        for (int i = 0; i < list->count; i++) {
+            if (groups[i] >= 0 && groups[i] / PROTO_COUNT == chain) {
+                HotRule* entry = &hot[start[groups[i] % PROTO_COUNT] + count[groups[i] % PROTO_COUNT]++];
+                entry->hits = hits[i];
+                entry->index = i;
+            }
+        }
+        for (int p = 0; p < PROTO_COUNT; p++) {
+            HotRule* rules = &hot[start[p]];
+            for (int first = 0, last; first < count[p]; first = last) {
+                int action = actions[rules[first].index];
+                last = first + 1;
+                while (last < count[p] && action != ACTION_LOG && actions[rules[last].index] == action) {
+                    last++;
+                }
+                qsort(&rules[first], last - first, sizeof(HotRule), compare_hot);
+            }
         }
-        if (strlen(current->rule.source_ip) > 0) {
-            fprintf(fp, " -s %s", current->rule.source_ip);
+
+        // Fill the chain's positions, taking the hottest protocol head
+        int taken[PROTO_COUNT] = {0};
+        for (int i = 0; i < list->count; i++) {
+            if (groups[i] < 0 || groups[i] / PROTO_COUNT != chain) {
+                continue;
+            }
+            int best = -1;
+            for (int p = 0; p < PROTO_COUNT; p++) {
+                if (taken[p] < count[p] &&
+                    (best < 0 || hot[start[p] + taken[p]].hits > hot[start[best] + taken[best]].hits)) {
+                    best = p;
+                }
+            }
+            sorted[i] = list->rules[hot[start[best] + taken[best]++].index];
         }
-        if (strlen(current->rule.dest_ip) > 0) {
-            fprintf(fp, " -d %s", current->rule.dest_ip);
+    }
+    memcpy(list->rules, sorted, list->count * sizeof(FirewallRule));
+    free(hot);
+    free(groups);
+    free(actions);
+    free(sorted);
+    return 1;
+}
+
+// Report the rules that can never match and how many neighbours could be
+// merged. Returns 0 if memory ran out.
+int analyze_rules(const RuleList* list) {
+    struct timespec start;
+    int* covered_by = malloc((list->count + 1) * sizeof(int));
+    RuleList live = {0};
+    uint64_t* hits = calloc(list->count + 1, sizeof(uint64_t));
+    int shadowed = 0, redundant = 0, shown = 0;
+    char text[96];
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    if (!covered_by || !hits || find_covered_rules(list, covered_by) < 0 ||
+        !reserve_rules(&live, list->count + 1)) {
+        printf("Memory allocation failed.\n");
+        free(covered_by);
+        free(hits);
+        free_rules(&live);
+        return 0;
+    }
+    for (int i = 0; i < list->count; i++) {
+        int by = covered_by[i];
+        if (by < 0) {
+            live.rules[live.count++] = list->rules[i];
+            continue;
         }
-        if (current->rule.source_port > 0) {
-            fprintf(fp, " --sport %d", current->rule.source_port);
+        int same = strcmp(list->rules[by].action, list->rules[i].action) == 0;
+        same ? redundant++ : shadowed++;
+        if (shown++ < 20) {
+            format_rule_csv(&list->rules[i], text, sizeof(text));
+            printf("Rule %d (%s) is %s by rule %d.\n", i, text, same ? "redundant" : "shadowed", by);
         }
-        if (current->rule.dest_port > 0) {
-            fprintf(fp, " --dport %d", current->rule.dest_port);
+    }
+    if (shown > 20) {
+        printf("... and %d more.\n", shown - 20);
+    }
+    int merged = merge_rules(&live, hits);
+    double ms = elapsed_ms(&start);
+
+    printf("Analyzed %d rules in %.1f ms:\n", list->count, ms);
+    printf("  %d shadowed (an earlier rule with another action covers them)\n", shadowed);
+    printf("  %d redundant (an earlier rule with the same action covers them)\n", redundant);
+    printf("  %d mergeable into the rule before them\n", merged);
+    printf("  %d rules remain after optimizing.\n", live.count);
+    free(covered_by);
+    free(hits);
+    free_rules(&live);
+    return 1;
+}
+
+// Replace the rules with an equivalent, smaller ruleset: drop the rules
+// that never match, merge neighbours and, given packet counters, put hot
+// rules first. counters is an iptables-save -c dump, "live" for the
+// running table, or "none". Returns 0 on failure.
+int optimize_rules(RuleList* list, const char* counters) {
+    int use_counters = strcmp(counters, "none") != 0;
+    int* covered_by = malloc((list->count + 1) * sizeof(int));
+    uint64_t* hits = calloc(list->count + 1, sizeof(uint64_t));
+    int before = list->count;
+
+    if (!covered_by || !hits) {
+        printf("Memory allocation failed.\n");
+        free(covered_by);
+        free(hits);
+        return 0;
+    }
+    if ((use_counters && !read_counters(list, counters, hits)) ||
+        find_covered_rules(list, covered_by) < 0) {
+        free(covered_by);
+        free(hits);
+        return 0;
+    }
+    int kept = 0;
+    for (int i = 0; i < list->count; i++) {
+        if (covered_by[i] < 0) {
+            list->rules[kept] = list->rules[i];
+            hits[kept++] = hits[i];
         }
-        fprintf(fp, " -j %s\n", current->rule.action);
-        current = current->next;
     }
-    fprintf(fp, "COMMIT\n");
-    fclose(fp);
+    int dead = list->count - kept;
+    list->count = kept;
+    int merged = merge_rules(list, hits);
+    int ok = !use_counters || reorder_rules(list, hits);
+    free(covered_by);
+    free(hits);
+    if (ok) {
+        printf("Optimized %d rules to %d: %d never matched, %d merged%s.\n", before, list->count,
+               dead, merged, use_counters ? ", hottest first" : "");
+    }
+    return ok;
+}
+
+// Read a packet from the user and show which rule decides it
+void test_packet(const RuleList* list) {
+    char chain[10], protocol[5], source_ip[16], dest_ip[16];
+    int source_port, dest_port, prefix_len;
+    PacketTuple packet;
+
+    printf("Enter chain (INPUT, OUTPUT, FORWARD): ");
+    scanf("%9s", chain);
+    printf("Enter protocol (TCP, UDP, ICMP): ");
+    scanf("%4s", protocol);
+    printf("Enter source IP: ");
+    scanf("%15s", source_ip);
+    printf("Enter destination IP: ");
+    scanf("%15s", dest_ip);
+    printf("Enter source port: ");
+    scanf("%d", &source_port);
+    printf("Enter destination port: ");
+    scanf("%d", &dest_port);
+
+    int chain_id = parse_chain(chain);
+    int protocol_id = parse_protocol(protocol);
+    if (chain_id < 0 || protocol_id < 0 || !parse_cidr(source_ip, &packet.source, &prefix_len) ||
+        !parse_cidr(dest_ip, &packet.dest, &prefix_len) || source_port < 0 || source_port > 65535 ||
+        dest_port < 0 || dest_port > 65535) {
+        printf("Invalid packet.\n");
+        return;
+    }
+    packet.chain = chain_id;
+    packet.protocol = protocol_id;
+    packet.source_port = source_port;
+    packet.dest_port = dest_port;
 
-    // Apply the rules
-    char command[256];
-    sprintf(command, "iptables-restore < %s", template);
-    int result = system(command);
-    if (result != 0) {
-        printf("Error applying rules. Ensure you have root privileges.\n");
+    CompiledRuleset* set = compile_rules(list);
+    if (!set) {
+        printf("Memory allocation failed.\n");
+        return;
+    }
+    int rule_index;
+    int action = match_packet(set, &packet, &rule_index);
+    if (rule_index < 0) {
+        printf("Verdict: %s (no rule matched, chain policy)\n", action_names[action]);
     } else {
-        printf("Rules applied successfully.\n");
+        printf("Verdict: %s (rule %d)\n", action_names[action], rule_index);
     }
-    unlink(template); // Remove the temporary file
+
+    // Time the lookup on the compiled set
+    const int rounds = 1000000;
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < rounds; i++) {
+        packet.source_port = source_port + (i & 1);
+        match_packet(set, &packet, &rule_index);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + (end.tv_nsec - start.tv_nsec);
+    printf("Lookup time: %.1f ns over %d compiled rules.\n", ns / rounds, set->rule_count);
+    free_compiled(set);
+}
+
+void print_usage(const char* program) {
+    printf("Usage: %s [command [argument]]...\n", program);
+    printf("Without commands the interactive menu starts. Commands run in order:\n");
+    printf("  load FILE          replace the rules with those of FILE (- for stdin)\n");
+    printf("  import FILE        append the rules of FILE (- for stdin)\n");
+    printf("  add RULE           append chain,source,dest,sport,dport,protocol,action\n");
+    printf("  delete INDEX       delete one rule\n");
+    printf("  delete-where KEYS  delete the rules matching key=value,... with keys\n");
+    printf("                     chain, protocol, action, source, dest, sport, dport\n");
+    printf("  list               list the rules\n");
+    printf("  save FILE          save the rules\n");
+    printf("  snapshot FILE      save the rules as a binary snapshot, which load reads\n");
+    printf("  bench FILE         time loading a CSV rule file each way\n");
+    printf("  apply              apply with iptables, changing only what differs\n");
+    printf("  preview DUMP       print the iptables changes against an iptables-save file\n");
+    printf("  apply-nft          apply with nftables\n");
+    printf("  preview-nft        print the nftables ruleset\n");
+    printf("  analyze            report shadowed, redundant and mergeable rules\n");
+    printf("  optimize COUNTERS  drop dead rules, merge neighbours and, given an\n");
+    printf("                     iptables-save -c dump or live, put hot rules first;\n");
+    printf("                     none skips the reordering\n");
 }
 
-// Free the linked list
-void free_rules(RuleNode* head) {
-    RuleNode* current = head;
-    while (current != NULL) {
-        RuleNode* temp = current;
-        current = current->next;
-        free(temp);
+// Run the commands given on the command line, stopping at the first one
+// that fails. Returns the exit status.
+int run_batch(RuleList* list, int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        const char* command = argv[i];
+        const char* argument = i + 1 < argc ? argv[i + 1] : NULL;
+        int needs_argument = strcmp(command, "load") == 0 || strcmp(command, "import") == 0 ||
+                             strcmp(command, "add") == 0 || strcmp(command, "delete") == 0 ||
+                             strcmp(command, "delete-where") == 0 || strcmp(command, "save") == 0 ||
+                             strcmp(command, "preview") == 0 || strcmp(command, "snapshot") == 0 ||
+                             strcmp(command, "bench") == 0 || strcmp(command, "optimize") == 0;
+        int ok;
+
+        if (needs_argument && !argument) {
+            printf("Missing argument for %s.\n", command);
+            return 2;
+        }
+        if (strcmp(command, "load") == 0) {
+            ok = load_rules(list, argument);
+        } else if (strcmp(command, "import") == 0) {
+            ok = import_rules(list, argument);
+        } else if (strcmp(command, "add") == 0) {
+            FirewallRule rule;
+            ok = parse_rule_line(argument, &rule) > 0;
+            if (!ok) {
+                printf("Invalid rule: %s\n", argument);
+            } else {
+                ok = append_rule(list, &rule);
+            }
+        } else if (strcmp(command, "delete") == 0) {
+            char* end;
+            long index = strtol(argument, &end, 10);
+            ok = end != argument && *end == '\0' && delete_rule(list, index);
+        } else if (strcmp(command, "delete-where") == 0) {
+            RuleFilter filter;
+            ok = parse_filter(argument, &filter);
+            if (!ok) {
+                printf("Invalid filter: %s\n", argument);
+            } else {
+                delete_matching(list, &filter);
+            }
+        } else if (strcmp(command, "list") == 0) {
+            list_rules(list);
+            ok = 1;
+        } else if (strcmp(command, "save") == 0) {
+            ok = save_rules(list, argument);
+        } else if (strcmp(command, "snapshot") == 0) {
+            ok = save_snapshot(list, argument);
+        } else if (strcmp(command, "bench") == 0) {
+            ok = benchmark_load(argument);
+        } else if (strcmp(command, "apply") == 0) {
+            ok = apply_rules(list, NULL, 0);
+        } else if (strcmp(command, "preview") == 0) {
+            ok = apply_rules(list, argument, 1);
+        } else if (strcmp(command, "apply-nft") == 0) {
+            ok = apply_rules_nft(list, 0);
+        } else if (strcmp(command, "preview-nft") == 0) {
+            ok = apply_rules_nft(list, 1);
+        } else if (strcmp(command, "analyze") == 0) {
+            ok = analyze_rules(list);
+        } else if (strcmp(command, "optimize") == 0) {
+            ok = optimize_rules(list, argument);
+        } else {
+            print_usage(argv[0]);
+            return 2;
+        }
+        if (!ok) {
+            return 1;
+        }
+        i += needs_argument;
     }
+    return 0;
 }
 
-// Main function with menu-driven interface
-int main() {
-    RuleNode* rules = NULL;
+// Main function with menu-driven interface, or batch mode when commands
+// are given
+int main(int argc, char* argv[]) {
+    RuleList rules = {0};
     int choice;
     char filename[256];
 
+    if (argc > 1) {
+        int status = run_batch(&rules, argc, argv);
+        free_rules(&rules);
+        return status;
+    }
+
     do {
         printf("\nFirewall Management Program\n");
         printf("1. Add rule\n");
@@ -296,7 +2561,12 @@ int main() {
         printf("4. Save rules\n");
         printf("5. Load rules\n");
         printf("6. Apply rules\n");
-        printf("7. Exit\n");
+        printf("7. Test packet\n");
+        printf("8. Preview apply against an iptables-save file\n");
+        printf("9. Apply rules with nftables\n");
+        printf("10. Preview nftables ruleset\n");
+        printf("11. Analyze rules\n");
+        printf("12. Exit\n");
         printf("Enter choice: ");
         if (scanf("%d", &choice) != 1) {
             printf("Invalid input. Please enter a number.\n");
@@ -309,7 +2579,7 @@ int main() {
                 add_rule(&rules);
                 break;
             case 2:
-                list_rules(rules);
+                list_rules(&rules);
                 int index;
                 printf("Enter index to delete: ");
                 if (scanf("%d", &index) != 1) {
@@ -320,12 +2590,12 @@ int main() {
                 delete_rule(&rules, index);
                 break;
             case 3:
-                list_rules(rules);
+                list_rules(&rules);
                 break;
             case 4:
                 printf("Enter filename to save: ");
                 scanf("%255s", filename);
-                save_rules(rules, filename);
+                save_rules(&rules, filename);
                 break;
             case 5:
                 printf("Enter filename to load: ");
@@ -333,17 +2603,34 @@ int main() {
                 load_rules(&rules, filename);
                 break;
             case 6:
-                apply_rules(rules);
+                apply_rules(&rules, NULL, 0);
                 break;
             case 7:
-                free_rules(rules);
+                test_packet(&rules);
+                break;
+            case 8:
+                printf("Enter iptables-save file: ");
+                scanf("%255s", filename);
+                apply_rules(&rules, filename, 1);
+                break;
+            case 9:
+                apply_rules_nft(&rules, 0);
+                break;
+            case 10:
+                apply_rules_nft(&rules, 1);
+                break;
+            case 11:
+                analyze_rules(&rules);
+                break;
+            case 12:
+                free_rules(&rules);
                 printf("Exiting program.\n");
                 return 0;
             default:
-                printf("Invalid choice. Please select 1-7.\n");
+                printf("Invalid choice. Please select 1-12.\n");
         }
     } while (1);
 
     return 0;
 }
-​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​​
+
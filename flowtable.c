@@ -0,0 +1,362 @@
+/*
+ * IPv4 flow table, see flowtable.h.
+ *
+ * The index holds a copy of each flow's hash next to its pool index, so
+ * probing reads eight slots per cache line and only touches a flow on a
+ * hash match. It stays at most half full and removals shift later slots
+ * back instead of leaving tombstones. Pool indexes never move, which lets
+ * the timer wheel and free list link flows by index.
+ *
+ * The wheel is lazy: a flow is filed under the second it would expire
+ * when created and is not moved when packets arrive. When the wheel
+ * reaches that second the flow is either expired or filed again under
+ * its new deadline, so a busy flow costs nothing per packet.
+ */
+
+#include "flowtable.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <netinet/in.h>
+#include <netinet/ip.h>
+#include <netinet/tcp.h>
+#include <netinet/if_ether.h>
+#include <arpa/inet.h>
+
+#define WHEEL_SLOTS 256              // Seconds; longer timeouts go round again
+
+struct slot {
+    uint32_t hash;
+    int32_t flow;                    // -1 when empty
+};
+
+struct flowtable {
+    pthread_mutex_t lock;
+    struct flow *flows;
+    int capacity;
+    int free_list;
+    struct slot *index;
+    uint32_t mask;
+    int32_t wheel[WHEEL_SLOTS];
+    time_t wheel_now;                // Last second the wheel has processed
+    struct flowtable_stat stat;
+};
+
+struct flow_key {
+    uint32_t src, dst;
+    uint16_t sport, dport;
+    uint8_t proto;
+};
+
+/* The same hash for both directions, so replies find their flow */
+static uint32_t hash_key(const struct flow_key *k) {
+    uint64_t a = (uint64_t)k->src << 16 | k->sport;
+    uint64_t b = (uint64_t)k->dst << 16 | k->dport;
+    uint64_t h = (a < b ? a : b) * 0x9e3779b97f4a7c15ull;
+
+    h ^= (a < b ? b : a) + k->proto;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    return h ^ (h >> 29);
+}
+
+/* 0 when the packet goes from flow side 0 to side 1, 1 for the reverse,
+ * -1 when it belongs to another flow */
+static int match_flow(const struct flow *f, const struct flow_key *k) {
+    if (f->proto != k->proto) {
+        return -1;
+    }
+    if (f->addr[0] == k->src && f->port[0] == k->sport && f->addr[1] == k->dst && f->port[1] == k->dport) {
+        return 0;
+    }
+    if (f->addr[0] == k->dst && f->port[0] == k->dport && f->addr[1] == k->src && f->port[1] == k->sport) {
+        return 1;
+    }
+    return -1;
+}
+
+static int flow_timeout(const struct flow *f) {
+    switch (f->state) {
+        case FLOW_ESTABLISHED:
+            return FLOW_TCP_TIMEOUT;
+        case FLOW_CLOSED:
+            return FLOW_CLOSED_TIMEOUT;
+        case FLOW_ACTIVE:
+            return f->proto == IPPROTO_UDP ? FLOW_UDP_TIMEOUT : FLOW_SHORT_TIMEOUT;
+        default:
+            return FLOW_SHORT_TIMEOUT;
+    }
+}
+
+/* File a flow under the second it expires, or as far ahead as the wheel
+ * reaches */
+static void schedule(struct flowtable *t, int i, time_t when) {
+    if (when <= t->wheel_now) {
+        when = t->wheel_now + 1;
+    } else if (when - t->wheel_now >= WHEEL_SLOTS) {
+        when = t->wheel_now + WHEEL_SLOTS - 1;
+    }
+    int s = when % WHEEL_SLOTS;
+    t->flows[i].next = t->wheel[s];
+    t->wheel[s] = i;
+}
+
+static void remove_flow(struct flowtable *t, int i, uint32_t hash) {
+    uint32_t pos = hash & t->mask;
+
+    while (t->index[pos].flow != i) {
+        pos = (pos + 1) & t->mask;
+    }
+    // Backward shift: pull up later slots whose home is at or before the gap
+    for (uint32_t next = (pos + 1) & t->mask; t->index[next].flow >= 0; next = (next + 1) & t->mask) {
+        uint32_t home = t->index[next].hash & t->mask;
+        if (((next - home) & t->mask) >= ((next - pos) & t->mask)) {
+            t->index[pos] = t->index[next];
+            pos = next;
+        }
+    }
+    t->index[pos].flow = -1;
+
+    t->flows[i].state = FLOW_FREE;
+    t->flows[i].next = t->free_list;
+    t->free_list = i;
+    t->stat.active--;
+    t->stat.expired++;
+}
+
+static uint32_t flow_hash(const struct flow *f) {
+    struct flow_key k = { f->addr[0], f->addr[1], f->port[0], f->port[1], f->proto };
+    return hash_key(&k);
+}
+
+/* Process every second up to now */
+static void advance(struct flowtable *t, time_t now) {
+    if (t->wheel_now == 0) {
+        t->wheel_now = now;
+        return;
+    }
+    // A jump past a whole turn visits every slot once
+    if (now - t->wheel_now > WHEEL_SLOTS) {
+        t->wheel_now = now - WHEEL_SLOTS;
+    }
+    while (t->wheel_now < now) {
+        t->wheel_now++;
+        int s = t->wheel_now % WHEEL_SLOTS;
+        int i = t->wheel[s];
+        t->wheel[s] = -1;
+        while (i >= 0) {
+            struct flow *f = &t->flows[i];
+            int next = f->next;
+            time_t deadline = (time_t)f->last_seen + flow_timeout(f);
+            if (deadline <= t->wheel_now) {
+                remove_flow(t, i, flow_hash(f));
+            } else {
+                schedule(t, i, deadline);
+            }
+            i = next;
+        }
+    }
+}
+
+static void track_tcp(struct flow *f, int dir, uint8_t flags) {
+    f->tcp_flags |= flags;
+    if (flags & TH_RST) {
+        f->state = FLOW_CLOSED;
+    } else if (flags & TH_FIN) {
+        f->fin |= 1 << dir;
+        f->state = f->fin == 3 ? FLOW_CLOSED : FLOW_CLOSING;
+    } else if ((flags & (TH_SYN | TH_ACK)) == TH_SYN) {
+        // A new connection, possibly reusing the ports of a closed one
+        if (f->state == FLOW_NEW || f->state == FLOW_CLOSED) {
+            f->state = FLOW_SYN_SENT;
+            f->fin = 0;
+        }
+    } else if (f->state == FLOW_NEW) {
+        // Picked up mid-stream
+        f->state = FLOW_ESTABLISHED;
+    } else if (f->state == FLOW_SYN_SENT && dir == 1 && (flags & (TH_SYN | TH_ACK)) == (TH_SYN | TH_ACK)) {
+        f->state = FLOW_SYN_RECEIVED;
+    } else if (f->state == FLOW_SYN_RECEIVED && dir == 0 && (flags & TH_ACK)) {
+        f->state = FLOW_ESTABLISHED;
+    }
+}
+
+/* Find the flow for k or start one; -1 when the table is full */
+static int lookup(struct flowtable *t, const struct flow_key *k, uint32_t hash, time_t now, int *dir) {
+    uint32_t pos = hash & t->mask;
+
+    for (; t->index[pos].flow >= 0; pos = (pos + 1) & t->mask) {
+        if (t->index[pos].hash == hash && (*dir = match_flow(&t->flows[t->index[pos].flow], k)) >= 0) {
+            return t->index[pos].flow;
+        }
+    }
+    if (t->free_list < 0) {
+        t->stat.overflow++;
+        return -1;
+    }
+
+    int i = t->free_list;
+    struct flow *f = &t->flows[i];
+    t->free_list = f->next;
+    memset(f, 0, sizeof(*f));
+    f->addr[0] = k->src;
+    f->addr[1] = k->dst;
+    f->port[0] = k->sport;
+    f->port[1] = k->dport;
+    f->proto = k->proto;
+    f->state = k->proto == IPPROTO_TCP ? FLOW_NEW : FLOW_ACTIVE;
+    f->first_seen = f->last_seen = now;
+    t->index[pos].hash = hash;
+    t->index[pos].flow = i;
+    t->stat.active++;
+    t->stat.created++;
+    // Filed under its shortest possible deadline; the wheel refiles it
+    schedule(t, i, now + FLOW_CLOSED_TIMEOUT);
+    *dir = 0;
+    return i;
+}
+
+void flowtable_packet(struct flowtable *t, const struct pcap_pkthdr *header, const u_char *packet) {
+    const struct ether_header *eth = (const struct ether_header *)packet;
+    size_t caplen = header->caplen;
+    struct flow_key k = {0};
+    uint8_t tcp_flags = 0;
+
+    if (caplen < sizeof(struct ether_header) + sizeof(struct ip) || ntohs(eth->ether_type) != ETHERTYPE_IP) {
+        return;
+    }
+    const struct ip *ip = (const struct ip *)(packet + sizeof(struct ether_header));
+    size_t ip_len = ip->ip_hl * 4;
+    if (ip->ip_v != 4 || ip_len < sizeof(struct ip)) {
+        return;
+    }
+    k.src = ip->ip_src.s_addr;
+    k.dst = ip->ip_dst.s_addr;
+    k.proto = ip->ip_p;
+
+    // Ports come from the first fragment only; later ones have no header
+    const u_char *l4 = (const u_char *)ip + ip_len;
+    size_t l4_len = caplen - sizeof(struct ether_header) > ip_len ? caplen - sizeof(struct ether_header) - ip_len : 0;
+    if ((ntohs(ip->ip_off) & IP_OFFMASK) == 0 && (k.proto == IPPROTO_TCP || k.proto == IPPROTO_UDP) && l4_len >= 4) {
+        k.sport = l4[0] << 8 | l4[1];
+        k.dport = l4[2] << 8 | l4[3];
+        if (k.proto == IPPROTO_TCP && l4_len >= 14) {
+            tcp_flags = l4[13];
+        }
+    }
+
+    uint32_t hash = hash_key(&k);
+    time_t now = header->ts.tv_sec;
+    int dir;
+
+    pthread_mutex_lock(&t->lock);
+    if (now > t->wheel_now) {
+        advance(t, now);
+    }
+    int i = lookup(t, &k, hash, now, &dir);
+    if (i >= 0) {
+        struct flow *f = &t->flows[i];
+        f->packets[dir]++;
+        f->bytes[dir] += header->len;
+        if ((uint32_t)now > f->last_seen) {
+            f->last_seen = now;
+        }
+        if (k.proto == IPPROTO_TCP) {
+            track_tcp(f, dir, tcp_flags);
+        }
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+void flowtable_expire(struct flowtable *t, time_t now) {
+    pthread_mutex_lock(&t->lock);
+    if (now > t->wheel_now && t->wheel_now != 0) {
+        advance(t, now);
+    }
+    pthread_mutex_unlock(&t->lock);
+}
+
+static uint64_t flow_bytes(const struct flow *f) {
+    return f->bytes[0] + f->bytes[1];
+}
+
+int flowtable_top(struct flowtable *t, struct flow *out, int n, int port) {
+    int count = 0;
+
+    pthread_mutex_lock(&t->lock);
+    for (int i = 0; i < t->capacity; i++) {
+        const struct flow *f = &t->flows[i];
+        if (f->state == FLOW_FREE || (port && f->port[0] != port && f->port[1] != port)) {
+            continue;
+        }
+        // Insertion into a short sorted list
+        if (count == n && flow_bytes(f) <= flow_bytes(&out[n - 1])) {
+            continue;
+        }
+        int j = count < n ? count++ : n - 1;
+        while (j > 0 && flow_bytes(&out[j - 1]) < flow_bytes(f)) {
+            out[j] = out[j - 1];
+            j--;
+        }
+        out[j] = *f;
+    }
+    pthread_mutex_unlock(&t->lock);
+    return count;
+}
+
+void flowtable_stats(struct flowtable *t, struct flowtable_stat *stat) {
+    pthread_mutex_lock(&t->lock);
+    *stat = t->stat;
+    pthread_mutex_unlock(&t->lock);
+}
+
+const char *flow_state_name(int state) {
+    static const char *names[] = {
+        "FREE", "NEW", "ACTIVE", "SYN_SENT", "SYN_RECEIVED", "ESTABLISHED", "CLOSING", "CLOSED"
+    };
+    return state >= 0 && state <= FLOW_CLOSED ? names[state] : "?";
+}
+
+struct flowtable *flowtable_create(int capacity) {
+    struct flowtable *t = calloc(1, sizeof(*t));
+    uint32_t slots = 16;
+
+    if (!t || capacity < 1) {
+        free(t);
+        return NULL;
+    }
+    while (slots < (uint32_t)capacity * 2) {
+        slots <<= 1;
+    }
+    t->flows = aligned_alloc(64, (size_t)capacity * sizeof(struct flow));
+    t->index = malloc(slots * sizeof(struct slot));
+    if (!t->flows || !t->index) {
+        flowtable_destroy(t);
+        return NULL;
+    }
+    pthread_mutex_init(&t->lock, NULL);
+    t->capacity = capacity;
+    t->mask = slots - 1;
+    memset(t->flows, 0, (size_t)capacity * sizeof(struct flow));
+    for (int i = 0; i < capacity; i++) {
+        t->flows[i].next = i + 1 < capacity ? i + 1 : -1;
+    }
+    t->free_list = 0;
+    memset(t->index, 0xff, slots * sizeof(struct slot));
+    memset(t->wheel, 0xff, sizeof(t->wheel));
+    return t;
+}
+
+void flowtable_destroy(struct flowtable *t) {
+    if (!t) {
+        return;
+    }
+    if (t->flows) {
+        pthread_mutex_destroy(&t->lock);
+    }
+    free(t->flows);
+    free(t->index);
+    free(t);
+}
@@ -0,0 +1,84 @@
+/*
+ * Connection tracking for the packet tools
+ * ----------------------------------------
+ * A fixed-size table of IPv4 flows keyed on the 5-tuple, counting bytes
+ * and packets in each direction along with TCP flags and state. Flows
+ * live in a preallocated pool and are found through an open-addressing
+ * index, so a packet costs a hash, a short probe and no allocation. Idle
+ * flows are expired through a one-second timer wheel driven by packet
+ * timestamps.
+ *
+ * Each table has its own lock, which only the packet path and the
+ * occasional report take; give every capture thread its own table.
+ */
+
+#ifndef FLOWTABLE_H
+#define FLOWTABLE_H
+
+#include <stdint.h>
+#include <time.h>
+#include <pcap.h>
+
+#define FLOWTABLE_SIZE 65536         // Flows per table
+#define FLOW_TCP_TIMEOUT 300         // Seconds idle before an established TCP flow expires
+#define FLOW_UDP_TIMEOUT 60
+#define FLOW_SHORT_TIMEOUT 30        // Handshakes in progress and other protocols
+#define FLOW_CLOSED_TIMEOUT 10       // TCP after FIN from both sides or RST
+
+enum flow_state {
+    FLOW_FREE,
+    FLOW_NEW,                        // TCP before its first flags are seen
+    FLOW_ACTIVE,                     // Any flow that is not TCP
+    FLOW_SYN_SENT,
+    FLOW_SYN_RECEIVED,
+    FLOW_ESTABLISHED,
+    FLOW_CLOSING,                    // FIN from one side
+    FLOW_CLOSED
+};
+
+/* Direction 0 is from the side that sent the first packet seen */
+struct flow {
+    uint32_t addr[2];                // Network byte order
+    uint16_t port[2];                // Host byte order, 0 without ports
+    uint8_t proto;
+    uint8_t state;
+    uint8_t tcp_flags;               // Every flag seen in either direction
+    uint8_t fin;                     // Bit per direction that sent a FIN
+    int32_t next;                    // Timer wheel or free list link
+    uint32_t first_seen;
+    uint32_t last_seen;
+    uint64_t packets[2];
+    uint64_t bytes[2];
+} __attribute__((aligned(64)));
+
+struct flowtable_stat {
+    unsigned active;
+    unsigned long long created;
+    unsigned long long expired;
+    unsigned long long overflow;     // Packets of new flows that found the table full
+};
+
+struct flowtable;
+
+/* Room for capacity flows; returns NULL when out of memory */
+struct flowtable *flowtable_create(int capacity);
+
+/* Account one Ethernet frame; anything but IPv4 is ignored */
+void flowtable_packet(struct flowtable *t, const struct pcap_pkthdr *header, const u_char *packet);
+
+/* Expire idle flows up to now, for tables that see no packets */
+void flowtable_expire(struct flowtable *t, time_t now);
+
+/* Copy up to n flows with the most bytes into out, largest first. With
+ * port set only flows using that port on either side count. Returns the
+ * number copied. */
+int flowtable_top(struct flowtable *t, struct flow *out, int n, int port);
+
+void flowtable_stats(struct flowtable *t, struct flowtable_stat *stat);
+
+/* Name of a flow state for display */
+const char *flow_state_name(int state);
+
+void flowtable_destroy(struct flowtable *t);
+
+#endif
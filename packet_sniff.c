@@ -10,12 +10,23 @@
  * - Identifies protocols (TCP, UDP, ICMP).
  * - Displays packet size and source/destination information.
  * - Works on a specified network interface (default: eth0).
+ * - Multi-worker mode (-w): a PACKET_FANOUT group with one pinned worker
+ *   per core, each counting packets and protocols on its own; the totals
+ *   are merged and printed every few seconds.
+ * - Tracks connections by 5-tuple (bytes, packets, TCP state, first and
+ *   last seen) and shows the top talkers every few seconds with -t or -w.
  *
  * Compilation:
- *  gcc -o packet_sniff packet_sniff.c -lpcap
+ *  gcc -o packet_sniff packet_sniff.c resolver.c fanout.c flowtable.c -lpcap -lpthread
  *
  * Usage:
- *  sudo ./packet_sniff [interface]
+ *  sudo ./packet_sniff [-w workers] [-B ring_mb] [-t] [-p port] [-f flows] [interface]
+ *
+ *  -w  Number of fanout workers, 0 for one per CPU
+ *  -B  Ring size per worker in megabytes (default 32)
+ *  -t  Show the top talkers instead of printing every packet
+ *  -p  Only list flows to or from this port among the top talkers
+ *  -f  Flows tracked per capture thread (default 65536)
  *
  * Dependencies:
  *  - libpcap (Install with `sudo apt install libpcap-dev`)
@@ -40,27 +51,37 @@
 #include <netdb.h>
 #include <string.h>
 #include <unistd.h>
+#include <signal.h>
+#include <time.h>
+#include "resolver.h"
+#include "fanout.h"
+#include "flowtable.h"
 
 #define SNAP_LEN 1518  // Max packet size to capture
 #define DEFAULT_INTERFACE "eth0"
 #define DELAY 200000    // 200ms delay in microseconds (200,000 μs)
+#define STATS_INTERVAL 5 // Seconds between merged worker statistics
+#define TOP_TALKERS 10   // Flows listed in the top talkers view
 
-/* Function to resolve IP address to hostname */
-const char *resolve_hostname(const char *ip_address) {
-    struct in_addr addr;
-    struct hostent *host_entry;
-
-    if (!inet_aton(ip_address, &addr)) {
-        return ip_address;
-    }
-
-    host_entry = gethostbyaddr(&addr, sizeof(addr), AF_INET);
-    if (host_entry) {
-        return host_entry->h_name;
-    }
+/* Counters owned by one worker. Only the owner writes them; the main
+ * thread reads them when merging. The alignment keeps workers off each
+ * other's cache lines. */
+struct worker_stats {
+    unsigned long long packets;
+    unsigned long long bytes;
+    unsigned long long tcp;
+    unsigned long long udp;
+    unsigned long long icmp;
+    unsigned long long other;
+    struct flowtable *flows;    // This worker's connections
+} __attribute__((aligned(64)));
 
-    return ip_address;
-}
+static struct fanout *fanout;
+static pcap_t *handle;
+static struct flowtable *flows; // Connections seen by the pcap handle
+static int top_mode;            // Top talkers instead of packet lines
+static int top_port;            // Top talkers filter, 0 for all ports
+static volatile sig_atomic_t stopping;
 
 /* Function to print protocol information */
 void print_protocol_info(uint8_t protocol) {
@@ -84,8 +105,14 @@ void print_protocol_info(uint8_t protocol) {
 void packet_handler(u_char *args, const struct pcap_pkthdr *header, const u_char *packet) {
     struct ether_header *eth_header = (struct ether_header *)packet;
 
-    // Only process IP packets
-    if (ntohs(eth_header->ether_type) != ETHERTYPE_IP) {
+    flowtable_packet(flows, header, packet);
+    if (top_mode) {
+        return;
+    }
+
+    // Only process IP packets that were captured past the IP header
+    if (header->caplen < sizeof(struct ether_header) + sizeof(struct ip) ||
+        ntohs(eth_header->ether_type) != ETHERTYPE_IP) {
         return;
     }
 
@@ -97,9 +124,10 @@ void packet_handler(u_char *args, const struct pcap_pkthdr *header, const u_char
     inet_ntop(AF_INET, &(ip_header->ip_src), source_ip, INET_ADDRSTRLEN);
     inet_ntop(AF_INET, &(ip_header->ip_dst), dest_ip, INET_ADDRSTRLEN);
 
-    // Resolve hostnames
-    const char *source_hostname = resolve_hostname(source_ip);
-    const char *dest_hostname = resolve_hostname(dest_ip);
+    // Cached names only; misses show the IP until a worker resolves them
+    char source_hostname[NI_MAXHOST], dest_hostname[NI_MAXHOST];
+    resolver_lookup(ip_header->ip_src.s_addr, source_hostname, sizeof(source_hostname));
+    resolver_lookup(ip_header->ip_dst.s_addr, dest_hostname, sizeof(dest_hostname));
 
     // Print packet details
     printf("\nPacket Captured - Size: %d bytes\n", header->len);
@@ -113,30 +141,344 @@ void packet_handler(u_char *args, const struct pcap_pkthdr *header, const u_char
     usleep(DELAY);  // 200ms (200,000 microseconds)
 }
 
+/* Single-writer counter update; a plain add on x86 but still a defined
+ * read for the merging thread */
+static inline void count(unsigned long long *counter, unsigned long long n) {
+    __atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+}
+
+/* Worker handler: classify the packet into the worker's own counters */
+void worker_handler(u_char *args, const struct pcap_pkthdr *header, const u_char *packet) {
+    struct worker_stats *stats = (struct worker_stats *)args;
+    struct ether_header *eth_header = (struct ether_header *)packet;
+
+    flowtable_packet(stats->flows, header, packet);
+    count(&stats->packets, 1);
+    count(&stats->bytes, header->len);
+    if (header->caplen < sizeof(struct ether_header) + sizeof(struct ip) ||
+        ntohs(eth_header->ether_type) != ETHERTYPE_IP) {
+        count(&stats->other, 1);
+        return;
+    }
+
+    struct ip *ip_header = (struct ip *)(packet + sizeof(struct ether_header));
+    switch (ip_header->ip_p) {
+        case IPPROTO_TCP:
+            count(&stats->tcp, 1);
+            break;
+        case IPPROTO_UDP:
+            count(&stats->udp, 1);
+            break;
+        case IPPROTO_ICMP:
+            count(&stats->icmp, 1);
+            break;
+        default:
+            count(&stats->other, 1);
+            break;
+    }
+}
+
+void stop_capture(int sig) {
+    (void)sig;
+    stopping = 1;
+    if (fanout) {
+        fanout_stop(fanout);
+    }
+    if (handle) {
+        pcap_breakloop(handle);
+    }
+}
+
+/* Byte count with a unit that keeps it short */
+void format_bytes(uint64_t bytes, char *out, size_t size) {
+    const char *units[] = { "B", "KB", "MB", "GB", "TB" };
+    double value = bytes;
+    int unit = 0;
+
+    while (value >= 1024 && unit < 4) {
+        value /= 1024;
+        unit++;
+    }
+    snprintf(out, size, unit ? "%.1f %s" : "%.0f %s", value, units[unit]);
+}
+
+/* Print flows sorted by bytes, as returned by flowtable_top() */
+void print_top_talkers(const struct flow *top, int n, const struct flowtable_stat *stat) {
+    time_t now = time(NULL);
+
+    printf("\nTop talkers (%u active flows, %llu expired", stat->active, stat->expired);
+    if (stat->overflow) {
+        printf(", %llu packets untracked, table full", stat->overflow);
+    }
+    printf(")%s\n", n ? "" : ": none yet");
+    for (int i = 0; i < n; i++) {
+        const struct flow *f = &top[i];
+        char from[NI_MAXHOST], to[NI_MAXHOST], out[32], in[32];
+        const char *proto = f->proto == IPPROTO_TCP ? "TCP" : f->proto == IPPROTO_UDP ? "UDP" :
+                            f->proto == IPPROTO_ICMP ? "ICMP" : "OTHER";
+
+        // Cached names only, as for the packet lines
+        resolver_lookup(f->addr[0], from, sizeof(from));
+        resolver_lookup(f->addr[1], to, sizeof(to));
+        if (f->proto == IPPROTO_TCP || f->proto == IPPROTO_UDP) {
+            printf("  %-5s %s:%u -> %s:%u  %s\n", proto, from, f->port[0], to, f->port[1],
+                   flow_state_name(f->state));
+        } else {
+            printf("  %-5s %s -> %s\n", proto, from, to);
+        }
+        format_bytes(f->bytes[0], out, sizeof(out));
+        format_bytes(f->bytes[1], in, sizeof(in));
+        printf("        %llu/%llu packets, %s/%s out/in, %lds old, idle %lds",
+               (unsigned long long)f->packets[0], (unsigned long long)f->packets[1],
+               out, in, (long)(now - f->first_seen), (long)(now - f->last_seen));
+        if (f->proto == IPPROTO_TCP) {
+            printf(", flags %s%s%s%s%s%s",
+                   f->tcp_flags & TH_SYN ? "S" : "", f->tcp_flags & TH_ACK ? "A" : "",
+                   f->tcp_flags & TH_PUSH ? "P" : "", f->tcp_flags & TH_FIN ? "F" : "",
+                   f->tcp_flags & TH_RST ? "R" : "", f->tcp_flags & TH_URG ? "U" : "");
+        }
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+/* Expire idle flows in every worker table and list the biggest flows
+ * across all of them. The fanout hash keeps each flow in one table. */
+void print_worker_flows(struct worker_stats *workers, int n) {
+    struct flow *top = malloc((size_t)n * TOP_TALKERS * sizeof(struct flow));
+    struct flowtable_stat total = {0};
+    int count = 0;
+
+    if (!top) {
+        return;
+    }
+    for (int i = 0; i < n; i++) {
+        struct flowtable_stat stat;
+        flowtable_expire(workers[i].flows, time(NULL));
+        count += flowtable_top(workers[i].flows, top + count, TOP_TALKERS, top_port);
+        flowtable_stats(workers[i].flows, &stat);
+        total.active += stat.active;
+        total.expired += stat.expired;
+        total.overflow += stat.overflow;
+    }
+    // Each worker's list is sorted; a small insertion sort merges them
+    for (int i = 1; i < count; i++) {
+        struct flow f = top[i];
+        int j = i;
+        while (j > 0 && top[j - 1].bytes[0] + top[j - 1].bytes[1] < f.bytes[0] + f.bytes[1]) {
+            top[j] = top[j - 1];
+            j--;
+        }
+        top[j] = f;
+    }
+    print_top_talkers(top, count < TOP_TALKERS ? count : TOP_TALKERS, &total);
+    free(top);
+}
+
+/* Merge the per-worker counters and print totals, rates over the last
+ * interval and how the fanout spread the load */
+void print_worker_stats(struct worker_stats *workers, struct worker_stats *last, double seconds) {
+    struct worker_stats total = {0};
+    struct fanout_stat kernel;
+    int n = fanout_workers(fanout);
+
+    for (int i = 0; i < n; i++) {
+        total.packets += __atomic_load_n(&workers[i].packets, __ATOMIC_RELAXED);
+        total.bytes += __atomic_load_n(&workers[i].bytes, __ATOMIC_RELAXED);
+        total.tcp += __atomic_load_n(&workers[i].tcp, __ATOMIC_RELAXED);
+        total.udp += __atomic_load_n(&workers[i].udp, __ATOMIC_RELAXED);
+        total.icmp += __atomic_load_n(&workers[i].icmp, __ATOMIC_RELAXED);
+        total.other += __atomic_load_n(&workers[i].other, __ATOMIC_RELAXED);
+    }
+    if (seconds <= 0) {
+        seconds = 1e-9;
+    }
+
+    printf("\nPackets: %llu (%.0f pps, %.1f Mbit/s)\n", total.packets,
+           (total.packets - last->packets) / seconds,
+           (total.bytes - last->bytes) * 8 / seconds / 1e6);
+    printf("Protocol: TCP %llu  UDP %llu  ICMP %llu  OTHER %llu\n",
+           total.tcp, total.udp, total.icmp, total.other);
+    if (fanout_stats(fanout, &kernel) == 0) {
+        printf("Kernel: received %llu, dropped %llu\n", kernel.packets, kernel.drops);
+    }
+    for (int i = 0; i < n; i++) {
+        unsigned long long packets = __atomic_load_n(&workers[i].packets, __ATOMIC_RELAXED);
+        printf("  Worker %d (CPU %d): %llu packets (%.1f%%)\n", i, fanout_cpu(fanout, i), packets,
+               total.packets ? packets * 100.0 / total.packets : 0.0);
+    }
+    print_worker_flows(workers, n);
+    *last = total;
+}
+
+double monotonic_seconds(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* Capture with a fanout group until SIGINT/SIGTERM */
+int run_workers(const char *dev, int workers, int ring_mb, int flow_capacity) {
+    char errbuf[256];
+
+    fanout = fanout_open(dev, workers, ring_mb, errbuf, sizeof(errbuf));
+    if (fanout == NULL) {
+        fprintf(stderr, "Couldn't open device %s: %s\n", dev, errbuf);
+        return 2;
+    }
+
+    int n = fanout_workers(fanout);
+    struct worker_stats *stats = aligned_alloc(64, n * sizeof(struct worker_stats));
+    u_char **args = malloc(n * sizeof(u_char *));
+    if (!stats || !args) {
+        fprintf(stderr, "Out of memory\n");
+        free(stats);
+        free(args);
+        fanout_close(fanout);
+        return 1;
+    }
+    memset(stats, 0, n * sizeof(struct worker_stats));
+    int failed = 0;
+    for (int i = 0; i < n; i++) {
+        args[i] = (u_char *)&stats[i];
+        stats[i].flows = flowtable_create(flow_capacity);
+        failed |= stats[i].flows == NULL;
+    }
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = stop_capture;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+
+    if (failed || fanout_start(fanout, worker_handler, args) != 0) {
+        fprintf(stderr, failed ? "Out of memory\n" : "Couldn't start the capture workers\n");
+        fanout_close(fanout);
+        for (int i = 0; i < n; i++) {
+            flowtable_destroy(stats[i].flows);
+        }
+        free(stats);
+        free(args);
+        return 1;
+    }
+    printf("Listening on %s with %d workers...\n", dev, n);
+    fflush(stdout);
+
+    struct worker_stats last = {0};
+    double last_report = monotonic_seconds();
+    while (!stopping) {
+        sleep(1);
+        double now = monotonic_seconds();
+        if (stopping || now - last_report >= STATS_INTERVAL) {
+            print_worker_stats(stats, &last, now - last_report);
+            last_report = now;
+        }
+    }
+
+    fanout_close(fanout);
+    for (int i = 0; i < n; i++) {
+        flowtable_destroy(stats[i].flows);
+    }
+    free(stats);
+    free(args);
+    return 0;
+}
+
 /* Main function */
 int main(int argc, char *argv[]) {
     char *dev = DEFAULT_INTERFACE; // Default to eth0
     char errbuf[PCAP_ERRBUF_SIZE];
-    pcap_t *handle;
+    int workers = -1, ring_mb = FANOUT_RING_MB, flow_capacity = FLOWTABLE_SIZE, opt;
+
+    while ((opt = getopt(argc, argv, "w:B:tp:f:")) != -1) {
+        switch (opt) {
+            case 'w':
+                workers = atoi(optarg);
+                break;
+            case 'B':
+                ring_mb = atoi(optarg);
+                break;
+            case 't':
+                top_mode = 1;
+                break;
+            case 'p':
+                top_port = atoi(optarg);
+                break;
+            case 'f':
+                flow_capacity = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-w workers] [-B ring_mb] [-t] [-p port] [-f flows] [interface]\n", argv[0]);
+                return 1;
+        }
+    }
+    if (flow_capacity < 1 || top_port < 0 || top_port > 65535) {
+        fprintf(stderr, "Usage: %s [-w workers] [-B ring_mb] [-t] [-p port] [-f flows] [interface]\n", argv[0]);
+        return 1;
+    }
 
     // Allow user to specify interface
-    if (argc > 1) {
-        dev = argv[1];
+    if (optind < argc) {
+        dev = argv[optind];
+    }
+
+    if (resolver_init(RESOLVER_THREADS, RESOLVER_CACHE_SIZE) != 0) {
+        fprintf(stderr, "Couldn't start the hostname resolver, showing IPs only\n");
+    }
+
+    if (workers >= 0) {
+        int rc = run_workers(dev, workers, ring_mb, flow_capacity);
+        resolver_shutdown();
+        return rc;
+    }
+
+    flows = flowtable_create(flow_capacity);
+    if (flows == NULL) {
+        fprintf(stderr, "Out of memory\n");
+        resolver_shutdown();
+        return 1;
     }
 
     // Open device for packet capture
     handle = pcap_open_live(dev, SNAP_LEN, 1, 1000, errbuf);
     if (handle == NULL) {
         fprintf(stderr, "Couldn't open device %s: %s\n", dev, errbuf);
+        resolver_shutdown();
+        flowtable_destroy(flows);
         return 2;
     }
 
     printf("Listening on %s...\n", dev);
 
-    // Start capturing packets
-    pcap_loop(handle, 0, packet_handler, NULL);
+    if (top_mode) {
+        struct sigaction sa;
+        memset(&sa, 0, sizeof(sa));
+        sa.sa_handler = stop_capture;
+        sigaction(SIGINT, &sa, NULL);
+        sigaction(SIGTERM, &sa, NULL);
+
+        // The 1 s read timeout brings dispatch back even on a quiet link
+        time_t last_report = time(NULL);
+        while (!stopping && pcap_dispatch(handle, -1, packet_handler, NULL) >= 0) {
+            time_t now = time(NULL);
+            if (now - last_report >= STATS_INTERVAL) {
+                struct flow top[TOP_TALKERS];
+                struct flowtable_stat stat;
+                flowtable_expire(flows, now);
+                int n = flowtable_top(flows, top, TOP_TALKERS, top_port);
+                flowtable_stats(flows, &stat);
+                print_top_talkers(top, n, &stat);
+                last_report = now;
+            }
+        }
+    } else {
+        // Start capturing packets
+        pcap_loop(handle, 0, packet_handler, NULL);
+    }
 
     // Cleanup
+    resolver_shutdown();
     pcap_close(handle);
+    flowtable_destroy(flows);
     return 0;
 }
@@ -0,0 +1,253 @@
+/*
+ * Non-blocking reverse DNS for the packet tools, see resolver.h.
+ *
+ * The cache is a fixed array of entries chained into a hash table on the
+ * address and into an LRU list. One mutex guards both and the request
+ * queue; the capture thread holds it only for a hash lookup and a copy.
+ * Workers resolve with getnameinfo(), which unlike gethostbyaddr() is
+ * safe to call from several threads.
+ */
+
+#include "resolver.h"
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+#include <netdb.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+
+#define QUEUE_SIZE 1024  // Pending lookups; misses beyond this retry later
+
+enum entry_state { ENTRY_FREE, ENTRY_PENDING, ENTRY_RESOLVED, ENTRY_FAILED };
+
+struct entry {
+    uint32_t addr;
+    enum entry_state state;
+    time_t expires;
+    int hash_next;          // Next entry in the same bucket, -1 at the end
+    int lru_prev;           // Towards the most recently used entry
+    int lru_next;
+    char name[NI_MAXHOST];
+};
+
+static struct {
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+    pthread_t *threads;
+    int thread_count;
+    int stopping;
+
+    struct entry *entries;
+    int capacity;
+    int *buckets;
+    int bucket_shift;       // Hash bits kept: 32 - log2(bucket count)
+    int lru_head;           // Most recently used
+    int lru_tail;           // Next to be evicted
+
+    uint32_t queue[QUEUE_SIZE];
+    int queue_head;
+    int queue_count;
+} resolver = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .wake = PTHREAD_COND_INITIALIZER,
+};
+
+/* Fibonacci hashing; the top bits of the product mix in every byte of
+ * the address, whatever its byte order */
+static unsigned bucket_of(uint32_t addr) {
+    return (addr * 2654435761u) >> resolver.bucket_shift;
+}
+
+static int find_entry(uint32_t addr) {
+    for (int i = resolver.buckets[bucket_of(addr)]; i >= 0; i = resolver.entries[i].hash_next) {
+        if (resolver.entries[i].addr == addr && resolver.entries[i].state != ENTRY_FREE) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+static void lru_unlink(int i) {
+    struct entry *e = &resolver.entries[i];
+    if (e->lru_prev >= 0) {
+        resolver.entries[e->lru_prev].lru_next = e->lru_next;
+    } else {
+        resolver.lru_head = e->lru_next;
+    }
+    if (e->lru_next >= 0) {
+        resolver.entries[e->lru_next].lru_prev = e->lru_prev;
+    } else {
+        resolver.lru_tail = e->lru_prev;
+    }
+}
+
+static void lru_push_front(int i) {
+    struct entry *e = &resolver.entries[i];
+    e->lru_prev = -1;
+    e->lru_next = resolver.lru_head;
+    if (resolver.lru_head >= 0) {
+        resolver.entries[resolver.lru_head].lru_prev = i;
+    }
+    resolver.lru_head = i;
+    if (resolver.lru_tail < 0) {
+        resolver.lru_tail = i;
+    }
+}
+
+static void hash_unlink(int i) {
+    int *link = &resolver.buckets[bucket_of(resolver.entries[i].addr)];
+    while (*link != i) {
+        link = &resolver.entries[*link].hash_next;
+    }
+    *link = resolver.entries[i].hash_next;
+}
+
+/* Take the least recently used entry for addr and queue its lookup.
+ * Returns 0 when the queue is full, in which case nothing changes. */
+static int request_lookup(uint32_t addr, int i) {
+    if (resolver.queue_count == QUEUE_SIZE) {
+        return 0;
+    }
+    if (i < 0) {
+        i = resolver.lru_tail;
+        if (resolver.entries[i].state != ENTRY_FREE) {
+            hash_unlink(i);
+        }
+        resolver.entries[i].addr = addr;
+        resolver.entries[i].hash_next = resolver.buckets[bucket_of(addr)];
+        resolver.buckets[bucket_of(addr)] = i;
+    }
+    resolver.entries[i].state = ENTRY_PENDING;
+    resolver.entries[i].expires = 0;
+    lru_unlink(i);
+    lru_push_front(i);
+
+    resolver.queue[(resolver.queue_head + resolver.queue_count++) % QUEUE_SIZE] = addr;
+    pthread_cond_signal(&resolver.wake);
+    return 1;
+}
+
+int resolver_lookup(uint32_t addr, char *out, size_t size) {
+    struct in_addr in = { .s_addr = addr };
+    int found = 0;
+
+    if (!resolver.entries) {
+        inet_ntop(AF_INET, &in, out, size);
+        return 0;
+    }
+    pthread_mutex_lock(&resolver.lock);
+    int i = find_entry(addr);
+    struct entry *e = i >= 0 ? &resolver.entries[i] : NULL;
+    if (e && e->state == ENTRY_PENDING) {
+        // Already queued, nothing to do until a worker answers
+    } else if (!e || e->expires <= time(NULL)) {
+        request_lookup(addr, i);
+    } else if (e->state == ENTRY_RESOLVED) {
+        snprintf(out, size, "%s", e->name);
+        lru_unlink(i);
+        lru_push_front(i);
+        found = 1;
+    }
+    pthread_mutex_unlock(&resolver.lock);
+
+    if (!found) {
+        inet_ntop(AF_INET, &in, out, size);
+    }
+    return found;
+}
+
+static void *resolver_worker(void *arg) {
+    (void)arg;
+    pthread_mutex_lock(&resolver.lock);
+    while (!resolver.stopping) {
+        if (resolver.queue_count == 0) {
+            pthread_cond_wait(&resolver.wake, &resolver.lock);
+            continue;
+        }
+        uint32_t addr = resolver.queue[resolver.queue_head];
+        resolver.queue_head = (resolver.queue_head + 1) % QUEUE_SIZE;
+        resolver.queue_count--;
+        pthread_mutex_unlock(&resolver.lock);
+
+        struct sockaddr_in sa;
+        char name[NI_MAXHOST];
+        memset(&sa, 0, sizeof(sa));
+        sa.sin_family = AF_INET;
+        sa.sin_addr.s_addr = addr;
+        int rc = getnameinfo((struct sockaddr *)&sa, sizeof(sa), name, sizeof(name), NULL, 0, NI_NAMEREQD);
+
+        pthread_mutex_lock(&resolver.lock);
+        // The entry may have been evicted while the lookup ran
+        int i = find_entry(addr);
+        if (i >= 0 && resolver.entries[i].state == ENTRY_PENDING) {
+            struct entry *e = &resolver.entries[i];
+            e->state = rc == 0 ? ENTRY_RESOLVED : ENTRY_FAILED;
+            e->expires = time(NULL) + (rc == 0 ? RESOLVER_TTL : RESOLVER_NEGATIVE_TTL);
+            if (rc == 0) {
+                snprintf(e->name, sizeof(e->name), "%s", name);
+            }
+        }
+    }
+    pthread_mutex_unlock(&resolver.lock);
+    return NULL;
+}
+
+int resolver_init(int threads, size_t cache_size) {
+    int buckets = 16, shift = 28;
+
+    if (threads < 1 || cache_size < 1 || cache_size > 1 << 24) {
+        return -1;
+    }
+    while (buckets < (int)cache_size * 2) {
+        buckets *= 2;
+        shift--;
+    }
+    resolver.entries = calloc(cache_size, sizeof(struct entry));
+    resolver.buckets = malloc(buckets * sizeof(int));
+    resolver.threads = calloc(threads, sizeof(pthread_t));
+    if (!resolver.entries || !resolver.buckets || !resolver.threads) {
+        resolver_shutdown();
+        return -1;
+    }
+    memset(resolver.buckets, 0xff, buckets * sizeof(int));
+    resolver.bucket_shift = shift;
+    resolver.capacity = cache_size;
+    resolver.lru_head = resolver.lru_tail = -1;
+    for (int i = 0; i < resolver.capacity; i++) {
+        resolver.entries[i].hash_next = -1;
+        lru_push_front(i);
+    }
+    resolver.stopping = 0;
+    for (resolver.thread_count = 0; resolver.thread_count < threads; resolver.thread_count++) {
+        if (pthread_create(&resolver.threads[resolver.thread_count], NULL, resolver_worker, NULL) != 0) {
+            break;
+        }
+    }
+    if (resolver.thread_count == 0) {
+        resolver_shutdown();
+        return -1;
+    }
+    return 0;
+}
+
+void resolver_shutdown(void) {
+    pthread_mutex_lock(&resolver.lock);
+    resolver.stopping = 1;
+    pthread_cond_broadcast(&resolver.wake);
+    pthread_mutex_unlock(&resolver.lock);
+    for (int i = 0; i < resolver.thread_count; i++) {
+        pthread_join(resolver.threads[i], NULL);
+    }
+
+    free(resolver.threads);
+    free(resolver.entries);
+    free(resolver.buckets);
+    resolver.threads = NULL;
+    resolver.entries = NULL;
+    resolver.buckets = NULL;
+    resolver.thread_count = 0;
+    resolver.queue_head = resolver.queue_count = 0;
+}
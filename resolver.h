@@ -0,0 +1,34 @@
+/*
+ * Non-blocking reverse DNS for the packet tools
+ * ---------------------------------------------
+ * Lookups answer from a bounded LRU cache and never wait on DNS. A miss
+ * returns the dotted IP right away and queues the address for a pool of
+ * worker threads, so the name shows up on a later packet. Failed lookups
+ * are cached too, for a shorter time, so dead addresses are not retried
+ * on every packet.
+ *
+ * Build the tools with resolver.c and -lpthread.
+ */
+
+#ifndef RESOLVER_H
+#define RESOLVER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define RESOLVER_THREADS 4
+#define RESOLVER_CACHE_SIZE 4096
+#define RESOLVER_TTL 300           // Seconds a resolved name is kept
+#define RESOLVER_NEGATIVE_TTL 60   // Seconds a failed lookup is kept
+
+/* Start the worker threads and allocate the cache; returns -1 on failure */
+int resolver_init(int threads, size_t cache_size);
+
+/* Write the hostname of addr (network byte order) into out. Returns 1 for
+ * a cached name, 0 when the dotted IP was written instead. */
+int resolver_lookup(uint32_t addr, char *out, size_t size);
+
+/* Stop the workers and free the cache */
+void resolver_shutdown(void);
+
+#endif
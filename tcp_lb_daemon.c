@@ -1,41 +1,169 @@
  /* CWD SYSTEMS
  *   Walletshield TCP Connection Load Balancer Daemon
- *   Uses 1.4KB of RAM per generated thread.
+ *   Idle sessions cost a few hundred bytes; no thread is created per client.
  *
  * Description:
  *   This program acts as a simple TCP connection load balancer. It listens on
  *   port 7070 for incoming TCP connections and distributes them to a set of
- *   backend nodes using a round-robin algorithm. The program runs as a daemon
- *   and logs its activity to a log file.
+ *   backend nodes using a round-robin algorithm by default. The program runs
+ *   as a daemon and logs its activity to a log file.
+ *
+ *   Connections are served by one event-driven worker thread per CPU core.
+ *   Each worker owns its own SO_REUSEPORT listening socket and epoll instance
+ *   and handles accept, the non-blocking backend connect and the proxying of
+ *   every session it accepted, so tens of thousands of concurrent sessions
+ *   need neither per-connection stacks nor context switches.
  *
  * Usage:
  *   Compile the program:
- *    gcc -o tcp_lb_daemon tcp_lb_daemon.c -lpthread
+ *    gcc -O2 -o tcp_lb_daemon tcp_lb_daemon.c -lpthread
  *
  *   Run the program as a daemon:
- *     sudo ./tcp_lb_daemon
+ *     sudo ./tcp_lb_daemon [-c config] [-l level] [-a algorithm] [-e engine] [-u]
+ *                          [-w workers]
+ *                          [-i interval_ms] [-t timeout_ms] [-r rise] [-f fall]
+ *                          [-p min[:max[:idle_ms]]]
+ *
+ *     -c config    Configuration file (default /etc/tcp_lb_daemon.conf,
+ *                  built-in defaults are used when it does not exist).
+ *     -l level     Log level: error, warn, info (default) or debug.
+ *     -a algorithm Backend selection: roundrobin (default), leastconn,
+ *                  weighted, p2c or maglev.
+ *     -e engine    Socket I/O: epoll (default) or io_uring.
+ *     -u           Copy data through userspace instead of splice().
+ *     -w workers   Number of worker threads (default: one per online CPU).
+ *     -i ms        Interval between health check rounds (default 2000,
+ *                  0 disables health checking).
+ *     -t ms        Timeout of a single TCP connect probe (default 1000).
+ *     -r rise      Consecutive successful probes to bring a node back (2).
+ *     -f fall      Consecutive failed probes to eject a node (3).
+ *     -p pool      Pre-connected idle backend connections per worker and
+ *                  node: minimum, burst maximum and idle recycle time
+ *                  (default 2:32:30000, -p 0 disables pooling).
+ *
+ *   Options given on the command line override the configuration file,
+ *   also after a reload.
  *
  *   Check the log file for output:
  *     tail -f /var/log/tcp_lb_daemon.log
  *
+ *   Reload the configuration file:
+ *     sudo kill -HUP $(pidof tcp_lb_daemon)
+ *
+ *   Upgrade to a new binary without dropping connections:
+ *     sudo install tcp_lb_daemon /usr/local/bin/tcp_lb_daemon
+ *     sudo kill -USR2 $(pidof tcp_lb_daemon)
+ *
  * Configuration:
- *   - Backend nodes are defined in the `backend_nodes` array. Modify this array
- *     to include the IP addresses of your backend servers.
- *   - The load balancer listens on port 7070. You can change this by modifying
- *     the `lb_addr.sin_port` value.
+ *   The configuration file holds one setting per line; `#` starts a comment.
+ *
+ *     listen 0.0.0.0:7070            # May be repeated
+ *     listen [::]:7070               # IPv6 listeners only take IPv6 clients
+ *     backlog 4096
+ *     workers 4
+ *     engine io_uring                # epoll (default) or io_uring
+ *     metrics 127.0.0.1:9100         # Prometheus endpoint, "off" disables it
+ *     backend 192.168.1.101:7070 weight=2
+ *     backend 192.168.1.102          # Port defaults to 7070
+ *     backend [2001:db8::103]:7070
+ *     algorithm weighted
+ *     splice on
+ *     proxy_protocol v2              # off, v1 (text) or v2 (binary)
+ *     buffer_size 16384              # Userspace relay buffer per direction
+ *     pipe_size 65536                # Kernel pipe per direction for splice()
+ *     health_interval 2000
+ *     health_timeout 1000
+ *     health_rise 2
+ *     health_fall 3
+ *     pool_min 2
+ *     pool_max 32
+ *     pool_idle 30000
+ *     connect_timeout 3000           # Milliseconds before trying the next node
+ *     connect_retries 2              # Other nodes tried before giving up
+ *     idle_timeout 300000            # Close sessions silent this long, 0 = never
+ *     client_rate 50                 # New connections per second and client, 0 = off
+ *     client_burst 20                # Connections a client may open at once
+ *     max_sessions 100000            # Default: a quarter of the descriptor limit
+ *     overload_latency 200           # Shed accepts while an event batch takes longer
+ *     drain_timeout 300              # Seconds the old process serves after -USR2
+ *     log_level info
+ *     log_rate 1000                  # Messages per second and thread, 0 = unlimited
+ *
+ *   - Without a `backend` line the nodes in the `backend_nodes` array are used.
  *   - The log file is created at `/var/log/tcp_lb_daemon.log`. You can change
  *     this path by modifying the `LOG_FILE` macro.
+ *   - SIGHUP re-reads the file. The new backend table is published with an
+ *     atomic pointer swap; sessions that are in flight keep using the node
+ *     they were paired with until they finish. `listen`, `backlog`,
+ *     `workers`, `engine` and `metrics` only take effect through a binary upgrade.
+ *   - SIGUSR2 starts the binary found at the daemon's original path again
+ *     and hands it the listening sockets. Once the new process is serving, the old one stops
+ *     accepting and exits when its last session closes (or after
+ *     `drain_timeout`). The accept queues are shared, so no connection
+ *     attempt is refused during the switch.
  *
  * Features:
  *   - Runs as a daemon process.
  *   - Logs all activity to a log file with timestamps.
- *   - Uses a simple round-robin algorithm to distribute connections.
+ *   - Non-blocking epoll event loop, one worker per core with SO_REUSEPORT
+ *     listeners (falls back to a shared EPOLLEXCLUSIVE listener).
  *   - Forwards data bidirectionally between clients and backend servers.
+ *     Both directions run independently (half-closes are propagated) and
+ *     bytes move socket -> pipe -> socket with splice(), so they never
+ *     leave the kernel; a userspace copy path is used when splice() is
+ *     unavailable.
+ *   - Active health checks: a background thread probes every backend with
+ *     a TCP connect, applies rise/fall thresholds and publishes the set of
+ *     healthy nodes as an immutable view. Connections are only sent to
+ *     nodes in that view and selection never takes a lock.
+ *   - Pluggable, lock-free backend selection:
+ *       roundrobin  per-worker rotation over the healthy nodes
+ *       leastconn   fewest outstanding connections
+ *       weighted    smooth weighted round-robin on the backend weights
+ *       p2c         power of two random choices on connections per weight
+ *       maglev      Maglev consistent hashing of the client IP, so a client
+ *                   sticks to its node while the healthy set is unchanged
+ *   - Backend connection pooling: each worker keeps pre-established
+ *     connections to every healthy node and hands one to a new client
+ *     instead of connecting on demand. Used connections are replaced with
+ *     asynchronous connects; a pool that runs dry grows towards its
+ *     maximum and shrinks back as idle connections are recycled.
+ *   - Backend failover: connects have a deadline, and a session whose
+ *     backend refuses, resets or times out before any byte was forwarded
+ *     is moved to the next healthy node it has not tried. Sessions
+ *     without traffic for `idle_timeout` are closed. Deadlines live in a
+ *     per-worker timer wheel, so arming and cancelling them is O(1).
+ *   - Admission control right after accept, before any backend work:
+ *     a per-client token bucket (IPv6 clients are counted per /64), a
+ *     global session cap and shedding while a worker falls behind.
+ *     Rejected clients get a TCP reset. The bucket table is shared by all
+ *     workers and updated with compare-and-swap, never a lock.
+ *   - Optional io_uring engine (`engine io_uring`): a multishot accept per
+ *     listener, sockets held in a fixed file table, receives into a
+ *     kernel-selected ring of provided buffers and backend connects
+ *     linked to their deadline. Completions queue the next operation and
+ *     the whole batch is submitted with the same system call that waits
+ *     for completions. A worker whose kernel lacks the needed features
+ *     falls back to epoll.
+ *   - IPv4 and IPv6 listeners, backends and metrics endpoint, in any mix.
+ *   - PROXY protocol v1 or v2: backends learn the client's address and the
+ *     address it connected to. The header is sent together with the first
+ *     client bytes, so it costs neither an extra packet nor a round trip.
+ *   - Configuration file with hot reload and zero-downtime binary upgrade.
+ *   - Prometheus metrics at http://127.0.0.1:9100/metrics: accepted and
+ *     active connections per worker, pool hits, retries and timeouts,
+ *     and per backend the selections, connect failures, bytes each way,
+ *     connect latency histogram, health state and open sessions. Workers
+ *     only bump counters in their own cache lines; the sums are built on
+ *     scrape.
  *
  * Limitations:
- *   - Does not include health checks for backend servers.
- *   - Does not support dynamic configuration (backend nodes are hardcoded).
- *   - Does not handle errors or retries for failed backend connections.
+ *   - A backend that fails after data has been forwarded closes the
+ *     session; only the connect phase is retried.
+ *   - The io_uring engine copies through its buffer ring; splice() and
+ *     the backend connection pool are only used by the epoll engine.
+ *   - With proxy_protocol the header waits for the client's first bytes,
+ *     so protocols where the server speaks first cannot be balanced.
  *
  * Example:
  *   If the backend_nodes array contains:
@@ -52,13 +180,23 @@
  * Logging:
  *   The program logs the following events:
  *     - When the load balancer starts listening on port 7070.
- *     - When a new client connection is accepted.
- *     - When a connection to a backend server is established.
- *     - When a connection is closed.
+ *     - When a backend is ejected or put back by the health checker.
+ *     - When the configuration is reloaded or the binary is upgraded.
+ *     - Errors and warnings, such as failed backend connections.
+ *   At log level debug it also logs every accepted client, established
+ *   backend connection and closed connection.
+ *
+ *   Threads queue messages in their own lock-free ring and a writer thread
+ *   appends them to the log file in batches, so logging never blocks the
+ *   forwarding path. Below error level each thread may log `log_rate`
+ *   messages per second; the writer reports how many were suppressed.
  *
  * Notes:
  *   - Ensure you have the necessary permissions to write to the log file
  *     (/var/log/tcp_lb_daemon.log).
+ *   - Every session uses two file descriptors, plus a pipe per direction
+ *     only while data is in flight; the daemon raises its
+ *     RLIMIT_NOFILE soft limit to the hard limit at startup.
  *   - This is a basic implementation and is intended for educational purposes.
  *     For production use, consider using a more robust solution like HAProxy.
  *
@@ -67,20 +205,91 @@
  * Version: 1.0 stable
  */
 
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <unistd.h>
+#include <errno.h>
+#include <stddef.h>
+#include <stdarg.h>
+#include <signal.h>
+#include <sched.h>
 #include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 #include <sys/types.h>
-#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/resource.h>
+#include <sys/time.h>
 #include <fcntl.h>
 #include <time.h>
+#include <poll.h>
 #include <pthread.h>
+#include <stdatomic.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
 
 #define BACKEND_NODES 3
-#define BUFFER_SIZE 1024
+#define BACKEND_PORT 7070
+#define LISTEN_PORT 7070
+#define LISTEN_BACKLOG 4096
+#define BUFFER_SIZE 16384
+#define PIPE_SIZE 65536         // Pipe capacity, also the bytes moved per splice() call
+#define PIPE_CACHE 64           // Idle pipes kept per worker
+#define MAX_EVENTS 256
+#define MAX_WORKERS 256
+#define MAX_BACKENDS 64
+#define MAX_LISTENERS 8
+#define HEALTH_INTERVAL 2000    // Milliseconds between health check rounds
+#define HEALTH_TIMEOUT 1000     // Milliseconds a TCP connect probe may take
+#define HEALTH_RISE 2           // Successful probes before a node is put back
+#define HEALTH_FALL 3           // Failed probes before a node is ejected
+#define MAGLEV_SIZE 65537       // Consistent-hash lookup table size (prime)
+#define POOL_MIN 2              // Idle backend connections kept per worker and node
+#define POOL_MAX 32             // Upper bound the pool may grow to under bursts
+#define POOL_IDLE 30000         // Milliseconds before an unused connection is recycled
+#define POOL_TICK 1000          // Milliseconds between pool maintenance passes
+#define CONNECT_TIMEOUT 3000    // Milliseconds a backend connect may take
+#define CONNECT_RETRIES 2       // Other backends tried after a failed connect
+#define IDLE_TIMEOUT 300000     // Milliseconds without traffic before a session is closed
+#define TIMER_TICK 100          // Milliseconds per timer wheel slot
+#define WHEEL_SLOTS 512         // Timer wheel slots, one lap is 51.2 seconds
+#define CLIENT_BURST 20         // Connections a client may open at once under client_rate
+#define RATE_SHARDS 16384       // Cache-line shards of the per-client rate table
+#define RATE_WAYS 4             // Clients tracked per shard
+#define RATE_TOKEN 1000         // Bucket fill per admitted connection (milli-tokens)
+#define RATE_TOKEN_BITS 24      // Low bits of a bucket's state hold the fill
+#define OVERLOAD_LATENCY 200    // Milliseconds an event batch may take before accepts are shed
+#define URING_ENTRIES 1024      // Submission queue size of an io_uring worker
+#define URING_FILES 65536       // Fixed file slots per io_uring worker
+#define URING_BUFFERS 1024      // Provided receive buffers per io_uring worker (power of 2)
+#define URING_BUFFER_GROUP 0
+#define DRAIN_TIMEOUT 300       // Seconds an upgraded-away process keeps serving
+#define UPGRADE_TIMEOUT 10000   // Milliseconds the new binary has to report ready
+#define METRICS_PORT 9100
+#define PROXY_HEADER_MAX 108    // Longest PROXY protocol v1 line; v2 headers are shorter
+#define MAX_STAT_SLOTS 128      // Distinct backend addresses the metrics can track
+#define LATENCY_BUCKETS 12      // Connect latency histogram buckets, plus +Inf
+#define CONFIG_FILE "/etc/tcp_lb_daemon.conf"
 #define LOG_FILE "/var/log/tcp_lb_daemon.log"
+#define LOG_LINE 200            // Longest message text, longer ones are truncated
+#define LOG_RING_SIZE 256       // Queued messages per thread
+#define LOG_BATCH 65536         // Bytes the log writer collects per write()
+#define LOG_FLUSH_INTERVAL 20   // Milliseconds the log writer sleeps when idle
+#define LOG_RATE 1000           // Messages per second and thread below error level
+
+enum log_level {
+    LOG_ERROR,
+    LOG_WARN,
+    LOG_INFO,
+    LOG_DEBUG
+};
+
+extern char **environ;
 
 const char *backend_nodes[BACKEND_NODES] = {
     "192.168.1.101",
@@ -88,8 +297,354 @@ const char *backend_nodes[BACKEND_NODES] = {
     "192.168.1.103"
 };
 
-int current_backend = 0; // Shared variable for round-robin selection
-pthread_mutex_t backend_mutex = PTHREAD_MUTEX_INITIALIZER; // Mutex for thread-safe access
+struct worker;
+struct healthy_view;
+
+// IPv4 or IPv6 socket address
+union address {
+    struct sockaddr sa;
+    struct sockaddr_in in;
+    struct sockaddr_in6 in6;
+};
+
+// How workers wait for and perform socket I/O
+enum engine {
+    ENGINE_EPOLL,
+    ENGINE_IO_URING
+};
+
+// PROXY protocol header sent to backends ahead of the client's bytes
+enum proxy_protocol {
+    PROXY_OFF,
+    PROXY_V1,
+    PROXY_V2
+};
+
+struct backend {
+    int id;                   // Index into the config's table and per-worker state
+    int stat_slot;            // Metrics slot, stable across reloads
+    char host[64];            // As configured; used in logs and for hashing
+    union address addr;
+    int weight;
+    atomic_int active;        // Outstanding connections across all workers
+    // Health state, only touched with backend_mutex held
+    int up;
+    int rise_count;
+    int fall_count;
+};
+
+// A load-balancing algorithm picks one backend of the current healthy view
+struct lb_algorithm {
+    const char *name;
+    struct backend *(*select)(struct worker *w, struct healthy_view *view,
+                              const union address *client);
+};
+
+// Everything the configuration file can set. A published config is only
+// modified in its backend counters and health state. It is reference
+// counted: sessions and pooled connections keep using their backend entry
+// after a reload has replaced the table.
+struct lb_config {
+    atomic_int refs;
+    // Startup only: changing these needs a binary upgrade
+    int listen_count;
+    union address listen[MAX_LISTENERS];
+    int backlog;
+    int workers;
+    enum engine engine;
+    int metrics_enabled;
+    union address metrics;
+    // Reloadable
+    const struct lb_algorithm *algorithm;
+    int splice;
+    enum proxy_protocol proxy_protocol;
+    int buffer_size;
+    int pipe_size;
+    int health_interval;
+    int health_timeout;
+    int health_rise;
+    int health_fall;
+    int pool_min;
+    int pool_max;
+    int pool_idle;
+    int connect_timeout;
+    int connect_retries;
+    int idle_timeout;
+    int client_rate;
+    int client_burst;
+    int max_sessions;
+    int overload_latency;
+    int drain_timeout;
+    int log_level;
+    int log_rate;
+    int backend_count;
+    struct backend backends[MAX_BACKENDS];
+};
+
+// Immutable snapshot of the backends that pass their health checks.
+// Writers publish a new view with an atomic pointer swap; readers never
+// lock and old views are freed after an RCU grace period.
+struct healthy_view {
+    struct lb_config *config; // Holds a reference
+    int count;
+    int total_weight;
+    struct backend *backends[MAX_BACKENDS];
+    unsigned char *maglev;    // MAGLEV_SIZE slots of indexes into backends[]
+};
+
+_Atomic(struct healthy_view *) healthy_view;
+struct lb_config *current_config; // Guarded by backend_mutex
+
+pthread_mutex_t backend_mutex = PTHREAD_MUTEX_INITIALIZER; // Serialises config and view publishers
+
+struct session;
+
+enum endpoint_kind {
+    EP_LISTENER,
+    EP_CLIENT,
+    EP_BACKEND,
+    EP_POOL,
+    EP_WAKE
+};
+
+// One registered file descriptor; epoll_event.data.ptr points at it
+struct endpoint {
+    int fd;
+    enum endpoint_kind kind;
+    uint32_t events;          // Interest set currently registered with epoll
+    int registered;
+    struct session *session;  // NULL for listeners
+};
+
+// One direction of a session. Bytes read from the source that the
+// destination has not accepted yet sit either in a pipe (splice path, the
+// data never leaves the kernel) or in a userspace buffer (fallback path).
+// Pipes and buffers are only attached while data is pending, so idle
+// sessions do not pin any of them.
+struct relay {
+    int pipe[2];              // pipe[0] is -1 when no pipe is attached
+    char *buf;
+    size_t buf_size;
+    size_t off;
+    size_t len;               // Bytes pending in the pipe or buffer
+    const char *prefix;       // Header still to be sent ahead of the data
+    size_t prefix_len;
+    int bid;                  // io_uring: provided buffer that buf points into
+    int busy;                 // io_uring: a receive or send is in flight
+    int moved;                // Some bytes have reached the destination
+    int eof;                  // Source has sent FIN
+    int shut;                 // FIN has been forwarded to the destination
+};
+
+// Entry in a worker's timer wheel
+struct timer {
+    struct timer *prev;       // NULL while not scheduled
+    struct timer *next;
+    long expires;             // Monotonic milliseconds
+};
+
+struct session {
+    struct endpoint client;
+    struct endpoint backend;
+    struct relay up;          // client -> backend
+    struct relay down;        // backend -> client
+    struct lb_config *config; // Holds a reference while the session lives
+    struct backend *backend_node;
+    long connect_start;       // Monotonic microseconds when connect() was issued
+    struct timer timer;       // Connect deadline, then idle check
+    long last_active;         // Monotonic milliseconds of the last socket event
+    uint64_t tried;           // Backend ids this session has connected to
+    int retries;
+    char proxy_header[PROXY_HEADER_MAX];
+    int connected;            // Backend connect() has completed
+    int closed;               // Queued for release at the end of the event batch
+    struct session *next_closed;
+    // io_uring engine only
+    int client_slot;          // Fixed file slots of the two sockets
+    int backend_slot;
+    int inflight;             // Submitted operations not completed yet
+    int starved;              // Directions waiting for a provided buffer
+    struct session *next_starved;
+    struct msghdr msg;        // First send when a PROXY header goes along
+    struct iovec iov[2];
+};
+
+// Completion kinds; the tag sits in the low bits of user_data
+enum uring_op {
+    UOP_ACCEPT,               // Listener index above the tag
+    UOP_WAKE,
+    UOP_SLOT,                 // Released fixed file slot above the tag
+    UOP_IGNORE,
+    UOP_NOP,                  // Session operations follow, session pointer
+    UOP_FILES,
+    UOP_CONNECT,
+    UOP_TIMEOUT,
+    UOP_RECV_UP,
+    UOP_RECV_DOWN,
+    UOP_SEND_UP,
+    UOP_SEND_DOWN
+};
+
+// A worker's io_uring instance with its fixed file table and provided
+// receive buffers
+struct uring {
+    int fd;
+    void *ring;
+    size_t ring_size;
+    _Atomic unsigned *sq_head;
+    _Atomic unsigned *sq_tail;
+    unsigned sq_mask;
+    unsigned sq_entries;
+    unsigned *sq_array;
+    struct io_uring_sqe *sqes;
+    unsigned sq_local;        // Tail including SQEs not yet published
+    unsigned sq_submitted;
+    _Atomic unsigned *cq_head;
+    _Atomic unsigned *cq_tail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+    struct io_uring_buf_ring *buf_ring;
+    char *buffers;
+    size_t buf_size;
+    uint16_t buf_tail;
+    int buf_free;             // Buffers the kernel may still hand out
+    int *free_slots;
+    int free_slot_count;
+    struct session *starved;  // Sessions waiting for a provided buffer
+    struct __kernel_timespec connect_timeout;
+    uint64_t wake_value;
+};
+
+// A pre-connected backend socket waiting for a client
+struct pooled_conn {
+    struct endpoint ep;       // Must stay first: epoll data points here
+    struct lb_config *config; // Holds a reference; pools are reset on reload
+    struct backend *node;
+    int connected;
+    long connect_start;       // Monotonic microseconds
+    long idle_since;          // Monotonic milliseconds
+    struct pooled_conn *prev;
+    struct pooled_conn *next;
+};
+
+// Per worker and backend; idle connections are kept newest first
+struct backend_pool {
+    struct pooled_conn *head;
+    struct pooled_conn *tail;
+    int idle;
+    int connecting;
+    int target;               // Adapts between pool_min and pool_max
+};
+
+struct free_buffer {
+    struct free_buffer *next;
+};
+
+// Counters of one backend as seen by one worker
+struct backend_stats {
+    _Atomic uint64_t selected;
+    _Atomic uint64_t connect_failures;
+    _Atomic uint64_t bytes_sent;      // client -> backend
+    _Atomic uint64_t bytes_received;  // backend -> client
+    _Atomic uint64_t connect_latency[LATENCY_BUCKETS + 1];
+    _Atomic uint64_t connect_time_us;
+};
+
+// Written only by the owning worker and summed by the metrics thread on
+// scrape. Aligned so neighbouring workers never share a cache line.
+struct worker_stats {
+    _Alignas(64) _Atomic uint64_t accepted;
+    _Atomic uint64_t closed;
+    _Atomic uint64_t pool_hits;
+    _Atomic uint64_t pool_misses;
+    _Atomic uint64_t connect_timeouts;
+    _Atomic uint64_t retries;
+    _Atomic uint64_t idle_timeouts;
+    _Atomic uint64_t rejected_rate;
+    _Atomic uint64_t rejected_limit;
+    _Atomic uint64_t rejected_overload;
+    struct backend_stats backends[MAX_STAT_SLOTS];
+};
+
+struct worker {
+    int id;
+    pthread_t thread;
+    int epfd;
+    int listener_count;
+    struct endpoint *listeners;
+    struct endpoint wake;             // eventfd written by the main thread
+    struct healthy_view *view;        // Snapshot valid for the current loop iteration
+    struct lb_config *config;         // Config the pools and selection state belong to
+    struct free_buffer *free_buffers; // Relay buffers waiting for reuse
+    size_t buffer_size;               // Size of the buffers in free_buffers
+    int pipes[PIPE_CACHE][2];         // Empty pipes waiting for reuse
+    int pipe_count;
+    struct session *closed;           // Sessions to release after the current batch
+    struct pooled_conn *closed_pool;  // Pool entries to release after the current batch
+    unsigned long sessions;
+    int accepting;                    // Cleared while draining after an upgrade
+    struct uring *uring;              // NULL when the worker runs on epoll
+    _Atomic unsigned long rcu_seen;   // Last grace period observed, 0 while idle
+    // Selection state is per worker so picking a backend shares no cache lines
+    unsigned int rr_next;
+    int wrr_current[MAX_BACKENDS];    // Smooth weighted round-robin credit
+    uint64_t rng;                     // xorshift state for p2c
+    struct backend_pool pools[MAX_BACKENDS];
+    long next_maintenance;
+    long now;                         // Monotonic milliseconds after the last epoll_wait
+    long busy;                        // Milliseconds the last event batch took
+    struct timer wheel[WHEEL_SLOTS];  // List heads, one per TIMER_TICK
+    long wheel_tick;                  // Last tick whose slot has been run
+    int timers;                       // Scheduled timers
+    struct worker_stats stats;
+};
+
+// Backend addresses that have metrics slots; slots are never reused so
+// counters survive reloads
+struct stat_slot {
+    char host[64];
+    union address addr;
+};
+
+struct stat_slot stat_slots[MAX_STAT_SLOTS];
+atomic_int stat_slot_count;
+
+// Token bucket of one client address. The state packs the time of the
+// last refill in milliseconds above RATE_TOKEN_BITS of fill, so a bucket
+// is updated with one compare-and-swap.
+struct rate_entry {
+    _Atomic uint64_t key;     // client_key(), 0 while unused
+    _Atomic uint64_t state;
+};
+
+// Clients are spread over cache-line sized shards shared by all workers;
+// a shard that is full recycles its least recently refilled entry
+struct rate_shard {
+    _Alignas(64) struct rate_entry entries[RATE_WAYS];
+};
+
+struct rate_shard rate_table[RATE_SHARDS];
+atomic_int sessions_open; // Sessions of all workers, for max_sessions
+
+// Upper bounds of the connect latency buckets in microseconds
+const long latency_bounds_us[LATENCY_BUCKETS] = {
+    100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 1000000
+};
+
+struct worker workers[MAX_WORKERS];
+int worker_count = 0;
+atomic_int workers_running;
+atomic_int draining;    // Set once a new binary has taken over the listeners
+int splice_enabled = 1; // Cleared when the kernel refuses splice()
+
+const char *config_path = CONFIG_FILE;
+char exe_path[4096];    // Binary to start on SIGUSR2, resolved at startup
+int saved_argc;
+char **saved_argv;
+
+// Quiescent-state RCU: a worker passes a quiescent state every time it
+// goes back to epoll_wait, so it never holds a view across iterations.
+_Atomic unsigned long rcu_gp = 1;
 
 void daemonize() {
     pid_t pid = fork();
@@ -130,136 +685,3506 @@ void daemonize() {
     close(log_fd);
 }
 
-void log_message(const char *message) {
-    time_t now;
-    time(&now);
-    char *timestamp = ctime(&now);
-    timestamp[strlen(timestamp) - 1] = '\0'; // Remove newline
-    printf("[%s] %s\n", timestamp, message);
+// Logging is asynchronous: every thread appends to its own lock-free ring
+// and a writer thread drains all rings in batches, so a worker never waits
+// for stdio locks or the disk. Until the writer runs (and after it stops)
+// messages are written directly.
+struct log_entry {
+    time_t when;
+    int level;
+    int len;
+    char text[LOG_LINE];
+};
+
+// Single producer (the owning thread), single consumer (the writer)
+struct log_ring {
+    _Alignas(64) atomic_uint head;    // Next slot the owner fills
+    _Alignas(64) atomic_uint tail;    // Next slot the writer drains
+    _Alignas(64) time_t window;       // Rate limit window, owner only
+    int window_count;
+    atomic_ulong dropped;             // Messages lost to the rate limit or a full ring
+    unsigned long reported;           // Drops the writer has already logged
+    time_t reported_at;               // Drops are summarised at most once a second
+    struct log_ring *next;
+    struct log_entry entries[LOG_RING_SIZE];
+};
+
+const char *log_levels[] = {"error", "warn", "info", "debug"};
+
+_Atomic(struct log_ring *) log_rings;
+__thread struct log_ring *log_ring_self;
+atomic_int log_level = LOG_INFO;
+atomic_int log_rate = LOG_RATE;
+atomic_int log_writer_running;
+atomic_int log_stop;
+pthread_t log_thread;
+
+// ctime() layout without the newline; the writer reformats once a second
+void log_timestamp(time_t when, char *out, size_t size) {
+    struct tm tm;
+    localtime_r(&when, &tm);
+    strftime(out, size, "%a %b %e %H:%M:%S %Y", &tm);
 }
 
-// Thread function to handle client connections
-void *handle_client(void *arg) {
-    int client_socket = *(int *)arg;
-    int backend_socket;
-    struct sockaddr_in backend_addr;
-    char buffer[BUFFER_SIZE];
+// Append "[timestamp] level: text\n" to out, which must have room for it
+size_t log_format(char *out, const char *stamp, int level, const char *text, int len) {
+    size_t used = 0;
 
-    // Select the backend server (round-robin)
-    pthread_mutex_lock(&backend_mutex);
-    const char *backend_ip = backend_nodes[current_backend];
-    current_backend = (current_backend + 1) % BACKEND_NODES;
-    pthread_mutex_unlock(&backend_mutex);
+    out[used++] = '[';
+    memcpy(out + used, stamp, strlen(stamp));
+    used += strlen(stamp);
+    out[used++] = ']';
+    out[used++] = ' ';
+    // Info lines keep the historical format
+    if (level != LOG_INFO) {
+        used += sprintf(out + used, "%s: ", log_levels[level]);
+    }
+    memcpy(out + used, text, len);
+    used += len;
+    out[used++] = '\n';
+    return used;
+}
 
-    // Connect to the backend server
-    backend_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (backend_socket == -1) {
-        log_message("Backend socket creation failed");
-        close(client_socket);
-        pthread_exit(NULL);
+void log_write_all(const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = write(STDOUT_FILENO, buf, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return;
+        }
+        buf += n;
+        len -= n;
     }
+}
+
+struct log_ring *log_ring_register() {
+    struct log_ring *ring = calloc(1, sizeof(*ring));
+    if (!ring) {
+        return NULL;
+    }
+    ring->next = atomic_load(&log_rings);
+    while (!atomic_compare_exchange_weak(&log_rings, &ring->next, ring)) {
+    }
+    log_ring_self = ring;
+    return ring;
+}
 
-    memset(&backend_addr, 0, sizeof(backend_addr));
-    backend_addr.sin_family = AF_INET;
-    backend_addr.sin_port = htons(7070);
-    inet_pton(AF_INET, backend_ip, &backend_addr.sin_addr);
+void log_message(int level, const char *fmt, ...) {
+    va_list args;
 
-    if (connect(backend_socket, (struct sockaddr *)&backend_addr, sizeof(backend_addr)) < 0) {
-        log_message("Connection to backend failed");
-        close(backend_socket);
-        close(client_socket);
-        pthread_exit(NULL);
+    // Disabled levels cost one load and a compare
+    if (level > atomic_load_explicit(&log_level, memory_order_relaxed)) {
+        return;
+    }
+    time_t now = time(NULL);
+
+    if (!atomic_load_explicit(&log_writer_running, memory_order_acquire)) {
+        char text[LOG_LINE], stamp[32], line[LOG_LINE + 64];
+        va_start(args, fmt);
+        int len = vsnprintf(text, sizeof(text), fmt, args);
+        va_end(args);
+        if (len < 0) {
+            return;
+        }
+        if (len >= (int)sizeof(text)) {
+            len = sizeof(text) - 1;
+        }
+        log_timestamp(now, stamp, sizeof(stamp));
+        log_write_all(line, log_format(line, stamp, level, text, len));
+        return;
+    }
+
+    struct log_ring *ring = log_ring_self;
+    if (!ring && !(ring = log_ring_register())) {
+        return;
+    }
+
+    // Errors are never rate limited, only lost when the ring is full
+    int rate = atomic_load_explicit(&log_rate, memory_order_relaxed);
+    if (level > LOG_ERROR && rate > 0) {
+        if (ring->window != now) {
+            ring->window = now;
+            ring->window_count = 0;
+        }
+        if (ring->window_count++ >= rate) {
+            atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+            return;
+        }
     }
 
-    char log_msg[256];
-    snprintf(log_msg, sizeof(log_msg), "Connected to backend: %s", backend_ip);
-    log_message(log_msg);
+    unsigned int head = atomic_load_explicit(&ring->head, memory_order_relaxed);
+    if (head - atomic_load_explicit(&ring->tail, memory_order_acquire) >= LOG_RING_SIZE) {
+        atomic_fetch_add_explicit(&ring->dropped, 1, memory_order_relaxed);
+        return;
+    }
+    struct log_entry *e = &ring->entries[head % LOG_RING_SIZE];
+    e->when = now;
+    e->level = level;
+    va_start(args, fmt);
+    e->len = vsnprintf(e->text, sizeof(e->text), fmt, args);
+    va_end(args);
+    if (e->len < 0) {
+        e->len = 0;
+    }
+    if (e->len >= (int)sizeof(e->text)) {
+        e->len = sizeof(e->text) - 1;
+    }
+    atomic_store_explicit(&ring->head, head + 1, memory_order_release);
+}
 
-    // Forward data between client and backend
+// Drain every ring into one buffer and write it with a single call.
+// Lines are ordered per thread; threads interleave at batch granularity.
+void *log_writer(void *arg) {
+    char *batch = malloc(LOG_BATCH);
+    char stamp[32] = "";
+    time_t stamp_second = -1;
+    (void)arg;
+
+    if (!batch) {
+        atomic_store(&log_writer_running, 0);
+        return NULL;
+    }
     while (1) {
-        ssize_t bytes_received = recv(client_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
+        size_t used = 0;
+        int stop = atomic_load(&log_stop);
+        time_t now = time(NULL);
+
+        for (struct log_ring *ring = atomic_load(&log_rings); ring; ring = ring->next) {
+            unsigned int tail = atomic_load_explicit(&ring->tail, memory_order_relaxed);
+            unsigned int head = atomic_load_explicit(&ring->head, memory_order_acquire);
+            unsigned long dropped = atomic_load_explicit(&ring->dropped, memory_order_relaxed);
+
+            if (dropped != ring->reported && (ring->reported_at != now || stop) &&
+                used + LOG_LINE + 64 <= LOG_BATCH) {
+                char text[96];
+                int len = snprintf(text, sizeof(text), "%lu log messages suppressed",
+                                   dropped - ring->reported);
+                log_timestamp(now, stamp, sizeof(stamp));
+                stamp_second = now;
+                used += log_format(batch + used, stamp, LOG_WARN, text, len);
+                ring->reported = dropped;
+                ring->reported_at = now;
+            }
+            while (tail != head && used + LOG_LINE + 64 <= LOG_BATCH) {
+                struct log_entry *e = &ring->entries[tail % LOG_RING_SIZE];
+                if (e->when != stamp_second) {
+                    log_timestamp(e->when, stamp, sizeof(stamp));
+                    stamp_second = e->when;
+                }
+                used += log_format(batch + used, stamp, e->level, e->text, e->len);
+                tail++;
+            }
+            atomic_store_explicit(&ring->tail, tail, memory_order_release);
+        }
+
+        if (used > 0) {
+            log_write_all(batch, used);
+        } else if (stop) {
             break;
+        } else {
+            struct timespec pause = {0, LOG_FLUSH_INTERVAL * 1000000L};
+            nanosleep(&pause, NULL);
         }
+    }
+    free(batch);
+    return NULL;
+}
 
-        send(backend_socket, buffer, bytes_received, 0);
+// Start the writer; must be called after daemonize() since fork() does not
+// carry threads over
+void log_start() {
+    atomic_store(&log_writer_running, 1);
+    if (pthread_create(&log_thread, NULL, log_writer, NULL) != 0) {
+        atomic_store(&log_writer_running, 0);
+    }
+}
 
-        bytes_received = recv(backend_socket, buffer, BUFFER_SIZE, 0);
-        if (bytes_received <= 0) {
-            break;
+// Write out everything queued and go back to direct writes
+void log_shutdown() {
+    if (atomic_load(&log_writer_running)) {
+        atomic_store(&log_stop, 1);
+        pthread_join(log_thread, NULL);
+        atomic_store(&log_writer_running, 0);
+    }
+}
+
+int find_log_level(const char *name) {
+    for (int i = 0; i <= LOG_DEBUG; i++) {
+        if (strcmp(log_levels[i], name) == 0) {
+            return i;
         }
+    }
+    return -1;
+}
 
-        send(client_socket, buffer, bytes_received, 0);
+// Raise the descriptor limit so the workers can hold many sessions
+void raise_fd_limit() {
+    struct rlimit rl;
+
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < rl.rlim_max) {
+        rl.rlim_cur = rl.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &rl);
     }
+}
 
-    // Close the connections
-    close(backend_socket);
-    close(client_socket);
+void rcu_online(struct worker *w) {
+    atomic_store(&w->rcu_seen, atomic_load(&rcu_gp));
+}
 
-    log_message("Connection closed");
-    pthread_exit(NULL);
+void rcu_offline(struct worker *w) {
+    atomic_store(&w->rcu_seen, 0);
 }
 
-int main() {
-    int lb_socket, client_socket;
-    struct sockaddr_in lb_addr, client_addr;
-    socklen_t addr_len = sizeof(client_addr);
+// Wait until no worker can still hold a pointer published before the call
+void rcu_synchronize() {
+    unsigned long gp = atomic_fetch_add(&rcu_gp, 1) + 1;
+    struct timespec pause = {0, 1000000};
 
-    // Daemonize the process
-    daemonize();
+    for (int i = 0; i < worker_count; i++) {
+        unsigned long seen;
+        while ((seen = atomic_load(&workers[i].rcu_seen)) != 0 && seen < gp) {
+            nanosleep(&pause, NULL);
+        }
+    }
+}
 
-    // Create load balancer socket
-    lb_socket = socket(AF_INET, SOCK_STREAM, 0);
-    if (lb_socket == -1) {
-        log_message("Socket creation failed");
-        exit(EXIT_FAILURE);
+void config_get(struct lb_config *cfg) {
+    atomic_fetch_add_explicit(&cfg->refs, 1, memory_order_relaxed);
+}
+
+void config_put(struct lb_config *cfg) {
+    if (cfg && atomic_fetch_sub_explicit(&cfg->refs, 1, memory_order_acq_rel) == 1) {
+        free(cfg);
+    }
+}
+
+// Every counter has a single writer, its worker, so a relaxed load and
+// store is enough: no locked instruction, and a scrape never sees a torn value
+void stat_add(_Atomic uint64_t *counter, uint64_t n) {
+    atomic_store_explicit(counter, atomic_load_explicit(counter, memory_order_relaxed) + n,
+                          memory_order_relaxed);
+}
+
+uint32_t hash32(uint32_t x) {
+    x ^= x >> 16;
+    x *= 0x7feb352d;
+    x ^= x >> 15;
+    x *= 0x846ca68b;
+    x ^= x >> 16;
+    return x;
+}
+
+// Hash of the IP only, so every connection of a client hashes alike
+uint32_t address_hash(const union address *addr) {
+    if (addr->sa.sa_family == AF_INET6) {
+        uint32_t words[4], h = 0;
+        memcpy(words, &addr->in6.sin6_addr, sizeof(words));
+        for (int i = 0; i < 4; i++) {
+            h = hash32(h ^ ntohl(words[i]));
+        }
+        return h;
+    }
+    return hash32(ntohl(addr->in.sin_addr.s_addr));
+}
+
+uint32_t hash_string(const char *str, uint32_t seed) {
+    uint32_t h = 2166136261u ^ seed;
+    while (*str) {
+        h = (h ^ (unsigned char)*str++) * 16777619u;
     }
+    return hash32(h);
+}
 
-    // Bind the load balancer socket to port 7070
-    memset(&lb_addr, 0, sizeof(lb_addr));
-    lb_addr.sin_family = AF_INET;
-    lb_addr.sin_addr.s_addr = INADDR_ANY;
-    lb_addr.sin_port = htons(7070);
+// Fill the Maglev lookup table: every backend walks its own permutation
+// of the slots and claims the next free one, weight times per round.
+// Slots only move for clients of a node that joins or leaves the view.
+int build_maglev(struct healthy_view *view) {
+    uint32_t offset[MAX_BACKENDS], skip[MAX_BACKENDS], next[MAX_BACKENDS];
+    int filled = 0;
 
-    if (bind(lb_socket, (struct sockaddr *)&lb_addr, sizeof(lb_addr)) < 0) {
-        log_message("Bind failed");
-        close(lb_socket);
-        exit(EXIT_FAILURE);
+    view->maglev = malloc(MAGLEV_SIZE);
+    if (!view->maglev) {
+        return -1;
     }
+    memset(view->maglev, 0xff, MAGLEV_SIZE);
 
-    // Listen for incoming connections
-    if (listen(lb_socket, 5) < 0) {
-        log_message("Listen failed");
-        close(lb_socket);
-        exit(EXIT_FAILURE);
+    for (int i = 0; i < view->count; i++) {
+        offset[i] = hash_string(view->backends[i]->host, 0) % MAGLEV_SIZE;
+        skip[i] = hash_string(view->backends[i]->host, 0x9e3779b9) % (MAGLEV_SIZE - 1) + 1;
+        next[i] = 0;
     }
 
-    log_message("Load balancer listening on port 7070...");
+    while (filled < MAGLEV_SIZE) {
+        for (int i = 0; i < view->count && filled < MAGLEV_SIZE; i++) {
+            for (int turn = 0; turn < view->backends[i]->weight && filled < MAGLEV_SIZE; turn++) {
+                uint32_t slot;
+                do {
+                    slot = (offset[i] + (uint64_t)next[i] * skip[i]) % MAGLEV_SIZE;
+                    next[i]++;
+                } while (view->maglev[slot] != 0xff);
+                view->maglev[slot] = i;
+                filled++;
+            }
+        }
+    }
+    return 0;
+}
 
-    while (1) {
-        // Accept a new client connection
-        client_socket = accept(lb_socket, (struct sockaddr *)&client_addr, &addr_len);
-        if (client_socket < 0) {
-            log_message("Accept failed");
-            continue;
+void free_healthy_view(struct healthy_view *view) {
+    config_put(view->config);
+    free(view->maglev);
+    free(view);
+}
+
+// Build a view of current_config and swap it in. Must be called with
+// backend_mutex held; returns the previous view for retire_view().
+struct healthy_view *swap_healthy_view_locked() {
+    struct lb_config *cfg = current_config;
+    struct healthy_view *view = calloc(1, sizeof(*view));
+    if (!view) {
+        log_message(LOG_ERROR, "Healthy view allocation failed");
+        return NULL;
+    }
+    for (int i = 0; i < cfg->backend_count; i++) {
+        if (cfg->backends[i].up) {
+            view->backends[view->count++] = &cfg->backends[i];
+        }
+    }
+    if (view->count == 0) {
+        // Nothing passes its checks; keep trying every node rather than
+        // refusing all clients on what may be a probe-side problem
+        log_message(LOG_WARN, "No healthy backends, falling back to all nodes");
+        for (int i = 0; i < cfg->backend_count; i++) {
+            view->backends[view->count++] = &cfg->backends[i];
+        }
+    }
+    for (int i = 0; i < view->count; i++) {
+        view->total_weight += view->backends[i]->weight;
+    }
+    if (build_maglev(view) < 0) {
+        log_message(LOG_ERROR, "Healthy view allocation failed");
+        free(view);
+        return NULL;
+    }
+    config_get(cfg);
+    view->config = cfg;
+
+    return atomic_exchange(&healthy_view, view);
+}
+
+// Free a replaced view once no worker can still be reading it
+void retire_view(struct healthy_view *old) {
+    if (old) {
+        rcu_synchronize();
+        free_healthy_view(old);
+    }
+}
+
+struct backend *select_roundrobin(struct worker *w, struct healthy_view *view,
+                                  const union address *client) {
+    (void)client;
+    return view->backends[w->rr_next++ % view->count];
+}
+
+// Fewest outstanding connections; the scan starts at a rotating offset so
+// ties do not all land on the first node
+struct backend *select_leastconn(struct worker *w, struct healthy_view *view,
+                                 const union address *client) {
+    unsigned int start = w->rr_next++;
+    struct backend *best = NULL;
+    int best_active = 0;
+    (void)client;
+
+    for (int i = 0; i < view->count; i++) {
+        struct backend *b = view->backends[(start + i) % view->count];
+        int active = atomic_load_explicit(&b->active, memory_order_relaxed);
+        if (!best || active < best_active) {
+            best = b;
+            best_active = active;
         }
+    }
+    return best;
+}
 
-        log_message("New connection accepted");
+// Smooth weighted round-robin: every pick adds each node's weight to its
+// credit and the node with the most credit pays back the total weight
+struct backend *select_weighted(struct worker *w, struct healthy_view *view,
+                                const union address *client) {
+    struct backend *best = NULL;
+    (void)client;
 
-        // Create a new thread to handle the client connection
-        pthread_t thread_id;
-        if (pthread_create(&thread_id, NULL, handle_client, &client_socket) != 0) {
-            log_message("Failed to create thread");
-            close(client_socket);
-            continue;
+    for (int i = 0; i < view->count; i++) {
+        struct backend *b = view->backends[i];
+        w->wrr_current[b->id] += b->weight;
+        if (!best || w->wrr_current[b->id] > w->wrr_current[best->id]) {
+            best = b;
+        }
+    }
+    w->wrr_current[best->id] -= view->total_weight;
+    return best;
+}
+
+uint64_t worker_random(struct worker *w) {
+    w->rng ^= w->rng << 13;
+    w->rng ^= w->rng >> 7;
+    w->rng ^= w->rng << 17;
+    return w->rng;
+}
+
+// Power of two choices: sample two nodes and keep the one with fewer
+// outstanding connections per unit of weight
+struct backend *select_p2c(struct worker *w, struct healthy_view *view,
+                           const union address *client) {
+    (void)client;
+    if (view->count == 1) {
+        return view->backends[0];
+    }
+
+    uint64_t r = worker_random(w);
+    int i = r % view->count;
+    int j = (i + 1 + (r >> 32) % (view->count - 1)) % view->count;
+    struct backend *a = view->backends[i];
+    struct backend *b = view->backends[j];
+    long load_a = (long)atomic_load_explicit(&a->active, memory_order_relaxed) * b->weight;
+    long load_b = (long)atomic_load_explicit(&b->active, memory_order_relaxed) * a->weight;
+    return (load_a <= load_b) ? a : b;
+}
+
+// Consistent hashing on the client address for session affinity
+struct backend *select_maglev(struct worker *w, struct healthy_view *view,
+                              const union address *client) {
+    (void)w;
+    uint32_t h = address_hash(client);
+    return view->backends[view->maglev[h % MAGLEV_SIZE]];
+}
+
+const struct lb_algorithm lb_algorithms[] = {
+    {"roundrobin", select_roundrobin},
+    {"leastconn", select_leastconn},
+    {"weighted", select_weighted},
+    {"p2c", select_p2c},
+    {"maglev", select_maglev},
+};
+
+const struct lb_algorithm *find_lb_algorithm(const char *name) {
+    for (size_t i = 0; i < sizeof(lb_algorithms) / sizeof(lb_algorithms[0]); i++) {
+        if (strcmp(lb_algorithms[i].name, name) == 0) {
+            return &lb_algorithms[i];
+        }
+    }
+    return NULL;
+}
+
+// Select a backend server from the healthy view with the configured algorithm
+struct backend *select_backend(struct worker *w, const union address *client) {
+    struct healthy_view *view = w->view;
+    struct backend *b = view->config->algorithm->select(w, view, client);
+
+    atomic_fetch_add_explicit(&b->active, 1, memory_order_relaxed);
+    stat_add(&w->stats.backends[b->stat_slot].selected, 1);
+    return b;
+}
+
+socklen_t address_len(const union address *addr) {
+    return addr->sa.sa_family == AF_INET6 ? sizeof(addr->in6) : sizeof(addr->in);
+}
+
+int address_port(const union address *addr) {
+    return ntohs(addr->sa.sa_family == AF_INET6 ? addr->in6.sin6_port : addr->in.sin_port);
+}
+
+int address_equal(const union address *a, const union address *b) {
+    if (a->sa.sa_family != b->sa.sa_family || address_port(a) != address_port(b)) {
+        return 0;
+    }
+    if (a->sa.sa_family == AF_INET6) {
+        return memcmp(&a->in6.sin6_addr, &b->in6.sin6_addr, sizeof(a->in6.sin6_addr)) == 0;
+    }
+    return a->in.sin_addr.s_addr == b->in.sin_addr.s_addr;
+}
+
+// "ip:port", with IPv6 addresses in brackets
+void address_format(const union address *addr, char *out, size_t size) {
+    char ip[INET6_ADDRSTRLEN];
+
+    if (addr->sa.sa_family == AF_INET6) {
+        inet_ntop(AF_INET6, &addr->in6.sin6_addr, ip, sizeof(ip));
+        snprintf(out, size, "[%s]:%d", ip, address_port(addr));
+    } else {
+        inet_ntop(AF_INET, &addr->in.sin_addr, ip, sizeof(ip));
+        snprintf(out, size, "%s:%d", ip, address_port(addr));
+    }
+}
+
+// Parse "a.b.c.d[:port]", "[v6addr]:port" or a bare IPv6 address
+int parse_address(const char *str, int default_port, union address *addr) {
+    char host[64];
+    const char *start = str, *port_str = NULL;
+    size_t len;
+    int port = default_port;
+
+    if (str[0] == '[') {
+        const char *close = strchr(str, ']');
+        if (!close || (close[1] != '\0' && close[1] != ':')) {
+            return -1;
+        }
+        start = str + 1;
+        len = close - start;
+        port_str = (close[1] == ':') ? close + 2 : NULL;
+    } else {
+        const char *colon = strchr(str, ':');
+        if (colon && strchr(colon + 1, ':')) {
+            colon = NULL; // More than one colon: IPv6 without a port
+        }
+        len = colon ? (size_t)(colon - str) : strlen(str);
+        port_str = colon ? colon + 1 : NULL;
+    }
+
+    if (len >= sizeof(host)) {
+        return -1;
+    }
+    memcpy(host, start, len);
+    host[len] = '\0';
+    if (port_str) {
+        char *end;
+        port = strtol(port_str, &end, 10);
+        if (*end != '\0' || port < 1 || port > 65535) {
+            return -1;
+        }
+    }
+
+    memset(addr, 0, sizeof(*addr));
+    if (inet_pton(AF_INET, host, &addr->in.sin_addr) == 1) {
+        addr->in.sin_family = AF_INET;
+        addr->in.sin_port = htons(port);
+        return 0;
+    }
+    if (inet_pton(AF_INET6, host, &addr->in6.sin6_addr) == 1) {
+        addr->in6.sin6_family = AF_INET6;
+        addr->in6.sin6_port = htons(port);
+        return 0;
+    }
+    return -1;
+}
+
+// Write the PROXY protocol header announcing a connection from src to
+// dst. Both are of the same family as they come from one socket.
+size_t proxy_header_build(char *out, enum proxy_protocol version,
+                          const union address *src, const union address *dst) {
+    static const char signature[12] = "\r\n\r\n\0\r\nQUIT\n";
+    int v6 = (src->sa.sa_family == AF_INET6);
+
+    if (version == PROXY_V1) {
+        char src_ip[INET6_ADDRSTRLEN], dst_ip[INET6_ADDRSTRLEN];
+        inet_ntop(src->sa.sa_family, v6 ? (const void *)&src->in6.sin6_addr : (const void *)&src->in.sin_addr,
+                  src_ip, sizeof(src_ip));
+        inet_ntop(dst->sa.sa_family, v6 ? (const void *)&dst->in6.sin6_addr : (const void *)&dst->in.sin_addr,
+                  dst_ip, sizeof(dst_ip));
+        return snprintf(out, PROXY_HEADER_MAX, "PROXY %s %s %s %d %d\r\n", v6 ? "TCP6" : "TCP4",
+                        src_ip, dst_ip, address_port(src), address_port(dst));
+    }
+
+    // Binary v2: signature, PROXY command, TCP over IPv4 or IPv6, then the
+    // addresses and ports in network byte order
+    unsigned char *p = (unsigned char *)out;
+    memcpy(p, signature, sizeof(signature));
+    p[12] = 0x21;
+    p[13] = v6 ? 0x21 : 0x11;
+    p[14] = 0;
+    p[15] = v6 ? 36 : 12;
+    p += 16;
+    if (v6) {
+        memcpy(p, &src->in6.sin6_addr, 16);
+        memcpy(p + 16, &dst->in6.sin6_addr, 16);
+        memcpy(p + 32, &src->in6.sin6_port, 2);
+        memcpy(p + 34, &dst->in6.sin6_port, 2);
+        return 16 + 36;
+    }
+    memcpy(p, &src->in.sin_addr, 4);
+    memcpy(p + 4, &dst->in.sin_addr, 4);
+    memcpy(p + 8, &src->in.sin_port, 2);
+    memcpy(p + 10, &dst->in.sin_port, 2);
+    return 16 + 12;
+}
+
+// Configs are only built by the main thread, so slots are appended without
+// a lock and published to the metrics thread through the count. Once all
+// slots are taken further addresses share the last one.
+int stat_slot_for(const union address *addr) {
+    int count = atomic_load(&stat_slot_count);
+
+    for (int i = 0; i < count; i++) {
+        if (address_equal(&stat_slots[i].addr, addr)) {
+            return i;
         }
+    }
+    if (count == MAX_STAT_SLOTS) {
+        return MAX_STAT_SLOTS - 1;
+    }
+    stat_slots[count].addr = *addr;
+    address_format(addr, stat_slots[count].host, sizeof(stat_slots[count].host));
+    atomic_store_explicit(&stat_slot_count, count + 1, memory_order_release);
+    return count;
+}
+
+int add_backend(struct lb_config *cfg, const char *spec, int weight) {
+    if (cfg->backend_count >= MAX_BACKENDS) {
+        return -1;
+    }
+    struct backend *b = &cfg->backends[cfg->backend_count];
+    memset(b, 0, sizeof(*b));
+    if (parse_address(spec, BACKEND_PORT, &b->addr) < 0) {
+        return -1;
+    }
+    b->id = cfg->backend_count++;
+    snprintf(b->host, sizeof(b->host), "%s", spec);
+    b->weight = weight > 0 ? weight : 1;
+    b->up = 1; // Nodes start in service until probes say otherwise
+    return 0;
+}
+
+struct lb_config *default_config() {
+    struct lb_config *cfg = calloc(1, sizeof(*cfg));
+    if (!cfg) {
+        return NULL;
+    }
+    atomic_init(&cfg->refs, 1);
+    cfg->listen_count = 1;
+    cfg->listen[0].in.sin_family = AF_INET;
+    cfg->listen[0].in.sin_addr.s_addr = INADDR_ANY;
+    cfg->listen[0].in.sin_port = htons(LISTEN_PORT);
+    cfg->backlog = LISTEN_BACKLOG;
+    cfg->metrics_enabled = 1;
+    cfg->metrics.in.sin_family = AF_INET;
+    cfg->metrics.in.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    cfg->metrics.in.sin_port = htons(METRICS_PORT);
+    cfg->workers = sysconf(_SC_NPROCESSORS_ONLN);
+    cfg->algorithm = &lb_algorithms[0];
+    cfg->splice = 1;
+    cfg->buffer_size = BUFFER_SIZE;
+    cfg->pipe_size = PIPE_SIZE;
+    cfg->health_interval = HEALTH_INTERVAL;
+    cfg->health_timeout = HEALTH_TIMEOUT;
+    cfg->health_rise = HEALTH_RISE;
+    cfg->health_fall = HEALTH_FALL;
+    cfg->pool_min = POOL_MIN;
+    cfg->pool_max = POOL_MAX;
+    cfg->pool_idle = POOL_IDLE;
+    cfg->connect_timeout = CONNECT_TIMEOUT;
+    cfg->connect_retries = CONNECT_RETRIES;
+    cfg->idle_timeout = IDLE_TIMEOUT;
+    cfg->client_burst = CLIENT_BURST;
+    cfg->overload_latency = OVERLOAD_LATENCY;
+    cfg->drain_timeout = DRAIN_TIMEOUT;
+    cfg->log_level = LOG_INFO;
+    cfg->log_rate = LOG_RATE;
+    for (int i = 0; i < BACKEND_NODES; i++) {
+        add_backend(cfg, backend_nodes[i], 1);
+    }
+    return cfg;
+}
+
+int find_engine(const char *name) {
+    if (strcmp(name, "epoll") == 0) {
+        return ENGINE_EPOLL;
+    }
+    if (strcmp(name, "io_uring") == 0) {
+        return ENGINE_IO_URING;
+    }
+    return -1;
+}
+
+// Apply one "key value..." line of the configuration file
+int apply_config_line(struct lb_config *cfg, char *line, int *listen_seen, int *backend_seen) {
+    char *args[4];
+    int argc = 0;
+
+    for (char *tok = strtok(line, " \t\r\n"); tok && argc < 4; tok = strtok(NULL, " \t\r\n")) {
+        args[argc++] = tok;
+    }
+    if (argc == 0) {
+        return 0;
+    }
+    if (argc < 2) {
+        return -1;
+    }
+
+    const char *key = args[0];
+    const char *value = args[1];
 
-        // Detach the thread to allow it to clean up automatically
-        pthread_detach(thread_id);
+    if (strcmp(key, "listen") == 0) {
+        // The first listen line replaces the built-in default
+        if (!*listen_seen) {
+            cfg->listen_count = 0;
+            *listen_seen = 1;
+        }
+        if (cfg->listen_count >= MAX_LISTENERS ||
+            parse_address(value, LISTEN_PORT, &cfg->listen[cfg->listen_count]) < 0) {
+            return -1;
+        }
+        cfg->listen_count++;
+    } else if (strcmp(key, "backend") == 0) {
+        int weight = 1;
+        if (!*backend_seen) {
+            cfg->backend_count = 0;
+            *backend_seen = 1;
+        }
+        if (argc > 2 && sscanf(args[2], "weight=%d", &weight) != 1) {
+            return -1;
+        }
+        return add_backend(cfg, value, weight);
+    } else if (strcmp(key, "algorithm") == 0) {
+        cfg->algorithm = find_lb_algorithm(value);
+        return cfg->algorithm ? 0 : -1;
+    } else if (strcmp(key, "metrics") == 0) {
+        cfg->metrics_enabled = (strcmp(value, "off") != 0);
+        if (cfg->metrics_enabled) {
+            return parse_address(value, METRICS_PORT, &cfg->metrics);
+        }
+    } else if (strcmp(key, "log_level") == 0) {
+        cfg->log_level = find_log_level(value);
+        return cfg->log_level >= 0 ? 0 : -1;
+    } else if (strcmp(key, "splice") == 0) {
+        cfg->splice = (strcmp(value, "on") == 0 || strcmp(value, "1") == 0);
+    } else if (strcmp(key, "engine") == 0) {
+        int engine = find_engine(value);
+        if (engine < 0) {
+            return -1;
+        }
+        cfg->engine = engine;
+    } else if (strcmp(key, "proxy_protocol") == 0) {
+        if (strcmp(value, "off") == 0) {
+            cfg->proxy_protocol = PROXY_OFF;
+        } else if (strcmp(value, "v1") == 0) {
+            cfg->proxy_protocol = PROXY_V1;
+        } else if (strcmp(value, "v2") == 0) {
+            cfg->proxy_protocol = PROXY_V2;
+        } else {
+            return -1;
+        }
+    } else {
+        struct {
+            const char *name;
+            int *field;
+        } ints[] = {
+            {"backlog", &cfg->backlog},
+            {"workers", &cfg->workers},
+            {"buffer_size", &cfg->buffer_size},
+            {"pipe_size", &cfg->pipe_size},
+            {"health_interval", &cfg->health_interval},
+            {"health_timeout", &cfg->health_timeout},
+            {"health_rise", &cfg->health_rise},
+            {"health_fall", &cfg->health_fall},
+            {"pool_min", &cfg->pool_min},
+            {"pool_max", &cfg->pool_max},
+            {"pool_idle", &cfg->pool_idle},
+            {"connect_timeout", &cfg->connect_timeout},
+            {"connect_retries", &cfg->connect_retries},
+            {"idle_timeout", &cfg->idle_timeout},
+            {"client_rate", &cfg->client_rate},
+            {"client_burst", &cfg->client_burst},
+            {"max_sessions", &cfg->max_sessions},
+            {"overload_latency", &cfg->overload_latency},
+            {"drain_timeout", &cfg->drain_timeout},
+            {"log_rate", &cfg->log_rate},
+        };
+        for (size_t i = 0; i < sizeof(ints) / sizeof(ints[0]); i++) {
+            if (strcmp(key, ints[i].name) == 0) {
+                char *end;
+                *ints[i].field = strtol(value, &end, 10);
+                return *end == '\0' ? 0 : -1;
+            }
+        }
+        return -1;
+    }
+    return 0;
+}
+
+// Returns 0 when the file was applied, or is optional and does not exist
+int load_config_file(struct lb_config *cfg, const char *path, int required) {
+    char line[512], copy[512];
+    int line_no = 0, listen_seen = 0, backend_seen = 0;
+
+    FILE *fp = fopen(path, "r");
+    if (!fp) {
+        if (!required && errno == ENOENT) {
+            return 0;
+        }
+        log_message(LOG_ERROR, "Cannot open configuration %s: %s", path, strerror(errno));
+        return -1;
+    }
+    while (fgets(line, sizeof(line), fp)) {
+        line_no++;
+        line[strcspn(line, "#\r\n")] = '\0';
+        snprintf(copy, sizeof(copy), "%s", line);
+        if (apply_config_line(cfg, line, &listen_seen, &backend_seen) < 0) {
+            log_message(LOG_ERROR, "%s:%d: invalid setting: %s", path, line_no, copy);
+            fclose(fp);
+            return -1;
+        }
+    }
+    fclose(fp);
+    return 0;
+}
+
+// Apply command line overrides; also re-run after every reload
+int apply_arguments(struct lb_config *cfg, int argc, char *argv[]) {
+    int opt;
+
+    optind = 1;
+    while ((opt = getopt(argc, argv, "a:c:e:f:i:l:p:r:t:uw:")) != -1) {
+        switch (opt) {
+            case 'a':
+                cfg->algorithm = find_lb_algorithm(optarg);
+                if (!cfg->algorithm) {
+                    fprintf(stderr, "Unknown algorithm %s "
+                            "(roundrobin, leastconn, weighted, p2c, maglev)\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'c':
+                break;
+            case 'e':
+                if (find_engine(optarg) < 0) {
+                    fprintf(stderr, "Unknown engine %s (epoll, io_uring)\n", optarg);
+                    return -1;
+                }
+                cfg->engine = find_engine(optarg);
+                break;
+            case 'l':
+                cfg->log_level = find_log_level(optarg);
+                if (cfg->log_level < 0) {
+                    fprintf(stderr, "Unknown log level %s (error, warn, info, debug)\n", optarg);
+                    return -1;
+                }
+                break;
+            case 'f':
+                cfg->health_fall = atoi(optarg);
+                break;
+            case 'i':
+                cfg->health_interval = atoi(optarg);
+                break;
+            case 'p':
+                // min[:max[:idle_ms]]
+                cfg->pool_max = -1;
+                sscanf(optarg, "%d:%d:%d", &cfg->pool_min, &cfg->pool_max, &cfg->pool_idle);
+                if (cfg->pool_max < cfg->pool_min) {
+                    cfg->pool_max = cfg->pool_min;
+                }
+                break;
+            case 'r':
+                cfg->health_rise = atoi(optarg);
+                break;
+            case 't':
+                cfg->health_timeout = atoi(optarg);
+                break;
+            case 'u':
+                cfg->splice = 0;
+                break;
+            case 'w':
+                cfg->workers = atoi(optarg);
+                break;
+            default:
+                fprintf(stderr, "Usage: %s [-c config] [-l level] [-a algorithm] [-e engine] [-u] [-w workers] "
+                        "[-i interval_ms] [-t timeout_ms] [-r rise] [-f fall] "
+                        "[-p min[:max[:idle_ms]]]\n", argv[0]);
+                return -1;
+        }
+    }
+    return 0;
+}
+
+void sanitize_config(struct lb_config *cfg) {
+    if (cfg->workers < 1) {
+        cfg->workers = 1;
+    }
+    if (cfg->workers > MAX_WORKERS) {
+        cfg->workers = MAX_WORKERS;
+    }
+    if (cfg->backlog < 1) {
+        cfg->backlog = LISTEN_BACKLOG;
+    }
+    if (cfg->buffer_size < 1024) {
+        cfg->buffer_size = 1024;
+    }
+    if (cfg->pipe_size < 4096) {
+        cfg->pipe_size = 4096;
+    }
+    if (cfg->health_rise < 1) {
+        cfg->health_rise = 1;
+    }
+    if (cfg->health_fall < 1) {
+        cfg->health_fall = 1;
+    }
+    if (cfg->pool_min < 0) {
+        cfg->pool_min = 0;
+    }
+    if (cfg->pool_max < cfg->pool_min) {
+        cfg->pool_max = cfg->pool_min;
+    }
+    if (cfg->pool_idle < POOL_TICK) {
+        cfg->pool_idle = POOL_TICK;
+    }
+    if (cfg->connect_timeout < TIMER_TICK) {
+        cfg->connect_timeout = TIMER_TICK;
+    }
+    if (cfg->connect_retries < 0) {
+        cfg->connect_retries = 0;
+    }
+    if (cfg->idle_timeout < 0) {
+        cfg->idle_timeout = 0;
+    }
+    // The bucket fill has to fit its bits of the packed state
+    if (cfg->client_burst < 1) {
+        cfg->client_burst = 1;
+    }
+    if (cfg->client_burst > ((1 << RATE_TOKEN_BITS) - 1) / RATE_TOKEN) {
+        cfg->client_burst = ((1 << RATE_TOKEN_BITS) - 1) / RATE_TOKEN;
+    }
+    if (cfg->client_rate < 0) {
+        cfg->client_rate = 0;
+    }
+    // Default to what the descriptor limit allows: a client and a backend
+    // socket plus room for relay pipes
+    if (cfg->max_sessions <= 0) {
+        struct rlimit rl;
+        cfg->max_sessions = (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur != RLIM_INFINITY)
+                                ? (int)(rl.rlim_cur / 4) : 1 << 20;
+    }
+}
+
+// Built-in defaults, then the configuration file, then the command line
+struct lb_config *build_config(int required) {
+    struct lb_config *cfg = default_config();
+    if (!cfg) {
+        return NULL;
+    }
+    if (load_config_file(cfg, config_path, required) < 0 ||
+        apply_arguments(cfg, saved_argc, saved_argv) < 0) {
+        free(cfg);
+        return NULL;
+    }
+    if (cfg->backend_count == 0) {
+        log_message(LOG_ERROR, "Configuration has no backends");
+        free(cfg);
+        return NULL;
+    }
+    sanitize_config(cfg);
+    for (int i = 0; i < cfg->backend_count; i++) {
+        cfg->backends[i].stat_slot = stat_slot_for(&cfg->backends[i].addr);
+    }
+    return cfg;
+}
+
+void wake_workers() {
+    uint64_t one = 1;
+    for (int i = 0; i < worker_count; i++) {
+        write(workers[i].wake.fd, &one, sizeof(one));
+    }
+}
+
+// SIGHUP: build the new table, carry health state over for nodes that
+// stayed, then publish it. In-flight sessions hold a reference to the old
+// table, which is freed when the last of them closes.
+void reload_config() {
+    struct lb_config *cfg = build_config(1);
+
+    if (!cfg) {
+        log_message(LOG_WARN, "Reload failed, keeping the current configuration");
+        return;
+    }
+
+    pthread_mutex_lock(&backend_mutex);
+    struct lb_config *old = current_config;
+    for (int i = 0; i < cfg->backend_count; i++) {
+        struct backend *b = &cfg->backends[i];
+        for (int j = 0; j < old->backend_count; j++) {
+            struct backend *prev = &old->backends[j];
+            if (address_equal(&b->addr, &prev->addr)) {
+                b->up = prev->up;
+                b->rise_count = prev->rise_count;
+                b->fall_count = prev->fall_count;
+                break;
+            }
+        }
+    }
+    if (cfg->listen_count != old->listen_count ||
+        memcmp(cfg->listen, old->listen, sizeof(cfg->listen[0]) * cfg->listen_count) != 0 ||
+        cfg->backlog != old->backlog || cfg->workers != old->workers ||
+        cfg->engine != old->engine || cfg->metrics_enabled != old->metrics_enabled ||
+        memcmp(&cfg->metrics, &old->metrics, sizeof(cfg->metrics)) != 0) {
+        log_message(LOG_WARN, "listen, backlog, workers, engine and metrics changes need a binary upgrade (SIGUSR2)");
+    }
+    current_config = cfg;
+    atomic_store(&log_level, cfg->log_level);
+    atomic_store(&log_rate, cfg->log_rate);
+    struct healthy_view *old_view = swap_healthy_view_locked();
+    pthread_mutex_unlock(&backend_mutex);
+
+    retire_view(old_view);
+    config_put(old);
+    wake_workers();
+
+    log_message(LOG_INFO, "Configuration reloaded: %d backends, algorithm %s",
+                cfg->backend_count, cfg->algorithm->name);
+}
+
+long elapsed_ms(const struct timespec *start) {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) * 1000 + (now.tv_nsec - start->tv_nsec) / 1000000;
+}
+
+// Probe every backend with a concurrent non-blocking TCP connect.
+// result[i] is set to 1 when backend i accepted the connection in time.
+void probe_backends(struct lb_config *cfg, int result[]) {
+    struct pollfd fds[MAX_BACKENDS];
+    struct timespec start;
+    int count = cfg->backend_count;
+    int pending = 0;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < count; i++) {
+        result[i] = 0;
+        fds[i].events = POLLOUT;
+        fds[i].revents = 0;
+        const union address *addr = &cfg->backends[i].addr;
+        fds[i].fd = socket(addr->sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fds[i].fd < 0) {
+            continue;
+        }
+        if (connect(fds[i].fd, &addr->sa, address_len(addr)) == 0) {
+            result[i] = 1;
+            close(fds[i].fd);
+            fds[i].fd = -1;
+        } else if (errno == EINPROGRESS) {
+            pending++;
+        } else {
+            close(fds[i].fd);
+            fds[i].fd = -1;
+        }
+    }
+
+    while (pending > 0) {
+        long left = cfg->health_timeout - elapsed_ms(&start);
+        if (left <= 0 || poll(fds, count, left) <= 0) {
+            break;
+        }
+        for (int i = 0; i < count; i++) {
+            if (fds[i].fd < 0 || !fds[i].revents) {
+                continue;
+            }
+            int err = 0;
+            socklen_t len = sizeof(err);
+            getsockopt(fds[i].fd, SOL_SOCKET, SO_ERROR, &err, &len);
+            result[i] = (err == 0);
+            close(fds[i].fd);
+            fds[i].fd = -1;
+            pending--;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (fds[i].fd >= 0) {
+            close(fds[i].fd);
+        }
+    }
+}
+
+// Background health checker: applies rise/fall hysteresis to the probe
+// results and republishes the healthy view when a node changes state.
+void *health_loop(void *arg) {
+    int result[MAX_BACKENDS];
+    (void)arg;
+
+    while (1) {
+        struct timespec start;
+        struct healthy_view *old_view = NULL;
+        int changed = 0;
+
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        pthread_mutex_lock(&backend_mutex);
+        struct lb_config *cfg = current_config;
+        config_get(cfg);
+        pthread_mutex_unlock(&backend_mutex);
+
+        int interval = cfg->health_interval;
+        if (interval > 0) {
+            probe_backends(cfg, result);
+
+            pthread_mutex_lock(&backend_mutex);
+            // Results for a table that a reload replaced while probing are dropped
+            for (int i = 0; cfg == current_config && i < cfg->backend_count; i++) {
+                struct backend *b = &cfg->backends[i];
+
+                if (result[i]) {
+                    b->fall_count = 0;
+                    if (!b->up && ++b->rise_count >= cfg->health_rise) {
+                        b->up = 1;
+                        b->rise_count = 0;
+                        changed = 1;
+                        log_message(LOG_INFO, "Backend %s is UP", b->host);
+                    }
+                } else {
+                    b->rise_count = 0;
+                    if (b->up && ++b->fall_count >= cfg->health_fall) {
+                        b->up = 0;
+                        b->fall_count = 0;
+                        changed = 1;
+                        log_message(LOG_WARN, "Backend %s is DOWN, ejected", b->host);
+                    }
+                }
+            }
+            if (changed) {
+                old_view = swap_healthy_view_locked();
+            }
+            pthread_mutex_unlock(&backend_mutex);
+            retire_view(old_view);
+        } else {
+            interval = 1000; // Disabled; look again in case a reload enables it
+        }
+        config_put(cfg);
+
+        long left = interval - elapsed_ms(&start);
+        if (left > 0) {
+            struct timespec pause = {left / 1000, (left % 1000) * 1000000};
+            nanosleep(&pause, NULL);
+        }
+    }
+    return NULL;
+}
+
+char *buffer_get(struct worker *w, size_t *size) {
+    struct free_buffer *fb = w->free_buffers;
+
+    *size = w->buffer_size;
+    if (fb) {
+        w->free_buffers = fb->next;
+        return (char *)fb;
+    }
+    return malloc(w->buffer_size);
+}
+
+// Buffers of a size that a reload has changed are not cached again
+void buffer_put(struct worker *w, char *buf, size_t size) {
+    struct free_buffer *fb = (struct free_buffer *)buf;
+
+    if (size != w->buffer_size) {
+        free(buf);
+        return;
+    }
+    fb->next = w->free_buffers;
+    w->free_buffers = fb;
+}
+
+int pipe_get(struct worker *w, int p[2]) {
+    if (w->pipe_count > 0) {
+        w->pipe_count--;
+        p[0] = w->pipes[w->pipe_count][0];
+        p[1] = w->pipes[w->pipe_count][1];
+        return 0;
+    }
+    if (pipe2(p, O_NONBLOCK | O_CLOEXEC) < 0) {
+        return -1;
+    }
+    fcntl(p[1], F_SETPIPE_SZ, w->config->pipe_size);
+    return 0;
+}
+
+// Only empty pipes may be recycled; a pipe holding stale bytes is closed
+void pipe_put(struct worker *w, int p[2], int empty) {
+    if (empty && w->pipe_count < PIPE_CACHE) {
+        w->pipes[w->pipe_count][0] = p[0];
+        w->pipes[w->pipe_count][1] = p[1];
+        w->pipe_count++;
+    } else {
+        close(p[0]);
+        close(p[1]);
+    }
+    p[0] = p[1] = -1;
+}
+
+void relay_init(struct relay *r) {
+    memset(r, 0, sizeof(*r));
+    r->pipe[0] = r->pipe[1] = -1;
+}
+
+void relay_release(struct worker *w, struct relay *r) {
+    if (r->pipe[0] >= 0) {
+        pipe_put(w, r->pipe, r->len == 0);
+    }
+    if (r->buf) {
+        buffer_put(w, r->buf, r->buf_size);
+        r->buf = NULL;
+    }
+    r->off = r->len = 0;
+}
+
+// Register or update the epoll interest set of an endpoint
+int endpoint_watch(struct worker *w, struct endpoint *ep, uint32_t events) {
+    struct epoll_event ev;
+
+    if (ep->registered && ep->events == events) {
+        return 0;
+    }
+    ev.events = events;
+    ev.data.ptr = ep;
+    if (epoll_ctl(w->epfd, ep->registered ? EPOLL_CTL_MOD : EPOLL_CTL_ADD, ep->fd, &ev) < 0) {
+        return -1;
+    }
+    ep->events = events;
+    ep->registered = 1;
+    return 0;
+}
+
+void timer_cancel(struct worker *w, struct timer *t) {
+    if (t->prev) {
+        t->prev->next = t->next;
+        t->next->prev = t->prev;
+        t->prev = t->next = NULL;
+        w->timers--;
+    }
+}
+
+// O(1) insert into the slot of the tick the timer expires in. Slots are
+// run once their tick has passed; timers a lap or more ahead stay put.
+void timer_schedule(struct worker *w, struct timer *t, long expires) {
+    long tick = expires / TIMER_TICK;
+
+    timer_cancel(w, t);
+    if (tick <= w->wheel_tick) {
+        tick = w->wheel_tick + 1;
+    }
+    struct timer *head = &w->wheel[tick % WHEEL_SLOTS];
+    t->expires = expires;
+    t->prev = head;
+    t->next = head->next;
+    head->next->prev = t;
+    head->next = t;
+    w->timers++;
+}
+
+// Minimal io_uring plumbing on raw system calls. A ring belongs to one
+// worker thread, which is the only one to submit and reap.
+long uring_setup(unsigned entries, struct io_uring_params *p) {
+    return syscall(__NR_io_uring_setup, entries, p);
+}
+
+long uring_register(int fd, unsigned opcode, void *arg, unsigned nr) {
+    return syscall(__NR_io_uring_register, fd, opcode, arg, nr);
+}
+
+// Submit everything queued and, with wait set, block for one completion
+// or timeout_ms (-1 waits indefinitely). Returns -1 with errno on failure.
+int uring_enter(struct uring *u, int wait, int timeout_ms) {
+    struct io_uring_getevents_arg arg;
+    struct __kernel_timespec ts;
+    unsigned flags = wait ? IORING_ENTER_GETEVENTS | IORING_ENTER_EXT_ARG : 0;
+
+    memset(&arg, 0, sizeof(arg));
+    if (wait && timeout_ms >= 0) {
+        ts.tv_sec = timeout_ms / 1000;
+        ts.tv_nsec = (timeout_ms % 1000) * 1000000L;
+        arg.ts = (uint64_t)(uintptr_t)&ts;
+    }
+    atomic_store_explicit(u->sq_tail, u->sq_local, memory_order_release);
+    long n = syscall(__NR_io_uring_enter, u->fd, u->sq_local - u->sq_submitted, wait ? 1 : 0,
+                     flags, wait ? &arg : NULL, wait ? sizeof(arg) : 0);
+    if (n < 0) {
+        return -1;
+    }
+    u->sq_submitted += n;
+    return 0;
+}
+
+// Make room for count SQEs that must go out in the same submission, as a
+// link chain may not be split
+void uring_reserve(struct uring *u, unsigned count) {
+    if (u->sq_local - atomic_load_explicit(u->sq_head, memory_order_acquire) + count > u->sq_entries) {
+        uring_enter(u, 0, 0);
+    }
+}
+
+struct io_uring_sqe *uring_sqe(struct uring *u, uint8_t opcode, uint64_t user_data) {
+    uring_reserve(u, 1);
+    unsigned index = u->sq_local++ & u->sq_mask;
+    struct io_uring_sqe *sqe = &u->sqes[index];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->user_data = user_data;
+    u->sq_array[index] = index;
+    return sqe;
+}
+
+// Sessions come from calloc(), so their low four address bits are free to
+// carry the operation
+uint64_t uring_tag(struct session *s, enum uring_op op) {
+    return (uint64_t)(uintptr_t)s | op;
+}
+
+// Hand a provided buffer back to the kernel
+void uring_buffer_put(struct worker *w, int bid) {
+    struct uring *u = w->uring;
+    struct io_uring_buf *b = &u->buf_ring->bufs[u->buf_tail & (URING_BUFFERS - 1)];
+
+    b->addr = (uint64_t)(uintptr_t)(u->buffers + (size_t)bid * u->buf_size);
+    b->len = u->buf_size;
+    b->bid = bid;
+    u->buf_tail++;
+    u->buf_free++;
+    atomic_store_explicit((_Atomic uint16_t *)&u->buf_ring->tail, u->buf_tail, memory_order_release);
+}
+
+// Install fd in a fixed file slot; linked to the operation that follows
+void uring_install(struct uring *u, struct session *s, int *fd, int slot) {
+    struct io_uring_sqe *sqe = uring_sqe(u, IORING_OP_FILES_UPDATE, uring_tag(s, UOP_FILES));
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)fd;
+    sqe->len = 1;
+    sqe->off = slot;
+    sqe->flags = IOSQE_IO_LINK;
+    s->inflight++;
+}
+
+// Empty the fixed file slot; it is reused once the kernel confirms
+void uring_release_slot(struct uring *u, int slot) {
+    static int no_file = -1;
+
+    struct io_uring_sqe *sqe = uring_sqe(u, IORING_OP_FILES_UPDATE, ((uint64_t)slot << 4) | UOP_SLOT);
+    sqe->fd = -1;
+    sqe->addr = (uint64_t)(uintptr_t)&no_file;
+    sqe->len = 1;
+    sqe->off = slot;
+}
+
+// Stop the operations of a closed session: shutting the sockets down
+// completes pending receives and sends, and the NOP guarantees one more
+// completion, after which the session is released
+void uring_close_session(struct worker *w, struct session *s) {
+    shutdown(s->client.fd, SHUT_RDWR);
+    if (s->backend.fd >= 0) {
+        shutdown(s->backend.fd, SHUT_RDWR);
+    }
+    uring_sqe(w->uring, IORING_OP_NOP, uring_tag(s, UOP_NOP));
+    s->inflight++;
+}
+
+// Last completion of a closed session has arrived
+void uring_release_session(struct worker *w, struct session *s) {
+    struct uring *u = w->uring;
+
+    if (s->starved) {
+        struct session **link = &u->starved;
+        while (*link != s) {
+            link = &(*link)->next_starved;
+        }
+        *link = s->next_starved;
+    }
+
+    close(s->client.fd);
+    if (s->backend.fd >= 0) {
+        close(s->backend.fd);
+    }
+    if (s->up.buf) {
+        uring_buffer_put(w, s->up.bid);
+    }
+    if (s->down.buf) {
+        uring_buffer_put(w, s->down.bid);
+    }
+    if (s->client_slot >= 0) {
+        uring_release_slot(u, s->client_slot);
+    }
+    if (s->backend_slot >= 0) {
+        uring_release_slot(u, s->backend_slot);
+    }
+    s->next_closed = w->closed;
+    w->closed = s;
+}
+
+void close_session(struct worker *w, struct session *s) {
+    if (s->closed) {
+        return;
+    }
+    s->closed = 1;
+    timer_cancel(w, &s->timer);
+
+    if (w->uring) {
+        uring_close_session(w, s);
+    } else {
+        // Closing the descriptors also removes them from the epoll set
+        close(s->client.fd);
+        if (s->backend.fd >= 0) {
+            close(s->backend.fd);
+        }
+        relay_release(w, &s->up);
+        relay_release(w, &s->down);
+
+        // Other events for this session may still be in the current batch
+        s->next_closed = w->closed;
+        w->closed = s;
+    }
+
+    if (s->backend_node) {
+        atomic_fetch_sub_explicit(&s->backend_node->active, 1, memory_order_relaxed);
+    }
+    w->sessions--;
+    atomic_fetch_sub_explicit(&sessions_open, 1, memory_order_relaxed);
+    stat_add(&w->stats.closed, 1);
+
+    log_message(LOG_DEBUG, "Connection closed");
+}
+
+void release_closed_sessions(struct worker *w) {
+    while (w->closed) {
+        struct session *s = w->closed;
+        w->closed = s->next_closed;
+        config_put(s->config);
+        free(s);
+    }
+    while (w->closed_pool) {
+        struct pooled_conn *pc = w->closed_pool;
+        w->closed_pool = pc->next;
+        config_put(pc->config);
+        free(pc);
+    }
+}
+
+long monotonic_ms() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+long monotonic_us() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000 + now.tv_nsec / 1000;
+}
+
+void record_connect(struct worker *w, struct backend *b, long start_us) {
+    struct backend_stats *bs = &w->stats.backends[b->stat_slot];
+    long us = monotonic_us() - start_us;
+    int bucket = 0;
+
+    while (bucket < LATENCY_BUCKETS && us > latency_bounds_us[bucket]) {
+        bucket++;
+    }
+    stat_add(&bs->connect_latency[bucket], 1);
+    stat_add(&bs->connect_time_us, us);
+}
+
+void record_connect_failure(struct worker *w, struct backend *b) {
+    stat_add(&w->stats.backends[b->stat_slot].connect_failures, 1);
+}
+
+void pool_unlink(struct backend_pool *pool, struct pooled_conn *pc) {
+    if (pc->prev) {
+        pc->prev->next = pc->next;
+    } else {
+        pool->head = pc->next;
+    }
+    if (pc->next) {
+        pc->next->prev = pc->prev;
+    } else {
+        pool->tail = pc->prev;
+    }
+    pc->prev = pc->next = NULL;
+}
+
+// Remove a pool entry; with close_fd == 0 the socket was handed to a session
+void pool_discard(struct worker *w, struct pooled_conn *pc, int close_fd) {
+    // Entries of a replaced config are no longer counted in the pools
+    if (pc->config == w->config) {
+        struct backend_pool *pool = &w->pools[pc->node->id];
+        if (pc->connected) {
+            pool_unlink(pool, pc);
+            pool->idle--;
+        } else {
+            pool->connecting--;
+        }
+    }
+    if (close_fd) {
+        close(pc->ep.fd);
+    }
+    pc->ep.fd = -1;
+    pc->next = w->closed_pool;
+    w->closed_pool = pc;
+}
+
+// Start non-blocking connects until the pool reaches its target size
+void pool_refill(struct worker *w, struct backend *b) {
+    struct backend_pool *pool = &w->pools[b->id];
+    int one = 1;
+
+    if (!w->accepting) {
+        return;
+    }
+    while (pool->idle + pool->connecting < pool->target) {
+        struct pooled_conn *pc = calloc(1, sizeof(*pc));
+        if (!pc) {
+            return;
+        }
+        pc->node = b;
+        pc->ep.kind = EP_POOL;
+        pc->ep.fd = socket(b->addr.sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (pc->ep.fd < 0) {
+            free(pc);
+            return;
+        }
+        setsockopt(pc->ep.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+        pc->connect_start = monotonic_us();
+        if ((connect(pc->ep.fd, &b->addr.sa, address_len(&b->addr)) < 0 &&
+             errno != EINPROGRESS) || endpoint_watch(w, &pc->ep, EPOLLOUT) < 0) {
+            record_connect_failure(w, b);
+            close(pc->ep.fd);
+            free(pc);
+            return;
+        }
+        config_get(w->config);
+        pc->config = w->config;
+        pool->connecting++;
+    }
+}
+
+// Events on pooled sockets: connect completion, or the backend closing an
+// idle connection (any readable event on an unused socket means it is gone)
+void pool_event(struct worker *w, struct pooled_conn *pc, uint32_t events) {
+    if (pc->ep.fd < 0) {
+        return;
+    }
+    if (pc->connected || pc->config != w->config || !w->accepting) {
+        pool_discard(w, pc, 1);
+        return;
+    }
+
+    struct backend_pool *pool = &w->pools[pc->node->id];
+    int err = 0;
+    socklen_t len = sizeof(err);
+    if ((events & (EPOLLERR | EPOLLHUP)) ||
+        getsockopt(pc->ep.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        record_connect_failure(w, pc->node);
+        pool_discard(w, pc, 1);
+        return;
+    }
+    if (endpoint_watch(w, &pc->ep, EPOLLIN | EPOLLRDHUP) < 0) {
+        pool_discard(w, pc, 1);
+        return;
+    }
+    record_connect(w, pc->node, pc->connect_start);
+    pc->connected = 1;
+    pc->idle_since = monotonic_ms();
+    pool->connecting--;
+    pool->idle++;
+    pc->next = pool->head;
+    if (pool->head) {
+        pool->head->prev = pc;
+    } else {
+        pool->tail = pc;
+    }
+    pool->head = pc;
+}
+
+// Take an established connection to b, or -1 when the pool is empty.
+// The descriptor stays registered with epoll; the caller re-points it.
+int pool_take(struct worker *w, struct backend *b) {
+    struct backend_pool *pool = &w->pools[b->id];
+    int pool_max = w->config->pool_max;
+    char probe;
+
+    while (pool->head) {
+        struct pooled_conn *pc = pool->head;
+        int fd = pc->ep.fd;
+
+        // A peer close that epoll has not reported yet shows up here
+        ssize_t n = recv(fd, &probe, 1, MSG_PEEK | MSG_DONTWAIT);
+        if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            pool_discard(w, pc, 0);
+            pool_refill(w, b);
+            return fd;
+        }
+        pool_discard(w, pc, 1);
+    }
+
+    // A miss means the pool was too small for this burst
+    if (pool->target < pool_max) {
+        pool->target = (pool->target * 2 < pool_max) ? pool->target * 2 : pool_max;
+        if (pool->target == 0) {
+            pool->target = 1;
+        }
+    }
+    pool_refill(w, b);
+    return -1;
+}
+
+// Close every idle connection and forget the pool sizes. Connects still in
+// flight are dropped when they complete, as their config no longer matches
+// or the worker has stopped accepting.
+void pool_drain(struct worker *w) {
+    for (int i = 0; i < MAX_BACKENDS; i++) {
+        while (w->pools[i].head) {
+            pool_discard(w, w->pools[i].head, 1);
+        }
+        memset(&w->pools[i], 0, sizeof(w->pools[i]));
+    }
+}
+
+// Recycle connections nobody used within pool_idle, shrink the target back
+// towards pool_min, and top up the pools of every healthy backend
+void pool_maintain(struct worker *w) {
+    long now = monotonic_ms();
+    struct lb_config *cfg = w->config;
+
+    for (int i = 0; i < cfg->backend_count; i++) {
+        struct backend_pool *pool = &w->pools[i];
+        while (pool->tail && now - pool->tail->idle_since >= cfg->pool_idle) {
+            pool_discard(w, pool->tail, 1);
+            if (pool->target > cfg->pool_min) {
+                pool->target--;
+            }
+        }
+    }
+    for (int i = 0; i < w->view->count; i++) {
+        pool_refill(w, w->view->backends[i]);
+    }
+    w->next_maintenance = now + POOL_TICK;
+}
+
+// Switch the worker's per-backend state over to a newly published table
+void worker_adopt_config(struct worker *w, struct lb_config *cfg) {
+    struct lb_config *old = w->config;
+
+    pool_drain(w);
+    config_get(cfg);
+    w->config = cfg;
+    memset(w->wrr_current, 0, sizeof(w->wrr_current));
+    for (int i = 0; i < cfg->backend_count; i++) {
+        w->pools[i].target = cfg->pool_min;
+    }
+    w->next_maintenance = 0;
+
+    if ((size_t)cfg->buffer_size != w->buffer_size) {
+        while (w->free_buffers) {
+            struct free_buffer *fb = w->free_buffers;
+            w->free_buffers = fb->next;
+            free(fb);
+        }
+        w->buffer_size = cfg->buffer_size;
+    }
+    config_put(old);
+}
+
+// Account n sent bytes against the pending header first. Returns how
+// many of them were payload.
+size_t relay_consume_prefix(struct relay *r, size_t n) {
+    size_t head = (n < r->prefix_len) ? n : r->prefix_len;
+    r->prefix += head;
+    r->prefix_len -= head;
+    return n - head;
+}
+
+// Send the PROXY protocol header together with the first payload bytes.
+// A buffered payload goes out in the same sendmsg(); a spliced one follows
+// right after, corked with MSG_MORE so both still share a segment. Returns
+// the payload bytes sent.
+ssize_t relay_send_prefix(struct relay *r, int fd) {
+    struct iovec iov[2];
+    struct msghdr msg;
+    int spliced = (r->pipe[0] >= 0);
+
+    memset(&msg, 0, sizeof(msg));
+    iov[0].iov_base = (void *)r->prefix;
+    iov[0].iov_len = r->prefix_len;
+    iov[1].iov_base = r->buf ? r->buf + r->off : NULL;
+    iov[1].iov_len = r->len;
+    msg.msg_iov = iov;
+    msg.msg_iovlen = (spliced || r->len == 0) ? 1 : 2;
+
+    ssize_t n = sendmsg(fd, &msg, MSG_NOSIGNAL | (spliced && r->len > 0 ? MSG_MORE : 0));
+    if (n < 0) {
+        return -1;
+    }
+    return relay_consume_prefix(r, n);
+}
+
+// Write pending relay bytes to fd and forward a FIN once the source has
+// closed and everything before it was delivered. Returns -1 on a fatal
+// socket error.
+int relay_flush(struct worker *w, struct relay *r, int fd) {
+    while (r->len > 0 || (r->prefix_len > 0 && r->eof)) {
+        ssize_t n;
+        if (r->prefix_len > 0) {
+            n = relay_send_prefix(r, fd);
+        } else if (r->pipe[0] >= 0) {
+            n = splice(r->pipe[0], NULL, fd, NULL, r->len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+        } else {
+            n = send(fd, r->buf + r->off, r->len, MSG_NOSIGNAL);
+        }
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+        }
+        r->off += n;
+        r->len -= n;
+        r->moved = 1;
+    }
+    relay_release(w, r);
+
+    if (r->eof && !r->shut && r->prefix_len == 0) {
+        shutdown(fd, SHUT_WR);
+        r->shut = 1;
+    }
+    return 0;
+}
+
+// Move bytes from src into the kernel with splice(). Returns bytes read,
+// 0 on EOF, -1 with errno set on failure.
+ssize_t relay_fill_pipe(struct worker *w, struct relay *r, int src) {
+    ssize_t n;
+
+    if (pipe_get(w, r->pipe) < 0) {
+        return -1;
+    }
+    do {
+        n = splice(src, NULL, r->pipe[1], NULL, w->config->pipe_size,
+                   SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    } while (n < 0 && errno == EINTR);
+
+    if (n <= 0) {
+        int saved = errno;
+        pipe_put(w, r->pipe, 1);
+        errno = saved;
+    }
+    return n;
+}
+
+// Read from src into the relay. Returns -1 when the session should be
+// closed; EOF is recorded in r->eof.
+int relay_fill(struct worker *w, struct relay *r, int src) {
+    ssize_t n = -1;
+    int copy = 1;
+
+    if (splice_enabled && w->config->splice) {
+        n = relay_fill_pipe(w, r, src);
+        copy = (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+        if (copy && (errno == EINVAL || errno == ENOSYS)) {
+            // Sockets that cannot be spliced switch everyone to copying
+            splice_enabled = 0;
+            log_message(LOG_WARN, "splice() unsupported, using userspace forwarding");
+        }
+    }
+
+    // Userspace fallback, also used when no pipe could be created
+    if (copy) {
+        r->buf = buffer_get(w, &r->buf_size);
+        if (!r->buf) {
+            return -1;
+        }
+        do {
+            n = recv(src, r->buf, r->buf_size, 0);
+        } while (n < 0 && errno == EINTR);
+        if (n <= 0) {
+            int saved = errno;
+            buffer_put(w, r->buf, r->buf_size);
+            r->buf = NULL;
+            errno = saved;
+        }
+    }
+
+    if (n == 0) {
+        r->eof = 1;
+        return 0;
+    }
+    if (n < 0) {
+        return (errno == EAGAIN || errno == EWOULDBLOCK) ? 0 : -1;
+    }
+    r->off = 0;
+    r->len = n;
+    return 0;
+}
+
+// Recompute which events each side of the session waits for. The two
+// directions are independent: a side is read while its own relay is empty
+// and written while the opposite relay has pending bytes, which gives
+// per-direction backpressure without unbounded buffering.
+int session_update(struct worker *w, struct session *s) {
+    uint32_t client_events = 0, backend_events = 0;
+
+    if (s->up.len == 0 && !s->up.eof) {
+        client_events |= EPOLLIN;
+    }
+    if (s->down.len > 0) {
+        client_events |= EPOLLOUT;
+    }
+
+    if (!s->connected) {
+        backend_events = EPOLLOUT;
+    } else {
+        if (s->down.len == 0 && !s->down.eof) {
+            backend_events |= EPOLLIN;
+        }
+        // A FIN still waits for its write when the PROXY header is pending
+        if (s->up.len > 0 || (s->up.eof && !s->up.shut)) {
+            backend_events |= EPOLLOUT;
+        }
+    }
+
+    if (endpoint_watch(w, &s->client, client_events) < 0 ||
+        endpoint_watch(w, &s->backend, backend_events) < 0) {
+        return -1;
+    }
+    return 0;
+}
+
+void uring_recv(struct worker *w, struct session *s, int upstream) {
+    struct relay *r = upstream ? &s->up : &s->down;
+    struct io_uring_sqe *sqe = uring_sqe(w->uring, IORING_OP_RECV,
+                                         uring_tag(s, upstream ? UOP_RECV_UP : UOP_RECV_DOWN));
+
+    sqe->fd = upstream ? s->client_slot : s->backend_slot;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_BUFFER_SELECT;
+    sqe->buf_group = URING_BUFFER_GROUP;
+    sqe->len = w->uring->buf_size;
+    r->busy = 1;
+    s->inflight++;
+}
+
+void uring_send(struct worker *w, struct session *s, int upstream) {
+    struct relay *r = upstream ? &s->up : &s->down;
+    enum uring_op op = upstream ? UOP_SEND_UP : UOP_SEND_DOWN;
+    struct io_uring_sqe *sqe;
+
+    if (r->prefix_len > 0) {
+        // The PROXY header and the first bytes leave in one sendmsg
+        s->iov[0].iov_base = (void *)r->prefix;
+        s->iov[0].iov_len = r->prefix_len;
+        s->iov[1].iov_base = r->buf ? r->buf + r->off : NULL;
+        s->iov[1].iov_len = r->len;
+        memset(&s->msg, 0, sizeof(s->msg));
+        s->msg.msg_iov = s->iov;
+        s->msg.msg_iovlen = r->len > 0 ? 2 : 1;
+        sqe = uring_sqe(w->uring, IORING_OP_SENDMSG, uring_tag(s, op));
+        sqe->addr = (uint64_t)(uintptr_t)&s->msg;
+        sqe->len = 1;
+    } else {
+        sqe = uring_sqe(w->uring, IORING_OP_SEND, uring_tag(s, op));
+        sqe->addr = (uint64_t)(uintptr_t)(r->buf + r->off);
+        sqe->len = r->len;
+    }
+    sqe->fd = upstream ? s->backend_slot : s->client_slot;
+    sqe->flags = IOSQE_FIXED_FILE;
+    sqe->msg_flags = MSG_NOSIGNAL;
+    r->busy = 1;
+    s->inflight++;
+}
+
+// Next step of one direction once nothing is in flight: send what is
+// buffered, forward a FIN, or receive more
+void uring_forward(struct worker *w, struct session *s, int upstream) {
+    struct relay *r = upstream ? &s->up : &s->down;
+
+    if (s->closed || r->busy || (upstream && !s->connected)) {
+        return;
+    }
+    if (r->len > 0 || (r->prefix_len > 0 && r->eof)) {
+        uring_send(w, s, upstream);
+    } else if (!r->eof) {
+        uring_recv(w, s, upstream);
+    } else if (!r->shut) {
+        shutdown(upstream ? s->backend.fd : s->client.fd, SHUT_WR);
+        r->shut = 1;
+        if (s->up.shut && s->down.shut) {
+            close_session(w, s);
+        }
+    }
+}
+
+// Non-blocking connect of a fresh socket through the ring, bounded by a
+// linked timeout. Returns -1 when no socket could be created.
+int uring_connect(struct worker *w, struct session *s) {
+    struct uring *u = w->uring;
+    int one = 1;
+
+    s->tried |= 1ull << s->backend_node->id;
+    s->backend.fd = socket(s->backend_node->addr.sa.sa_family,
+                           SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->backend.fd == -1) {
+        log_message(LOG_ERROR, "Backend socket creation failed");
+        return -1;
+    }
+    setsockopt(s->backend.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    s->connect_start = monotonic_us();
+
+    // Slot update -> connect -> deadline, all in one submission
+    uring_reserve(u, 3);
+    uring_install(u, s, &s->backend.fd, s->backend_slot);
+    struct io_uring_sqe *sqe = uring_sqe(u, IORING_OP_CONNECT, uring_tag(s, UOP_CONNECT));
+    sqe->fd = s->backend_slot;
+    sqe->flags = IOSQE_FIXED_FILE | IOSQE_IO_LINK;
+    sqe->addr = (uint64_t)(uintptr_t)&s->backend_node->addr.sa;
+    sqe->off = address_len(&s->backend_node->addr);
+    u->connect_timeout.tv_sec = w->config->connect_timeout / 1000;
+    u->connect_timeout.tv_nsec = (w->config->connect_timeout % 1000) * 1000000L;
+    sqe = uring_sqe(u, IORING_OP_LINK_TIMEOUT, uring_tag(s, UOP_TIMEOUT));
+    sqe->addr = (uint64_t)(uintptr_t)&u->connect_timeout;
+    sqe->len = 1;
+    s->inflight += 2;
+    return 0;
+}
+
+// Give a new session its fixed file slots and start reading the client
+// while the backend connect is in progress. Returns -1 when the worker
+// has no slots left.
+int uring_start(struct worker *w, struct session *s) {
+    struct uring *u = w->uring;
+
+    s->client_slot = s->backend_slot = -1;
+    if (u->free_slot_count < 2) {
+        return -1;
+    }
+    s->client_slot = u->free_slots[--u->free_slot_count];
+    s->backend_slot = u->free_slots[--u->free_slot_count];
+
+    uring_reserve(u, 2);
+    uring_install(u, s, &s->client.fd, s->client_slot);
+    uring_recv(w, s, 1);
+    return 0;
+}
+
+// Start the idle check of a session whose backend is connected
+void session_arm_idle(struct worker *w, struct session *s) {
+    s->last_active = w->now;
+    if (w->config->idle_timeout > 0) {
+        timer_schedule(w, &s->timer, w->now + w->config->idle_timeout);
+    } else {
+        timer_cancel(w, &s->timer);
+    }
+}
+
+// Give the session a backend connection for s->backend_node, from the
+// pool or with a non-blocking connect that has a deadline. Returns -1
+// when the connect failed right away.
+int session_connect(struct worker *w, struct session *s) {
+    int one = 1;
+
+    s->tried |= 1ull << s->backend_node->id;
+
+    // Pair the client with an already established backend connection
+    s->backend.fd = pool_take(w, s->backend_node);
+    if (s->backend.fd >= 0) {
+        // Still registered by the pool: force a MOD so epoll points at the session
+        s->backend.registered = 1;
+        s->backend.events = ~0u;
+        s->connected = 1;
+        stat_add(&w->stats.pool_hits, 1);
+        session_arm_idle(w, s);
+        log_message(LOG_DEBUG, "Connected to backend: %s (pooled)", s->backend_node->host);
+        return 0;
+    }
+    if (w->config->pool_max > 0) {
+        stat_add(&w->stats.pool_misses, 1);
+    }
+
+    // Connect to the backend server
+    s->backend.fd = socket(s->backend_node->addr.sa.sa_family,
+                           SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (s->backend.fd == -1) {
+        log_message(LOG_ERROR, "Backend socket creation failed");
+        return -1;
+    }
+    setsockopt(s->backend.fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    s->connect_start = monotonic_us();
+    if (connect(s->backend.fd, &s->backend_node->addr.sa, address_len(&s->backend_node->addr)) < 0 &&
+        errno != EINPROGRESS) {
+        return -1;
+    }
+    timer_schedule(w, &s->timer, w->now + w->config->connect_timeout);
+    return 0;
+}
+
+// A session may move to another backend as long as the client cannot
+// tell: nothing was forwarded in either direction yet.
+int session_can_retry(struct worker *w, struct session *s) {
+    return !s->up.moved && !s->up.shut && !s->down.moved && s->down.len == 0 &&
+           !s->down.eof && s->retries < w->config->connect_retries &&
+           s->config == w->config;
+}
+
+// The next healthy backend after the current one that this session has
+// not tried yet
+struct backend *next_backend(struct worker *w, struct session *s) {
+    struct healthy_view *view = w->view;
+    int start = 0;
+
+    for (int i = 0; i < view->count; i++) {
+        if (view->backends[i] == s->backend_node) {
+            start = i + 1;
+            break;
+        }
+    }
+    for (int i = 0; i < view->count; i++) {
+        struct backend *b = view->backends[(start + i) % view->count];
+        if (!(s->tried & (1ull << b->id))) {
+            return b;
+        }
+    }
+    return NULL;
+}
+
+// The backend of a session failed: connect to the next healthy backend
+// while that is still transparent to the client, otherwise close
+void session_failover(struct worker *w, struct session *s) {
+    record_connect_failure(w, s->backend_node);
+
+    while (session_can_retry(w, s)) {
+        struct backend *next = next_backend(w, s);
+        if (!next) {
+            break;
+        }
+        log_message(LOG_WARN, "Backend %s failed, retrying on %s",
+                    s->backend_node->host, next->host);
+
+        // Closing the descriptor also removes it from the epoll set. On
+        // io_uring the fixed file slot is simply overwritten.
+        if (s->backend.fd >= 0) {
+            close(s->backend.fd);
+        }
+        s->backend.fd = -1;
+        s->backend.registered = 0;
+        s->backend.events = 0;
+        s->connected = 0;
+        atomic_fetch_sub_explicit(&s->backend_node->active, 1, memory_order_relaxed);
+        atomic_fetch_add_explicit(&next->active, 1, memory_order_relaxed);
+        stat_add(&w->stats.backends[next->stat_slot].selected, 1);
+        stat_add(&w->stats.retries, 1);
+        s->backend_node = next;
+        s->retries++;
+
+        if ((w->uring ? uring_connect(w, s) : session_connect(w, s)) < 0) {
+            record_connect_failure(w, s->backend_node);
+            continue;
+        }
+        if (!w->uring && session_update(w, s) < 0) {
+            log_message(LOG_ERROR, "Failed to register session");
+            break;
+        }
+        return;
+    }
+
+    log_message(LOG_WARN, "Connection to backend %s failed", s->backend_node->host);
+    close_session(w, s);
+}
+
+// Connect deadline or idle check of a session
+void session_timeout(struct worker *w, struct session *s) {
+    if (!s->connected) {
+        stat_add(&w->stats.connect_timeouts, 1);
+        log_message(LOG_WARN, "Connection to backend %s timed out", s->backend_node->host);
+        session_failover(w, s);
+        return;
+    }
+
+    if (w->config->idle_timeout <= 0) {
+        return;
+    }
+    long idle_until = s->last_active + w->config->idle_timeout;
+    if (idle_until <= w->now) {
+        stat_add(&w->stats.idle_timeouts, 1);
+        log_message(LOG_DEBUG, "Closing idle connection to %s", s->backend_node->host);
+        close_session(w, s);
+        return;
+    }
+    // Traffic since the timer was set: check again when it could expire
+    timer_schedule(w, &s->timer, idle_until);
+}
+
+// Fire the timers of every tick that has fully passed
+void timers_run(struct worker *w) {
+    long tick = w->now / TIMER_TICK - 1;
+    struct timer due;
+
+    if (w->timers == 0 || tick - w->wheel_tick > WHEEL_SLOTS) {
+        // Nothing can be pending in the slots that are skipped over, or
+        // a single lap visits all of them
+        if (w->timers == 0) {
+            w->wheel_tick = tick;
+            return;
+        }
+        w->wheel_tick = tick - WHEEL_SLOTS;
+    }
+
+    while (w->wheel_tick < tick) {
+        w->wheel_tick++;
+        struct timer *head = &w->wheel[w->wheel_tick % WHEEL_SLOTS];
+
+        // Collect first: callbacks schedule new timers, never into this slot
+        due.prev = due.next = &due;
+        for (struct timer *t = head->next, *next; t != head; t = next) {
+            next = t->next;
+            if (t->expires <= w->now) {
+                t->prev->next = t->next;
+                t->next->prev = t->prev;
+                t->prev = due.prev;
+                t->next = &due;
+                due.prev->next = t;
+                due.prev = t;
+            }
+        }
+        while (due.next != &due) {
+            struct timer *t = due.next;
+            timer_cancel(w, t);
+            session_timeout(w, (struct session *)((char *)t - offsetof(struct session, timer)));
+        }
+    }
+}
+
+// Complete a non-blocking connect to the backend. Returns 1 when the
+// connect is still in progress: the event was meant for a descriptor that
+// a failover in the same batch has replaced.
+int backend_connected(struct worker *w, struct session *s) {
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if (getsockopt(s->backend.fd, SOL_SOCKET, SO_ERROR, &err, &len) < 0 || err != 0) {
+        return -1;
+    }
+    union address peer;
+    len = sizeof(peer);
+    if (getpeername(s->backend.fd, &peer.sa, &len) < 0) {
+        return errno == ENOTCONN ? 1 : -1;
+    }
+    s->connected = 1;
+    record_connect(w, s->backend_node, s->connect_start);
+    session_arm_idle(w, s);
+
+    log_message(LOG_DEBUG, "Connected to backend: %s", s->backend_node->host);
+    return 0;
+}
+
+// Event handler for both sockets of a client session
+void handle_client(struct worker *w, struct endpoint *ep, uint32_t events) {
+    struct session *s = ep->session;
+
+    if (s->closed) {
+        return;
+    }
+    s->last_active = w->now;
+
+    if (ep->kind == EP_BACKEND && !s->connected) {
+        int rc = backend_connected(w, s);
+        if (rc > 0) {
+            return;
+        }
+        // Deliver whatever the client sent while we were connecting
+        if (rc < 0 || relay_flush(w, &s->up, s->backend.fd) < 0) {
+            session_failover(w, s);
+            return;
+        }
+    } else if (events & EPOLLERR) {
+        if (ep->kind == EP_BACKEND) {
+            session_failover(w, s);
+        } else {
+            close_session(w, s);
+        }
+        return;
+    }
+
+    if (events & EPOLLOUT) {
+        struct relay *r = (ep->kind == EP_CLIENT) ? &s->down : &s->up;
+        if (relay_flush(w, r, ep->fd) < 0) {
+            if (ep->kind == EP_BACKEND) {
+                session_failover(w, s);
+            } else {
+                close_session(w, s);
+            }
+            return;
+        }
+    }
+
+    if (events & (EPOLLIN | EPOLLHUP)) {
+        struct relay *r = (ep->kind == EP_CLIENT) ? &s->up : &s->down;
+        struct endpoint *peer = (ep->kind == EP_CLIENT) ? &s->backend : &s->client;
+
+        if (r->len == 0 && !r->eof) {
+            if (relay_fill(w, r, ep->fd) < 0) {
+                if (ep->kind == EP_BACKEND) {
+                    session_failover(w, s);
+                } else {
+                    close_session(w, s);
+                }
+                return;
+            }
+            struct backend_stats *bs = &w->stats.backends[s->backend_node->stat_slot];
+            stat_add((ep->kind == EP_CLIENT) ? &bs->bytes_sent : &bs->bytes_received, r->len);
+        }
+        // Forward right away; EPOLLOUT on the peer takes over if it is full
+        if (peer->kind == EP_CLIENT || s->connected) {
+            if (relay_flush(w, r, peer->fd) < 0) {
+                if (peer->kind == EP_BACKEND) {
+                    session_failover(w, s);
+                } else {
+                    close_session(w, s);
+                }
+                return;
+            }
+        }
+    }
+
+    // Both directions have delivered their FIN
+    if (s->up.shut && s->down.shut) {
+        close_session(w, s);
+        return;
+    }
+
+    if (session_update(w, s) < 0) {
+        close_session(w, s);
+    }
+}
+
+// Set up a session for an accepted client and start the backend connect
+void start_session(struct worker *w, int client_socket, const union address *client_addr) {
+    int one = 1;
+
+    struct session *s = calloc(1, sizeof(*s));
+    if (!s) {
+        log_message(LOG_ERROR, "Session allocation failed");
+        close(client_socket);
+        return;
+    }
+    s->client.fd = client_socket;
+    s->client.kind = EP_CLIENT;
+    s->client.session = s;
+    s->backend.kind = EP_BACKEND;
+    s->backend.session = s;
+    relay_init(&s->up);
+    relay_init(&s->down);
+    config_get(w->config);
+    s->config = w->config;
+    w->sessions++;
+    atomic_fetch_add_explicit(&sessions_open, 1, memory_order_relaxed);
+    setsockopt(client_socket, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    if (w->config->proxy_protocol != PROXY_OFF) {
+        union address local;
+        socklen_t len = sizeof(local);
+        if (getsockname(client_socket, &local.sa, &len) == 0) {
+            s->up.prefix = s->proxy_header;
+            s->up.prefix_len = proxy_header_build(s->proxy_header, w->config->proxy_protocol,
+                                                  client_addr, &local);
+        }
+    }
+
+    s->backend_node = select_backend(w, client_addr);
+    if (w->uring) {
+        if (uring_start(w, s) < 0) {
+            log_message(LOG_ERROR, "No io_uring file slots left");
+            close_session(w, s);
+        } else if (uring_connect(w, s) < 0) {
+            session_failover(w, s);
+        }
+        return;
+    }
+    if (session_connect(w, s) < 0) {
+        session_failover(w, s);
+        return;
+    }
+
+    if (session_update(w, s) < 0) {
+        log_message(LOG_ERROR, "Failed to register session");
+        close_session(w, s);
+    }
+}
+
+// Identity a client is rate limited under: the IPv4 address, or the /64
+// an IPv6 client can pick addresses from
+uint64_t client_key(const union address *addr) {
+    uint64_t key;
+
+    if (addr->sa.sa_family == AF_INET6) {
+        memcpy(&key, &addr->in6.sin6_addr, sizeof(key));
+    } else {
+        // Above the 32 address bits: a prefix no IPv6 client comes from
+        key = 0xffffffff00000000ull | ntohl(addr->in.sin_addr.s_addr);
+    }
+    return key ? key : 1;
+}
+
+// Take one token from the client's bucket. Rejections do not write, so a
+// flooding client does not bounce the cache line between workers.
+int rate_limit_allow(const union address *client, long now, int rate, int burst) {
+    uint64_t key = client_key(client);
+    struct rate_shard *shard = &rate_table[hash32((uint32_t)(key ^ (key >> 32))) % RATE_SHARDS];
+    const uint64_t fill_mask = (1ull << RATE_TOKEN_BITS) - 1;
+    const uint64_t full = (uint64_t)burst * RATE_TOKEN;
+    struct rate_entry *e = NULL, *oldest = &shard->entries[0];
+    uint64_t oldest_time = UINT64_MAX;
+
+    for (int i = 0; i < RATE_WAYS; i++) {
+        struct rate_entry *candidate = &shard->entries[i];
+        if (atomic_load_explicit(&candidate->key, memory_order_acquire) == key) {
+            e = candidate;
+            break;
+        }
+        uint64_t time = atomic_load_explicit(&candidate->state, memory_order_relaxed) >> RATE_TOKEN_BITS;
+        if (time < oldest_time) {
+            oldest_time = time;
+            oldest = candidate;
+        }
+    }
+    if (!e) {
+        // A new client starts with a full bucket. Two workers claiming the
+        // same entry at once only lets a few extra connections through.
+        e = oldest;
+        atomic_store_explicit(&e->state, ((uint64_t)now << RATE_TOKEN_BITS) | full,
+                              memory_order_relaxed);
+        atomic_store_explicit(&e->key, key, memory_order_release);
+    }
+
+    uint64_t state = atomic_load_explicit(&e->state, memory_order_relaxed);
+    uint64_t next;
+    do {
+        long last = (long)(state >> RATE_TOKEN_BITS);
+        uint64_t fill = state & fill_mask;
+        if (now > last) {
+            // rate tokens per second are rate milli-tokens per millisecond
+            uint64_t refill = (uint64_t)(now - last) * rate;
+            fill = (fill + refill > full) ? full : fill + refill;
+        }
+        if (fill < RATE_TOKEN) {
+            return 0;
+        }
+        next = ((uint64_t)(now > last ? now : last) << RATE_TOKEN_BITS) | (fill - RATE_TOKEN);
+    } while (!atomic_compare_exchange_weak_explicit(&e->state, &state, next,
+                                                    memory_order_relaxed, memory_order_relaxed));
+    return 1;
+}
+
+// Decide right after accept whether a client gets a session. Checks are
+// ordered from cheapest to most expensive.
+int admit_client(struct worker *w, const union address *client) {
+    struct lb_config *cfg = w->config;
+
+    if (cfg->overload_latency > 0 && w->busy >= cfg->overload_latency) {
+        stat_add(&w->stats.rejected_overload, 1);
+        return 0;
+    }
+    if (atomic_load_explicit(&sessions_open, memory_order_relaxed) >= cfg->max_sessions) {
+        stat_add(&w->stats.rejected_limit, 1);
+        return 0;
+    }
+    if (cfg->client_rate > 0 && !rate_limit_allow(client, w->now, cfg->client_rate, cfg->client_burst)) {
+        stat_add(&w->stats.rejected_rate, 1);
+        return 0;
+    }
+    return 1;
+}
+
+// Reset instead of a graceful close: no FIN handshake and no TIME_WAIT
+// state is spent on a client that is turned away
+void reject_client(int fd) {
+    struct linger reset = {1, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_LINGER, &reset, sizeof(reset));
+    close(fd);
+}
+
+// Accept every pending connection on one of the worker's listeners
+void accept_clients(struct worker *w, struct endpoint *listener) {
+    union address client_addr;
+    socklen_t addr_len;
+
+    while (w->accepting) {
+        addr_len = sizeof(client_addr);
+        int client_socket = accept4(listener->fd, &client_addr.sa, &addr_len,
+                                    SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (client_socket < 0) {
+            if (errno == EINTR || errno == ECONNABORTED) {
+                continue;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK) {
+                log_message(LOG_ERROR, "Accept failed");
+            }
+            return;
+        }
+
+        if (!admit_client(w, &client_addr)) {
+            reject_client(client_socket);
+            continue;
+        }
+        stat_add(&w->stats.accepted, 1);
+        log_message(LOG_DEBUG, "New connection accepted");
+        start_session(w, client_socket, &client_addr);
+    }
+}
+
+void uring_connected(struct worker *w, struct session *s, int res) {
+    if (res < 0) {
+        // Cancelled by the linked timeout
+        if (res == -ECANCELED) {
+            stat_add(&w->stats.connect_timeouts, 1);
+            log_message(LOG_WARN, "Connection to backend %s timed out", s->backend_node->host);
+        }
+        session_failover(w, s);
+        return;
+    }
+    s->connected = 1;
+    record_connect(w, s->backend_node, s->connect_start);
+    session_arm_idle(w, s);
+    log_message(LOG_DEBUG, "Connected to backend: %s", s->backend_node->host);
+
+    uring_forward(w, s, 1);
+    uring_forward(w, s, 0);
+}
+
+void uring_received(struct worker *w, struct session *s, int upstream, int res, uint32_t flags) {
+    struct relay *r = upstream ? &s->up : &s->down;
+
+    r->busy = 0;
+    if (flags & IORING_CQE_F_BUFFER) {
+        int bid = flags >> IORING_CQE_BUFFER_SHIFT;
+        w->uring->buf_free--;
+        if (s->closed || res <= 0) {
+            uring_buffer_put(w, bid);
+        } else {
+            r->bid = bid;
+            r->buf = w->uring->buffers + (size_t)bid * w->uring->buf_size;
+            r->off = 0;
+            r->len = res;
+            struct backend_stats *bs = &w->stats.backends[s->backend_node->stat_slot];
+            stat_add(upstream ? &bs->bytes_sent : &bs->bytes_received, res);
+        }
+    }
+    if (s->closed) {
+        return;
+    }
+
+    if (res == -ENOBUFS) {
+        // Every provided buffer was in use: wait for one to come back,
+        // unless that already happened while this completion was queued
+        if (w->uring->buf_free > 0) {
+            uring_forward(w, s, upstream);
+            return;
+        }
+        if (!s->starved) {
+            s->next_starved = w->uring->starved;
+            w->uring->starved = s;
+        }
+        s->starved |= upstream ? 1 : 2;
+        return;
+    }
+    // Only failed connects move to another backend: once the backend
+    // socket has operations of its own, their completions could not be
+    // told apart from those of a replacement
+    if (res < 0) {
+        close_session(w, s);
+        return;
+    }
+    if (res == 0) {
+        r->eof = 1;
+    }
+    uring_forward(w, s, upstream);
+}
+
+void uring_sent(struct worker *w, struct session *s, int upstream, int res) {
+    struct relay *r = upstream ? &s->up : &s->down;
+
+    r->busy = 0;
+    if (s->closed) {
+        return;
+    }
+    if (res < 0) {
+        close_session(w, s);
+        return;
+    }
+
+    size_t n = relay_consume_prefix(r, res);
+    r->off += n;
+    r->len -= n;
+    r->moved = 1;
+    if (r->len == 0 && r->buf) {
+        uring_buffer_put(w, r->bid);
+        r->buf = NULL;
+    }
+    uring_forward(w, s, upstream);
+}
+
+// Buffers are back: let the sessions that ran out receive again
+void uring_resume_starved(struct worker *w) {
+    struct uring *u = w->uring;
+
+    while (u->starved && u->buf_free > 0) {
+        struct session *s = u->starved;
+        u->starved = s->next_starved;
+        int directions = s->starved;
+        s->starved = 0;
+        for (int up = 1; up >= 0; up--) {
+            if (directions & (up ? 1 : 2)) {
+                uring_forward(w, s, up);
+            }
+        }
+    }
+}
+
+void uring_arm_accept(struct worker *w, int listener) {
+    struct io_uring_sqe *sqe = uring_sqe(w->uring, IORING_OP_ACCEPT,
+                                         ((uint64_t)listener << 4) | UOP_ACCEPT);
+    sqe->fd = w->listeners[listener].fd;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_NONBLOCK | SOCK_CLOEXEC;
+}
+
+void uring_arm_wake(struct worker *w) {
+    struct io_uring_sqe *sqe = uring_sqe(w->uring, IORING_OP_READ, UOP_WAKE);
+    sqe->fd = w->wake.fd;
+    sqe->addr = (uint64_t)(uintptr_t)&w->uring->wake_value;
+    sqe->len = sizeof(w->uring->wake_value);
+}
+
+void uring_stop_accepting(struct worker *w) {
+    for (int i = 0; i < w->listener_count; i++) {
+        struct io_uring_sqe *sqe = uring_sqe(w->uring, IORING_OP_ASYNC_CANCEL, UOP_IGNORE);
+        sqe->addr = ((uint64_t)i << 4) | UOP_ACCEPT;
+    }
+}
+
+void uring_accepted(struct worker *w, int fd) {
+    union address client_addr;
+    socklen_t addr_len = sizeof(client_addr);
+
+    // Multishot accept does not report the peer, ask for it
+    if (getpeername(fd, &client_addr.sa, &addr_len) < 0) {
+        close(fd);
+        return;
+    }
+    if (!admit_client(w, &client_addr)) {
+        reject_client(fd);
+        return;
+    }
+    stat_add(&w->stats.accepted, 1);
+    log_message(LOG_DEBUG, "New connection accepted");
+    start_session(w, fd, &client_addr);
+}
+
+// Dispatch every completion the kernel has posted
+void uring_reap(struct worker *w) {
+    struct uring *u = w->uring;
+    unsigned head = *u->cq_head;
+
+    while (head != atomic_load_explicit(u->cq_tail, memory_order_acquire)) {
+        struct io_uring_cqe *cqe = &u->cqes[head & u->cq_mask];
+        uint64_t data = cqe->user_data;
+        int res = cqe->res;
+        uint32_t flags = cqe->flags;
+        atomic_store_explicit(u->cq_head, ++head, memory_order_release);
+
+        enum uring_op op = data & 15;
+        if (op == UOP_ACCEPT) {
+            // A multishot accept ends on errors and cancellation
+            if (!(flags & IORING_CQE_F_MORE) && w->accepting) {
+                uring_arm_accept(w, data >> 4);
+            }
+            if (res >= 0) {
+                uring_accepted(w, res);
+            } else if (res != -ECANCELED) {
+                log_message(LOG_ERROR, "Accept failed: %s", strerror(-res));
+            }
+            continue;
+        } else if (op == UOP_WAKE) {
+            uring_arm_wake(w);
+            continue;
+        } else if (op == UOP_SLOT) {
+            u->free_slots[u->free_slot_count++] = data >> 4;
+            continue;
+        } else if (op == UOP_IGNORE) {
+            continue;
+        }
+
+        struct session *s = (struct session *)(uintptr_t)(data & ~(uint64_t)15);
+        s->inflight--;
+        s->last_active = w->now;
+        switch (op) {
+            case UOP_CONNECT:
+                if (!s->closed) {
+                    uring_connected(w, s, res);
+                }
+                break;
+            case UOP_RECV_UP:
+            case UOP_RECV_DOWN:
+                uring_received(w, s, op == UOP_RECV_UP, res, flags);
+                break;
+            case UOP_SEND_UP:
+            case UOP_SEND_DOWN:
+                uring_sent(w, s, op == UOP_SEND_UP, res);
+                break;
+            default:
+                break;
+        }
+        if (s->closed && s->inflight == 0) {
+            uring_release_session(w, s);
+        }
+    }
+    uring_resume_starved(w);
+}
+
+void uring_destroy(struct uring *u) {
+    if (u->ring && u->ring != MAP_FAILED) {
+        munmap(u->ring, u->ring_size);
+    }
+    if (u->sqes && u->sqes != MAP_FAILED) {
+        munmap(u->sqes, u->sq_entries * sizeof(struct io_uring_sqe));
+    }
+    if (u->buf_ring && u->buf_ring != MAP_FAILED) {
+        munmap(u->buf_ring, URING_BUFFERS * sizeof(struct io_uring_buf));
+    }
+    if (u->buffers && u->buffers != MAP_FAILED) {
+        munmap(u->buffers, (size_t)URING_BUFFERS * u->buf_size);
+    }
+    if (u->fd >= 0) {
+        close(u->fd);
+    }
+    free(u->free_slots);
+    free(u);
+}
+
+// Map the submission and completion rings of a new io_uring instance
+int uring_map(struct uring *u, const struct io_uring_params *p) {
+    size_t sq_size = p->sq_off.array + p->sq_entries * sizeof(unsigned);
+    size_t cq_size = p->cq_off.cqes + p->cq_entries * sizeof(struct io_uring_cqe);
+
+    // Kernels without these would need a different setup
+    if (!(p->features & IORING_FEAT_SINGLE_MMAP) || !(p->features & IORING_FEAT_EXT_ARG) ||
+        !(p->features & IORING_FEAT_NODROP)) {
+        errno = EOPNOTSUPP;
+        return -1;
+    }
+    u->sq_entries = p->sq_entries;
+    u->ring_size = sq_size > cq_size ? sq_size : cq_size;
+    u->ring = mmap(NULL, u->ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                   u->fd, IORING_OFF_SQ_RING);
+    u->sqes = mmap(NULL, p->sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                   MAP_SHARED | MAP_POPULATE, u->fd, IORING_OFF_SQES);
+    if (u->ring == MAP_FAILED || u->sqes == MAP_FAILED) {
+        return -1;
+    }
+    char *ring = u->ring;
+    u->sq_head = (_Atomic unsigned *)(ring + p->sq_off.head);
+    u->sq_tail = (_Atomic unsigned *)(ring + p->sq_off.tail);
+    u->sq_mask = *(unsigned *)(ring + p->sq_off.ring_mask);
+    u->sq_array = (unsigned *)(ring + p->sq_off.array);
+    u->cq_head = (_Atomic unsigned *)(ring + p->cq_off.head);
+    u->cq_tail = (_Atomic unsigned *)(ring + p->cq_off.tail);
+    u->cq_mask = *(unsigned *)(ring + p->cq_off.ring_mask);
+    u->cqes = (struct io_uring_cqe *)(ring + p->cq_off.cqes);
+    u->sq_local = u->sq_submitted = atomic_load(u->sq_tail);
+    return 0;
+}
+
+// Register a sparse fixed file table, two slots per session
+int uring_register_files(struct uring *u) {
+    struct io_uring_rsrc_register files;
+    struct rlimit rl;
+    int slots = URING_FILES;
+
+    // The kernel refuses tables larger than the descriptor limit
+    if (getrlimit(RLIMIT_NOFILE, &rl) == 0 && rl.rlim_cur < (rlim_t)slots) {
+        slots = rl.rlim_cur;
+    }
+    u->free_slots = malloc(slots * sizeof(int));
+    if (!u->free_slots) {
+        return -1;
+    }
+    memset(&files, 0, sizeof(files));
+    files.nr = slots;
+    files.flags = IORING_RSRC_REGISTER_SPARSE;
+    if (uring_register(u->fd, IORING_REGISTER_FILES2, &files, sizeof(files)) < 0) {
+        return -1;
+    }
+    for (int i = slots - 1; i >= 0; i--) {
+        u->free_slots[u->free_slot_count++] = i;
+    }
+    return 0;
+}
+
+// Register the provided buffer ring. Receives pick a buffer only once
+// data has arrived, so idle sessions hold none.
+int uring_register_buffers(struct uring *u, size_t buf_size) {
+    struct io_uring_buf_reg reg;
+
+    u->buf_size = buf_size;
+    u->buf_ring = mmap(NULL, URING_BUFFERS * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    u->buffers = mmap(NULL, (size_t)URING_BUFFERS * buf_size, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (u->buf_ring == MAP_FAILED || u->buffers == MAP_FAILED) {
+        return -1;
+    }
+    memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = (uint64_t)(uintptr_t)u->buf_ring;
+    reg.ring_entries = URING_BUFFERS;
+    reg.bgid = URING_BUFFER_GROUP;
+    return uring_register(u->fd, IORING_REGISTER_PBUF_RING, &reg, 1) < 0 ? -1 : 0;
+}
+
+// Move the worker onto io_uring. Runs on the worker thread, which is the
+// ring's only submitter. Returns -1 when the kernel lacks a feature the
+// engine needs; the worker then stays on epoll.
+int uring_init(struct worker *w, const struct lb_config *cfg) {
+    struct io_uring_params p;
+    struct uring *u = calloc(1, sizeof(*u));
+
+    if (!u) {
+        return -1;
+    }
+    // Completion work only runs while this thread waits for it, instead
+    // of interrupting it whenever a packet arrives
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE | IORING_SETUP_SUBMIT_ALL |
+              IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN;
+    p.cq_entries = URING_ENTRIES * 4;
+    u->fd = uring_setup(URING_ENTRIES, &p);
+    if (u->fd < 0 && errno == EINVAL) {
+        memset(&p, 0, sizeof(p));
+        p.flags = IORING_SETUP_CQSIZE;
+        p.cq_entries = URING_ENTRIES * 4;
+        u->fd = uring_setup(URING_ENTRIES, &p);
+    }
+    if (u->fd < 0 || uring_map(u, &p) < 0 || uring_register_files(u) < 0 ||
+        uring_register_buffers(u, cfg->buffer_size) < 0) {
+        log_message(LOG_WARN, "Worker %d: io_uring unavailable (%s), using epoll", w->id, strerror(errno));
+        uring_destroy(u);
+        return -1;
+    }
+
+    w->uring = u;
+    for (int i = 0; i < URING_BUFFERS; i++) {
+        uring_buffer_put(w, i);
+    }
+    for (int i = 0; i < w->listener_count; i++) {
+        uring_arm_accept(w, i);
+    }
+    uring_arm_wake(w);
+    return 0;
+}
+
+// A new binary owns the listening sockets now: stop accepting and let
+// the sessions of this process run to completion
+void worker_stop_accepting(struct worker *w) {
+    w->accepting = 0;
+    if (w->uring) {
+        uring_stop_accepting(w);
+    }
+    for (int i = 0; i < w->listener_count; i++) {
+        epoll_ctl(w->epfd, EPOLL_CTL_DEL, w->listeners[i].fd, NULL);
+    }
+    pool_drain(w);
+}
+
+void *worker_loop(void *arg) {
+    struct worker *w = arg;
+    struct epoll_event events[MAX_EVENTS];
+    int n = 0;
+
+    w->now = monotonic_ms();
+    w->wheel_tick = w->now / TIMER_TICK - 1;
+    rcu_online(w);
+    w->view = atomic_load_explicit(&healthy_view, memory_order_acquire);
+    if (w->view->config->engine == ENGINE_IO_URING) {
+        uring_init(w, w->view->config);
+    }
+    while (1) {
+        // The view stays valid until this worker goes offline again
+        w->view = atomic_load_explicit(&healthy_view, memory_order_acquire);
+        if (w->view->config != w->config) {
+            worker_adopt_config(w, w->view->config);
+        }
+
+        if (w->uring) {
+            uring_reap(w);
+        }
+        for (int i = 0; i < n; i++) {
+            struct endpoint *ep = events[i].data.ptr;
+            if (ep->kind == EP_LISTENER) {
+                accept_clients(w, ep);
+            } else if (ep->kind == EP_POOL) {
+                pool_event(w, (struct pooled_conn *)ep, events[i].events);
+            } else if (ep->kind == EP_WAKE) {
+                uint64_t value;
+                read(w->wake.fd, &value, sizeof(value));
+            } else {
+                handle_client(w, ep, events[i].events);
+            }
+        }
+        timers_run(w);
+        release_closed_sessions(w);
+        if (w->config->overload_latency > 0) {
+            w->busy = monotonic_ms() - w->now;
+        }
+
+        if (atomic_load(&draining)) {
+            if (w->accepting) {
+                worker_stop_accepting(w);
+            }
+            if (w->sessions == 0) {
+                break;
+            }
+        }
+
+        int timeout = -1;
+        if (w->accepting && w->config->pool_max > 0 && !w->uring) {
+            long now = monotonic_ms();
+            if (now >= w->next_maintenance) {
+                pool_maintain(w);
+            }
+            timeout = w->next_maintenance - now;
+        }
+        if (w->timers > 0 && (timeout < 0 || timeout > TIMER_TICK)) {
+            timeout = TIMER_TICK;
+        }
+
+        rcu_offline(w);
+        if (w->uring) {
+            // Submits everything the batch queued, then waits
+            n = uring_enter(w->uring, 1, timeout);
+            if (n < 0 && (errno == ETIME || errno == EBUSY)) {
+                n = 0;
+            }
+        } else {
+            n = epoll_wait(w->epfd, events, MAX_EVENTS, timeout);
+        }
+        rcu_online(w);
+        w->now = monotonic_ms();
+        if (n < 0) {
+            if (errno == EINTR) {
+                n = 0;
+                continue;
+            }
+            log_message(LOG_ERROR, "%s failed", w->uring ? "io_uring_enter" : "epoll_wait");
+            break;
+        }
+    }
+
+    release_closed_sessions(w);
+    if (w->uring) {
+        // Closing the ring also withdraws its accepts from the shared
+        // listeners, which would otherwise keep taking their wakeups
+        uring_destroy(w->uring);
+        w->uring = NULL;
+    }
+    rcu_offline(w);
+    atomic_fetch_sub(&workers_running, 1);
+    return NULL;
+}
+
+// Create a non-blocking listening socket bound to addr
+int create_listener(const union address *addr, int backlog, int reuseport) {
+    int one = 1;
+
+    int lb_socket = socket(addr->sa.sa_family, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (lb_socket == -1) {
+        log_message(LOG_ERROR, "Socket creation failed");
+        return -1;
+    }
+    setsockopt(lb_socket, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    // [::] only takes IPv6 clients, so it can sit next to a 0.0.0.0 listener
+    if (addr->sa.sa_family == AF_INET6) {
+        setsockopt(lb_socket, IPPROTO_IPV6, IPV6_V6ONLY, &one, sizeof(one));
+    }
+    if (reuseport && setsockopt(lb_socket, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one)) < 0) {
+        close(lb_socket);
+        return -1;
+    }
+
+    // Bind the load balancer socket to port 7070
+    if (bind(lb_socket, &addr->sa, address_len(addr)) < 0) {
+        log_message(LOG_ERROR, "Bind failed");
+        close(lb_socket);
+        return -1;
+    }
+
+    // Listen for incoming connections
+    if (listen(lb_socket, backlog) < 0) {
+        log_message(LOG_ERROR, "Listen failed");
+        close(lb_socket);
+        return -1;
+    }
+    return lb_socket;
+}
+
+int add_listener(struct worker *w, int fd, int exclusive) {
+    struct endpoint *grown = realloc(w->listeners, (w->listener_count + 1) * sizeof(*grown));
+    if (!grown) {
+        return -1;
+    }
+    w->listeners = grown;
+    struct endpoint *ep = &w->listeners[w->listener_count++];
+    memset(ep, 0, sizeof(*ep));
+    ep->fd = fd;
+    ep->kind = EP_LISTENER;
+    return endpoint_watch(w, ep, EPOLLIN | (exclusive ? EPOLLEXCLUSIVE : 0));
+}
+
+// Listening sockets handed over by the process we are replacing
+int inherited_fds[MAX_WORKERS * MAX_LISTENERS];
+int inherited_count = 0;
+
+void parse_inherited_fds() {
+    const char *env = getenv("LB_LISTEN_FDS");
+
+    while (env && *env && inherited_count < MAX_WORKERS * MAX_LISTENERS) {
+        char *end;
+        int fd = strtol(env, &end, 10);
+        if (end == env) {
+            break;
+        }
+        fcntl(fd, F_SETFD, FD_CLOEXEC);
+        inherited_fds[inherited_count++] = fd;
+        env = (*end == ',') ? end + 1 : end;
+    }
+    unsetenv("LB_LISTEN_FDS");
+}
+
+int listener_matches(int fd, const union address *addr) {
+    union address bound;
+    socklen_t len = sizeof(bound);
+
+    return getsockname(fd, &bound.sa, &len) == 0 && address_equal(&bound, addr);
+}
+
+// Take an inherited listener bound to addr, or -1
+int take_inherited(const union address *addr) {
+    for (int i = 0; i < inherited_count; i++) {
+        if (inherited_fds[i] >= 0 && listener_matches(inherited_fds[i], addr)) {
+            int fd = inherited_fds[i];
+            inherited_fds[i] = -1;
+            return fd;
+        }
+    }
+    return -1;
+}
+
+int start_workers(struct lb_config *cfg) {
+    int shared_fd[MAX_LISTENERS];
+    int ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+
+    for (int l = 0; l < cfg->listen_count; l++) {
+        shared_fd[l] = -1;
+    }
+
+    for (int i = 0; i < cfg->workers; i++) {
+        struct worker *w = &workers[i];
+
+        w->id = i;
+        w->accepting = 1;
+        w->rr_next = i;
+        w->rng = 0x9e3779b97f4a7c15ull * (i + 1);
+        for (int t = 0; t < WHEEL_SLOTS; t++) {
+            w->wheel[t].prev = w->wheel[t].next = &w->wheel[t];
+        }
+        w->epfd = epoll_create1(EPOLL_CLOEXEC);
+        if (w->epfd < 0) {
+            log_message(LOG_ERROR, "epoll_create1 failed");
+            return -1;
+        }
+        w->wake.kind = EP_WAKE;
+        w->wake.fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if (w->wake.fd < 0 || endpoint_watch(w, &w->wake, EPOLLIN) < 0) {
+            log_message(LOG_ERROR, "Failed to create wakeup eventfd");
+            return -1;
+        }
+
+        // One SO_REUSEPORT listener per worker lets the kernel spread
+        // accepts; without it every worker shares one listener and
+        // EPOLLEXCLUSIVE avoids waking all of them per connection.
+        for (int l = 0; l < cfg->listen_count; l++) {
+            int fd = -1, exclusive = 0;
+            if (shared_fd[l] < 0) {
+                fd = take_inherited(&cfg->listen[l]);
+                if (fd < 0) {
+                    fd = create_listener(&cfg->listen[l], cfg->backlog, 1);
+                }
+            }
+            if (fd < 0) {
+                if (shared_fd[l] < 0) {
+                    shared_fd[l] = create_listener(&cfg->listen[l], cfg->backlog, 0);
+                    if (shared_fd[l] < 0) {
+                        return -1;
+                    }
+                }
+                fd = shared_fd[l];
+                exclusive = 1;
+            }
+            if (add_listener(w, fd, exclusive) < 0) {
+                log_message(LOG_ERROR, "Failed to register listener");
+                return -1;
+            }
+        }
+        worker_count++;
+    }
+
+    // Sockets the previous process had beyond our worker count may hold
+    // queued connections; spread them over the workers. Addresses that
+    // are no longer configured are closed.
+    for (int i = 0, next = 0; i < inherited_count; i++) {
+        int keep = 0;
+        if (inherited_fds[i] < 0) {
+            continue;
+        }
+        for (int l = 0; l < cfg->listen_count; l++) {
+            keep |= listener_matches(inherited_fds[i], &cfg->listen[l]);
+        }
+        if (!keep || add_listener(&workers[next++ % worker_count], inherited_fds[i], 0) < 0) {
+            close(inherited_fds[i]);
+        }
+        inherited_fds[i] = -1;
+    }
+
+    atomic_store(&workers_running, worker_count);
+    for (int i = 0; i < worker_count; i++) {
+        struct worker *w = &workers[i];
+        if (pthread_create(&w->thread, NULL, worker_loop, w) != 0) {
+            log_message(LOG_ERROR, "Failed to create worker thread");
+            return -1;
+        }
+
+        // Pin each worker to its own core
+        if (ncpu > 0) {
+            cpu_set_t cpus;
+            CPU_ZERO(&cpus);
+            CPU_SET(i % ncpu, &cpus);
+            pthread_setaffinity_np(w->thread, sizeof(cpus), &cpus);
+        }
+    }
+    return 0;
+}
+
+// Sum one per-worker backend counter; offset selects the field
+uint64_t sum_backend_stat(int slot, size_t offset) {
+    uint64_t total = 0;
+    for (int i = 0; i < worker_count; i++) {
+        char *bs = (char *)&workers[i].stats.backends[slot];
+        total += atomic_load_explicit((_Atomic uint64_t *)(bs + offset), memory_order_relaxed);
+    }
+    return total;
+}
+
+void metrics_backend_counter(FILE *out, const char *name, const char *help, size_t offset) {
+    int slots = atomic_load_explicit(&stat_slot_count, memory_order_acquire);
+
+    fprintf(out, "# HELP %s %s\n# TYPE %s counter\n", name, help, name);
+    for (int i = 0; i < slots; i++) {
+        fprintf(out, "%s{backend=\"%s\"} %llu\n", name, stat_slots[i].host,
+                (unsigned long long)sum_backend_stat(i, offset));
+    }
+}
+
+// Render every metric in the Prometheus text format. Counters are only
+// summed here; the workers never synchronise with a scrape.
+void metrics_render(FILE *out) {
+    int slots = atomic_load_explicit(&stat_slot_count, memory_order_acquire);
+
+    fprintf(out, "# HELP tcp_lb_connections_accepted_total Client connections accepted.\n"
+                 "# TYPE tcp_lb_connections_accepted_total counter\n");
+    for (int i = 0; i < worker_count; i++) {
+        fprintf(out, "tcp_lb_connections_accepted_total{worker=\"%d\"} %llu\n", i,
+                (unsigned long long)atomic_load(&workers[i].stats.accepted));
+    }
+    fprintf(out, "# HELP tcp_lb_connections_active Client connections currently open.\n"
+                 "# TYPE tcp_lb_connections_active gauge\n");
+    for (int i = 0; i < worker_count; i++) {
+        // Read closed first so a racing accept cannot make the gauge negative
+        uint64_t closed = atomic_load(&workers[i].stats.closed);
+        uint64_t accepted = atomic_load(&workers[i].stats.accepted);
+        fprintf(out, "tcp_lb_connections_active{worker=\"%d\"} %llu\n", i,
+                (unsigned long long)(accepted - closed));
+    }
+
+    uint64_t hits = 0, misses = 0;
+    for (int i = 0; i < worker_count; i++) {
+        hits += atomic_load(&workers[i].stats.pool_hits);
+        misses += atomic_load(&workers[i].stats.pool_misses);
+    }
+    fprintf(out, "# HELP tcp_lb_pool_hits_total Sessions paired with a pooled backend connection.\n"
+                 "# TYPE tcp_lb_pool_hits_total counter\ntcp_lb_pool_hits_total %llu\n"
+                 "# HELP tcp_lb_pool_misses_total Sessions that had to connect on demand.\n"
+                 "# TYPE tcp_lb_pool_misses_total counter\ntcp_lb_pool_misses_total %llu\n",
+            (unsigned long long)hits, (unsigned long long)misses);
+
+    uint64_t retries = 0, connect_timeouts = 0, idle_timeouts = 0;
+    for (int i = 0; i < worker_count; i++) {
+        retries += atomic_load(&workers[i].stats.retries);
+        connect_timeouts += atomic_load(&workers[i].stats.connect_timeouts);
+        idle_timeouts += atomic_load(&workers[i].stats.idle_timeouts);
+    }
+    fprintf(out, "# HELP tcp_lb_retries_total Sessions moved to another backend after a failure.\n"
+                 "# TYPE tcp_lb_retries_total counter\ntcp_lb_retries_total %llu\n"
+                 "# HELP tcp_lb_connect_timeouts_total Backend connects that missed their deadline.\n"
+                 "# TYPE tcp_lb_connect_timeouts_total counter\ntcp_lb_connect_timeouts_total %llu\n"
+                 "# HELP tcp_lb_idle_timeouts_total Sessions closed for inactivity.\n"
+                 "# TYPE tcp_lb_idle_timeouts_total counter\ntcp_lb_idle_timeouts_total %llu\n",
+            (unsigned long long)retries, (unsigned long long)connect_timeouts,
+            (unsigned long long)idle_timeouts);
+
+    uint64_t rejected_rate = 0, rejected_limit = 0, rejected_overload = 0;
+    for (int i = 0; i < worker_count; i++) {
+        rejected_rate += atomic_load(&workers[i].stats.rejected_rate);
+        rejected_limit += atomic_load(&workers[i].stats.rejected_limit);
+        rejected_overload += atomic_load(&workers[i].stats.rejected_overload);
+    }
+    fprintf(out, "# HELP tcp_lb_connections_rejected_total Clients reset right after accept.\n"
+                 "# TYPE tcp_lb_connections_rejected_total counter\n"
+                 "tcp_lb_connections_rejected_total{reason=\"client_rate\"} %llu\n"
+                 "tcp_lb_connections_rejected_total{reason=\"max_sessions\"} %llu\n"
+                 "tcp_lb_connections_rejected_total{reason=\"overload\"} %llu\n",
+            (unsigned long long)rejected_rate, (unsigned long long)rejected_limit,
+            (unsigned long long)rejected_overload);
+
+    metrics_backend_counter(out, "tcp_lb_backend_selected_total",
+                            "Sessions assigned to the backend.",
+                            offsetof(struct backend_stats, selected));
+    metrics_backend_counter(out, "tcp_lb_backend_connect_failures_total",
+                            "Failed connects to the backend, including pool connects.",
+                            offsetof(struct backend_stats, connect_failures));
+    metrics_backend_counter(out, "tcp_lb_backend_sent_bytes_total",
+                            "Bytes forwarded from clients to the backend.",
+                            offsetof(struct backend_stats, bytes_sent));
+    metrics_backend_counter(out, "tcp_lb_backend_received_bytes_total",
+                            "Bytes forwarded from the backend to clients.",
+                            offsetof(struct backend_stats, bytes_received));
+
+    fprintf(out, "# HELP tcp_lb_backend_connect_seconds Time to establish a backend connection.\n"
+                 "# TYPE tcp_lb_backend_connect_seconds histogram\n");
+    for (int i = 0; i < slots; i++) {
+        uint64_t cumulative = 0;
+        for (int b = 0; b <= LATENCY_BUCKETS; b++) {
+            cumulative += sum_backend_stat(i, offsetof(struct backend_stats, connect_latency) +
+                                              b * sizeof(_Atomic uint64_t));
+            if (b < LATENCY_BUCKETS) {
+                fprintf(out, "tcp_lb_backend_connect_seconds_bucket{backend=\"%s\",le=\"%g\"} %llu\n",
+                        stat_slots[i].host, latency_bounds_us[b] / 1e6, (unsigned long long)cumulative);
+            } else {
+                fprintf(out, "tcp_lb_backend_connect_seconds_bucket{backend=\"%s\",le=\"+Inf\"} %llu\n",
+                        stat_slots[i].host, (unsigned long long)cumulative);
+            }
+        }
+        fprintf(out, "tcp_lb_backend_connect_seconds_sum{backend=\"%s\"} %.6f\n"
+                     "tcp_lb_backend_connect_seconds_count{backend=\"%s\"} %llu\n",
+                stat_slots[i].host,
+                sum_backend_stat(i, offsetof(struct backend_stats, connect_time_us)) / 1e6,
+                stat_slots[i].host, (unsigned long long)cumulative);
+    }
+
+    // Health and load of the backends in the current configuration
+    pthread_mutex_lock(&backend_mutex);
+    struct lb_config *cfg = current_config;
+    fprintf(out, "# HELP tcp_lb_backend_up Whether the backend passes its health checks.\n"
+                 "# TYPE tcp_lb_backend_up gauge\n");
+    for (int i = 0; i < cfg->backend_count; i++) {
+        fprintf(out, "tcp_lb_backend_up{backend=\"%s\"} %d\n",
+                stat_slots[cfg->backends[i].stat_slot].host, cfg->backends[i].up);
+    }
+    fprintf(out, "# HELP tcp_lb_backend_active_connections Sessions currently using the backend.\n"
+                 "# TYPE tcp_lb_backend_active_connections gauge\n");
+    for (int i = 0; i < cfg->backend_count; i++) {
+        fprintf(out, "tcp_lb_backend_active_connections{backend=\"%s\"} %d\n",
+                stat_slots[cfg->backends[i].stat_slot].host,
+                atomic_load_explicit(&cfg->backends[i].active, memory_order_relaxed));
+    }
+    pthread_mutex_unlock(&backend_mutex);
+}
+
+int send_all(int fd, const char *buf, size_t len) {
+    while (len > 0) {
+        ssize_t n = send(fd, buf, len, MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return -1;
+        }
+        buf += n;
+        len -= n;
+    }
+    return 0;
+}
+
+// Answer one HTTP request; only GET /metrics is served
+void metrics_serve(int fd) {
+    char request[1024], header[256];
+    char *body = NULL;
+    size_t body_len = 0;
+    const char *status = "404 Not Found";
+    struct timeval timeout = {1, 0};
+
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    ssize_t n = recv(fd, request, sizeof(request) - 1, 0);
+    if (n <= 0) {
+        return;
+    }
+    request[n] = '\0';
+
+    if (strncmp(request, "GET /metrics ", 13) == 0) {
+        FILE *out = open_memstream(&body, &body_len);
+        if (!out) {
+            return;
+        }
+        metrics_render(out);
+        fclose(out);
+        status = "200 OK";
+    }
+
+    int len = snprintf(header, sizeof(header),
+                       "HTTP/1.0 %s\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                       "Content-Length: %zu\r\nConnection: close\r\n\r\n", status, body_len);
+    if (send_all(fd, header, len) == 0 && body) {
+        send_all(fd, body, body_len);
+    }
+    free(body);
+}
+
+// Metrics listener; stops when an upgrade hands over to a new binary,
+// whose own listener shares the port through SO_REUSEPORT
+void *metrics_loop(void *arg) {
+    int listener = (int)(long)arg;
+    struct pollfd pfd = {listener, POLLIN, 0};
+
+    while (!atomic_load(&draining)) {
+        if (poll(&pfd, 1, 1000) <= 0) {
+            continue;
+        }
+        int fd = accept4(listener, NULL, NULL, SOCK_CLOEXEC);
+        if (fd < 0) {
+            continue;
+        }
+        metrics_serve(fd);
+        close(fd);
+    }
+    close(listener);
+    return NULL;
+}
+
+void start_metrics(struct lb_config *cfg) {
+    pthread_t thread;
+    int one = 1;
+
+    if (!cfg->metrics_enabled) {
+        return;
+    }
+    int fd = socket(cfg->metrics.sa.sa_family, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) {
+        log_message(LOG_ERROR, "Metrics socket creation failed");
+        return;
+    }
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &one, sizeof(one));
+    if (bind(fd, &cfg->metrics.sa, address_len(&cfg->metrics)) < 0 || listen(fd, 16) < 0) {
+        log_message(LOG_ERROR, "Metrics listener failed on port %d", address_port(&cfg->metrics));
+        close(fd);
+        return;
+    }
+    if (pthread_create(&thread, NULL, metrics_loop, (void *)(long)fd) != 0) {
+        log_message(LOG_ERROR, "Failed to create metrics thread");
+        close(fd);
+        return;
+    }
+    pthread_detach(thread);
+}
+
+// SIGUSR2: exec the binary again with our listening sockets. The new
+// process reports readiness over a pipe; only then does this one stop
+// accepting. Everything the child needs is prepared before fork() since
+// other threads may hold locks at that point.
+void upgrade_binary() {
+    int fds[MAX_WORKERS * MAX_LISTENERS];
+    int fd_count = 0, ready[2], env_count = 0;
+    char fd_list[4096] = "LB_LISTEN_FDS=", ready_env[64], config_env[4200];
+    size_t used = strlen(fd_list);
+
+    if (atomic_load(&draining) || pipe2(ready, O_CLOEXEC) < 0) {
+        return;
+    }
+    for (int i = 0; i < worker_count; i++) {
+        for (int l = 0; l < workers[i].listener_count; l++) {
+            int fd = workers[i].listeners[l].fd, seen = 0;
+            for (int j = 0; j < fd_count; j++) {
+                seen |= (fds[j] == fd);
+            }
+            if (!seen && used < sizeof(fd_list) - 16) {
+                used += snprintf(fd_list + used, sizeof(fd_list) - used, "%s%d",
+                                 fd_count ? "," : "", fd);
+                fds[fd_count++] = fd;
+            }
+        }
+    }
+    snprintf(ready_env, sizeof(ready_env), "LB_READY_FD=%d", ready[1]);
+    snprintf(config_env, sizeof(config_env), "LB_CONFIG_PATH=%s", config_path);
+
+    while (environ[env_count]) {
+        env_count++;
+    }
+    char **envp = calloc(env_count + 4, sizeof(char *));
+    if (!envp) {
+        close(ready[0]);
+        close(ready[1]);
+        return;
+    }
+    env_count = 0;
+    for (char **e = environ; *e; e++) {
+        if (strncmp(*e, "LB_", 3) != 0) {
+            envp[env_count++] = *e;
+        }
+    }
+    envp[env_count++] = fd_list;
+    envp[env_count++] = ready_env;
+    envp[env_count++] = config_env;
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        sigset_t none;
+        sigemptyset(&none);
+        sigprocmask(SIG_SETMASK, &none, NULL);
+        for (int i = 0; i < fd_count; i++) {
+            fcntl(fds[i], F_SETFD, 0);
+        }
+        fcntl(ready[1], F_SETFD, 0);
+        execve(exe_path, saved_argv, envp);
+        _exit(127);
+    }
+    free(envp);
+    close(ready[1]);
+    if (pid < 0) {
+        log_message(LOG_ERROR, "Upgrade failed: fork");
+        close(ready[0]);
+        return;
+    }
+
+    struct pollfd pfd = {ready[0], POLLIN, 0};
+    char ok = 0;
+    if (poll(&pfd, 1, UPGRADE_TIMEOUT) == 1 && read(ready[0], &ok, 1) == 1 && ok == '1') {
+        log_message(LOG_INFO, "New binary is serving, draining this process");
+        atomic_store(&draining, 1);
+        wake_workers();
+    } else {
+        log_message(LOG_ERROR, "Upgrade failed: new binary did not start, still serving");
+    }
+    close(ready[0]);
+}
+
+// Tell the process that started us with SIGUSR2 that we are serving
+void report_ready() {
+    const char *env = getenv("LB_READY_FD");
+    if (env) {
+        int fd = atoi(env);
+        write(fd, "1", 1);
+        close(fd);
+        unsetenv("LB_READY_FD");
+    }
+}
+
+int main(int argc, char *argv[]) {
+    int opt;
+
+    saved_argc = argc;
+    saved_argv = argv;
+    opterr = 0;
+    while ((opt = getopt(argc, argv, "a:c:e:f:i:l:p:r:t:uw:")) != -1) {
+        if (opt == 'c') {
+            config_path = optarg;
+        }
+    }
+    opterr = 1;
+    int config_required = (strcmp(config_path, CONFIG_FILE) != 0);
+
+    ssize_t len = readlink("/proc/self/exe", exe_path, sizeof(exe_path) - 1);
+    exe_path[len > 0 ? len : 0] = '\0';
+
+    // daemonize() changes to /, so reloads need an absolute path. An
+    // upgraded binary is told the path its predecessor resolved.
+    if (getenv("LB_CONFIG_PATH")) {
+        config_path = strdup(getenv("LB_CONFIG_PATH"));
+        unsetenv("LB_CONFIG_PATH");
+    } else {
+        char *resolved = realpath(config_path, NULL);
+        if (resolved) {
+            config_path = resolved;
+        }
+    }
+
+    // Validate before detaching so mistakes are reported on the terminal.
+    // The descriptor limit sizes the default max_sessions.
+    raise_fd_limit();
+    struct lb_config *cfg = build_config(config_required);
+    if (!cfg) {
+        exit(EXIT_FAILURE);
+    }
+
+    parse_inherited_fds();
+
+    // Daemonize the process; an upgraded binary is already detached
+    if (inherited_count == 0) {
+        daemonize();
+    }
+    log_start();
+
+    current_config = cfg;
+    atomic_store(&log_level, cfg->log_level);
+    atomic_store(&log_rate, cfg->log_rate);
+    pthread_mutex_lock(&backend_mutex);
+    swap_healthy_view_locked();
+    pthread_mutex_unlock(&backend_mutex);
+
+    signal(SIGPIPE, SIG_IGN);
+
+    // Control signals are taken synchronously by the main thread only
+    sigset_t control;
+    sigemptyset(&control);
+    sigaddset(&control, SIGHUP);
+    sigaddset(&control, SIGUSR2);
+    pthread_sigmask(SIG_BLOCK, &control, NULL);
+
+    if (start_workers(cfg) < 0) {
+        exit(EXIT_FAILURE);
+    }
+
+    pthread_t health_thread;
+    if (pthread_create(&health_thread, NULL, health_loop, NULL) != 0) {
+        log_message(LOG_ERROR, "Failed to create health check thread");
+    }
+    start_metrics(cfg);
+
+    log_message(LOG_INFO, "Load balancer listening on port %d with %d workers...",
+                address_port(&cfg->listen[0]), worker_count);
+    report_ready();
+
+    long drain_deadline = 0;
+    while (1) {
+        struct timespec tick = {1, 0};
+        int sig = sigtimedwait(&control, NULL, &tick);
+
+        if (sig == SIGHUP) {
+            reload_config();
+        } else if (sig == SIGUSR2) {
+            upgrade_binary();
+        }
+
+        if (atomic_load(&draining)) {
+            if (!drain_deadline) {
+                pthread_mutex_lock(&backend_mutex);
+                drain_deadline = monotonic_ms() + current_config->drain_timeout * 1000L;
+                pthread_mutex_unlock(&backend_mutex);
+            }
+            if (atomic_load(&workers_running) == 0 || monotonic_ms() >= drain_deadline) {
+                log_message(LOG_INFO, "Old process exiting after upgrade");
+                break;
+            }
+        }
     }
 
-    // Close the load balancer socket
-    close(lb_socket);
+    log_shutdown();
 
     return 0;
 }